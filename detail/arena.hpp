@@ -0,0 +1,230 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace grp_prt_detail {
+
+// keeps the large temporary buffers (particle chunk data, sorting) alive between uses,
+// so we do not pay for page faults and mmap/munmap every chunk.
+// The buffers are mapped directly (page aligned, so at least 64-byte aligned), so their memory is returned
+// to the system when the arena is destroyed, and does not stay in the heap
+// where it would count against the memory budget of later runs.
+// If TRANSPARENT_HUGEPAGES is defined, large buffers are aligned to 2MB
+// and the kernel is advised to back them with huge pages.
+class Arena
+{// {{{
+    struct Slot
+    {
+        void *ptr;
+        size_t capacity;
+        bool in_use;
+    };
+
+    std::vector<Slot> slots;
+
+    // buffers are requested from several threads in the prt_loop pipeline
+    std::mutex mtx;
+
+    #ifdef TRANSPARENT_HUGEPAGES
+    static constexpr const size_t hugepage_size = 1UL << 21;
+    #endif // TRANSPARENT_HUGEPAGES
+
+    #ifndef NDEBUG
+    size_t Nallocs = 0UL, Nreuses = 0UL, peak_capacity = 0UL;
+    #endif // NDEBUG
+
+    // capacity is rounded up
+    static void *allocate (size_t &capacity);
+
+    static void deallocate (void *ptr, size_t capacity);
+
+public :
+    Arena () = default;
+    ~Arena ();
+
+    Arena (const Arena &) = delete;
+    Arena &operator= (const Arena &) = delete;
+
+    // returns a buffer of at least bytes bytes, reusing a previously released one if possible
+    void *acquire (size_t bytes);
+
+    // the buffer is kept for later calls to acquire, ptr can be nullptr
+    void release (void *ptr);
+
+    // the total capacity of the buffers that are not in use
+    // (they count towards the resident set size, but will be reused)
+    size_t free_bytes ();
+};// }}}
+
+// ----- Implementation -----
+
+inline
+Arena::~Arena ()
+{// {{{
+    #ifndef NDEBUG
+    std::fprintf(stderr, "Arena : %lu allocations, %lu reuses, peak %.2f MB\n",
+                         Nallocs, Nreuses, (double)peak_capacity / 1024.0 / 1024.0);
+    #endif // NDEBUG
+
+    for (auto &slot : slots)
+    {
+        assert(!slot.in_use);
+        deallocate(slot.ptr, slot.capacity);
+    }
+}// }}}
+
+inline void *
+Arena::allocate (size_t &capacity)
+{// {{{
+    size_t alignment = (size_t)sysconf(_SC_PAGESIZE);
+
+    #ifdef TRANSPARENT_HUGEPAGES
+    if (capacity >= hugepage_size)
+        alignment = hugepage_size;
+    #endif // TRANSPARENT_HUGEPAGES
+
+    capacity = std::max(1UL, (capacity + alignment - 1UL) / alignment) * alignment;
+
+    // mmap only guarantees page alignment, so for huge pages we map more and trim
+    const size_t mapped = capacity + alignment - (size_t)sysconf(_SC_PAGESIZE);
+    void *ptr = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    // (checked in all builds, so running out of memory does not turn into a null dereference,
+    //  and not thrown, since we may be inside an OpenMP region)
+    if (ptr == MAP_FAILED)
+    {
+        std::fprintf(stderr, "Arena : could not allocate %.1f MB (%s)\n",
+                             (double)mapped / 1024.0 / 1024.0, std::strerror(errno));
+        std::abort();
+    }
+
+    const size_t head = (alignment - (uintptr_t)ptr % alignment) % alignment;
+    if (head)
+        munmap(ptr, head);
+    if (mapped - head - capacity)
+        munmap((char *)ptr + head + capacity, mapped - head - capacity);
+    ptr = (char *)ptr + head;
+
+    #ifdef TRANSPARENT_HUGEPAGES
+    if (alignment == hugepage_size)
+        madvise(ptr, capacity, MADV_HUGEPAGE);
+    #endif // TRANSPARENT_HUGEPAGES
+
+    return ptr;
+}// }}}
+
+inline void
+Arena::deallocate (void *ptr, size_t capacity)
+{// {{{
+    munmap(ptr, capacity);
+}// }}}
+
+inline void *
+Arena::acquire (size_t bytes)
+{// {{{
+    std::lock_guard<std::mutex> lock (mtx);
+
+    // the smallest free buffer that is large enough,
+    // and the largest free one that is too small
+    Slot *best = nullptr, *too_small = nullptr;
+    for (auto &slot : slots)
+    {
+        if (slot.in_use)
+            continue;
+
+        if (slot.capacity >= bytes)
+        {
+            if (!best || slot.capacity < best->capacity)
+                best = &slot;
+        }
+        else if (!too_small || slot.capacity > too_small->capacity)
+            too_small = &slot;
+    }
+
+    if (best)
+    {
+        #ifndef NDEBUG
+        ++Nreuses;
+        #endif // NDEBUG
+
+        best->in_use = true;
+        return best->ptr;
+    }
+
+    #ifndef NDEBUG
+    ++Nallocs;
+    #endif // NDEBUG
+
+    // replace a free buffer that has become too small, so the number of buffers stays bounded
+    if (too_small)
+    {
+        deallocate(too_small->ptr, too_small->capacity);
+        too_small->capacity = bytes;
+        too_small->ptr = allocate(too_small->capacity);
+        too_small->in_use = true;
+        best = too_small;
+    }
+    else
+    {
+        Slot slot { nullptr, bytes, true };
+        slot.ptr = allocate(slot.capacity);
+        slots.push_back(slot);
+        best = &slots.back();
+    }
+
+    #ifndef NDEBUG
+    size_t capacity = 0UL;
+    for (const auto &slot : slots)
+        capacity += slot.capacity;
+    peak_capacity = std::max(peak_capacity, capacity);
+    #endif // NDEBUG
+
+    return best->ptr;
+}// }}}
+
+inline void
+Arena::release (void *ptr)
+{// {{{
+    if (!ptr) return;
+
+    std::lock_guard<std::mutex> lock (mtx);
+
+    for (auto &slot : slots)
+        if (slot.ptr == ptr)
+        {
+            assert(slot.in_use);
+            slot.in_use = false;
+            return;
+        }
+
+    assert(false);
+}// }}}
+
+inline size_t
+Arena::free_bytes ()
+{// {{{
+    std::lock_guard<std::mutex> lock (mtx);
+
+    size_t out = 0UL;
+    for (const auto &slot : slots)
+        if (!slot.in_use)
+            out += slot.capacity;
+    return out;
+}// }}}
+
+} // namespace grp_prt_detail
+
+#endif // ARENA_HPP
@@ -0,0 +1,88 @@
+#ifndef BOUNDED_QUEUE_HPP
+#define BOUNDED_QUEUE_HPP
+
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+namespace grp_prt_detail {
+
+// simple thread safe FIFO queue with a maximum number of items,
+// used to pass particle chunks between the stages of the pipeline
+template<typename T>
+class BoundedQueue
+{// {{{
+    const size_t capacity;
+    std::deque<T> items;
+    bool closed = false;
+
+    std::mutex mtx;
+    std::condition_variable not_full, not_empty;
+
+public :
+    BoundedQueue (size_t capacity_);
+    BoundedQueue () = delete;
+
+    // blocks while the queue is full
+    void push (const T &item);
+
+    // blocks while the queue is empty,
+    // returns false if the queue is empty and has been closed
+    bool pop (T &item);
+
+    // no more items will be pushed
+    void close ();
+};// }}}
+
+// ----- Implementation -----
+
+template<typename T>
+BoundedQueue<T>::BoundedQueue (size_t capacity_) :
+    capacity { capacity_ }
+{ }
+
+template<typename T>
+void
+BoundedQueue<T>::push (const T &item)
+{// {{{
+    {
+        std::unique_lock<std::mutex> lock (mtx);
+        not_full.wait(lock, [this](){ return items.size() < capacity; });
+        items.push_back(item);
+    }
+    not_empty.notify_one();
+}// }}}
+
+template<typename T>
+bool
+BoundedQueue<T>::pop (T &item)
+{// {{{
+    {
+        std::unique_lock<std::mutex> lock (mtx);
+        not_empty.wait(lock, [this](){ return !items.empty() || closed; });
+
+        if (items.empty())
+            return false;
+
+        item = items.front();
+        items.pop_front();
+    }
+    not_full.notify_one();
+    return true;
+}// }}}
+
+template<typename T>
+void
+BoundedQueue<T>::close ()
+{// {{{
+    {
+        std::lock_guard<std::mutex> lock (mtx);
+        closed = true;
+    }
+    not_empty.notify_all();
+}// }}}
+
+} // namespace grp_prt_detail
+
+#endif // BOUNDED_QUEUE_HPP
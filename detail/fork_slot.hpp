@@ -0,0 +1,166 @@
+#ifndef FORK_SLOT_HPP
+#define FORK_SLOT_HPP
+
+#include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include <algorithm>
+
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+namespace grp_prt_detail {
+
+// shared memory through which a worker process sends the per-group data
+// of its particle chunks to the parent.
+// Only one message piece is in flight at a time, larger messages are split.
+class ForkSlot
+{// {{{
+    struct Header
+    {
+        sem_t full, empty;
+        size_t chunk_idx;   // chunk this message belongs to
+        size_t size;        // total size of the message
+        size_t piece;       // size of the piece currently in the buffer
+        bool end;           // worker has no more chunks
+    };
+
+    const size_t capacity;
+    void *mem;
+
+    Header &header () { return *(Header *)mem; }
+    char *buffer () { return (char *)mem + sizeof(Header); }
+
+    // waits for the semaphore, aborting if the worker process has died
+    void wait_worker (sem_t &sem, pid_t worker);
+
+public :
+    ForkSlot (size_t capacity_);
+    ~ForkSlot ();
+
+    ForkSlot (const ForkSlot &) = delete;
+    ForkSlot &operator= (const ForkSlot &) = delete;
+
+    // called by the worker process
+    void send (size_t chunk_idx, const std::vector<char> &buf);
+    void send_end ();
+
+    // called by the parent process,
+    // returns false if the worker has no more chunks
+    bool recv (pid_t worker, size_t &chunk_idx, std::vector<char> &buf);
+};// }}}
+
+// ----- Implementation -----
+
+inline
+ForkSlot::ForkSlot (size_t capacity_) :
+    capacity { capacity_ }
+{// {{{
+    mem = mmap(nullptr, sizeof(Header) + capacity, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (mem == MAP_FAILED)
+    {
+        std::fprintf(stderr, "ForkSlot : could not map %lu bytes of shared memory (%s)\n",
+                             sizeof(Header) + capacity, std::strerror(errno));
+        std::abort();
+    }
+
+    sem_init(&header().full, 1, 0);
+    sem_init(&header().empty, 1, 1);
+}// }}}
+
+inline
+ForkSlot::~ForkSlot ()
+{// {{{
+    sem_destroy(&header().full);
+    sem_destroy(&header().empty);
+    munmap(mem, sizeof(Header) + capacity);
+}// }}}
+
+inline void
+ForkSlot::wait_worker (sem_t &sem, pid_t worker)
+{// {{{
+    while (true)
+    {
+        timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+
+        if (!sem_timedwait(&sem, &deadline))
+            return;
+
+        if (errno != ETIMEDOUT && errno != EINTR)
+            break;
+
+        int status;
+        if (waitpid(worker, &status, WNOHANG) == worker)
+            break;
+    }
+
+    std::fprintf(stderr, "ForkSlot : worker process %d terminated unexpectedly\n", (int)worker);
+    std::abort();
+}// }}}
+
+inline void
+ForkSlot::send (size_t chunk_idx, const std::vector<char> &buf)
+{// {{{
+    size_t offset = 0UL;
+    do
+    {
+        while (sem_wait(&header().empty)) assert(errno == EINTR);
+
+        header().chunk_idx = chunk_idx;
+        header().size      = buf.size();
+        header().piece     = std::min(capacity, buf.size()-offset);
+        header().end       = false;
+        std::memcpy(buffer(), buf.data()+offset, header().piece);
+        offset += header().piece;
+
+        sem_post(&header().full);
+    } while (offset < buf.size());
+}// }}}
+
+inline void
+ForkSlot::send_end ()
+{// {{{
+    while (sem_wait(&header().empty)) assert(errno == EINTR);
+    header().end = true;
+    sem_post(&header().full);
+}// }}}
+
+inline bool
+ForkSlot::recv (pid_t worker, size_t &chunk_idx, std::vector<char> &buf)
+{// {{{
+    size_t offset = 0UL;
+    do
+    {
+        wait_worker(header().full, worker);
+
+        if (header().end)
+        {
+            // do not post empty, the worker does not send anymore
+            return false;
+        }
+
+        chunk_idx = header().chunk_idx;
+        buf.resize(header().size);
+        std::memcpy(buf.data()+offset, buffer(), header().piece);
+        offset += header().piece;
+
+        sem_post(&header().empty);
+    } while (offset < buf.size());
+
+    return true;
+}// }}}
+
+} // namespace grp_prt_detail
+
+#endif // FORK_SLOT_HPP
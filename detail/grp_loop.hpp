@@ -1,9 +1,12 @@
 #ifndef GRP_LOOP_HPP
 #define GRP_LOOP_HPP
 
+#include <cassert>
 #include <memory>
-#include <cstring>
+#include <vector>
+#include <algorithm>
 #include <cstdio>
+#include <cstdint>
 
 #include "H5Cpp.h"
 
@@ -14,9 +17,9 @@
 
 namespace grp_prt_detail {
 
-template<typename AFields>
+template<typename AFields, typename CB>
 void
-Workspace<AFields>::grp_loop ()
+Workspace<AFields, CB>::grp_loop ()
 {
     #ifndef NDEBUG
     std::fprintf(stderr, "Started Workspace::grp_loop ...\n");
@@ -25,8 +28,12 @@ Workspace<AFields>::grp_loop ()
     // the file name for the current chunk will be written here
     std::string fname;
 
-    // loop until the callback function returns false
-    for (size_t chunk_idx=0; callback.grp_chunk(chunk_idx, fname); ++chunk_idx)
+    // reads the groups from a file into the temporary storage and converts their coordinates,
+    // returns the number of groups
+    #ifdef PRECISE_COORDS
+    std::vector<coord_t> coord_residuals;
+    #endif // PRECISE_COORDS
+    auto read_file = [&, this](size_t chunk_idx) -> size_t
     {
         // open the hdf5 file
         auto fptr = std::make_shared<H5::H5File>(fname, H5F_ACC_RDONLY);
@@ -35,7 +42,7 @@ Workspace<AFields>::grp_loop ()
         size_t Ngrp_this_file;
         callback.read_grp_meta(chunk_idx, fptr, Ngrp_this_file);
 
-        if (!Ngrp_this_file) continue;
+        if (!Ngrp_this_file) return 0UL;
 
         // allocate storage
         realloc_tmp_storage<typename AFields::GroupFields>(Ngrp_this_file, tmp_grp_properties);
@@ -47,42 +54,113 @@ Workspace<AFields>::grp_loop ()
         fptr->close();
 
         // convert coordinates to global type
+        #ifdef PRECISE_COORDS
+        coord_residuals.resize(3UL * Ngrp_this_file);
+        AFields::GroupFields::convert_coords(Ngrp_this_file, tmp_grp_properties[0],
+                                             1, coord_residuals.data());
+        #else // PRECISE_COORDS
         AFields::GroupFields::convert_coords(Ngrp_this_file, tmp_grp_properties[0]);
+        #endif // PRECISE_COORDS
+
+        return Ngrp_this_file;
+    };
+
+    // first pass over the files : only the selection, so the permanent storage
+    // can be allocated once for exactly the selected groups.
+    // The group files are read twice, but they are small compared to the particle files.
+    // For each file, whether its groups are selected (the result of Callback::grp_select_bulk
+    // or Callback::grp_select), and how many are
+    std::vector<std::vector<uint8_t>> selected_mask;
+    std::vector<size_t> Nselected;
+    size_t Ngrp_selected = 0UL;
+    for (size_t chunk_idx=0; callback.grp_chunk(chunk_idx, fname); ++chunk_idx)
+    {
+        const size_t Ngrp_this_file = read_file(chunk_idx);
+
+        std::vector<uint8_t> &mask = selected_mask.emplace_back(Ngrp_this_file, 1);
+
+        // let the user select all groups at once if they want
+        if (callback.grp_select_is_bulk())
+        {
+            if (Ngrp_this_file)
+                callback.grp_select_bulk(Ngrp_this_file, tmp_grp_properties, mask.data());
+        }
+        else
+        {
+            typename Callback<AFields>::GrpProperties grp (chunk_idx, tmp_grp_properties);
+            for (size_t grp_idx=0; grp_idx != Ngrp_this_file; ++grp_idx, grp.advance())
+                mask[grp_idx] = callback.grp_select(grp);
+        }
+
+        Nselected.push_back(std::count_if(mask.begin(), mask.end(), [](uint8_t m){ return m != 0; }));
+        Ngrp_selected += Nselected.back();
+    }
+
+    // with no selected groups, anything left from a previous call is released
+    alloced_grp = Ngrp_selected;
+    realloc_grp_storage(alloced_grp);
+
+    // the groups selected from the current file and their radii
+    // (and apertures, if there are several)
+    std::vector<size_t> selected;
+    std::vector<coord_t> radii;
+    std::vector<coord_t> apertures;
+
+    // second pass : the selected groups are passed to the user and stored
+    for (size_t chunk_idx=0; chunk_idx != selected_mask.size(); ++chunk_idx)
+    {
+        if (!Nselected[chunk_idx]) continue;
+
+        callback.grp_chunk(chunk_idx, fname);
+        read_file(chunk_idx);
 
-        typename Callback<AFields>::GrpProperties grp (chunk_idx, tmp_grp_properties);
+        const std::vector<uint8_t> &mask = selected_mask[chunk_idx];
+        selected.clear();
+        selected.reserve(Nselected[chunk_idx]);
+        for (size_t grp_idx=0; grp_idx != mask.size(); ++grp_idx)
+            if (mask[grp_idx])
+                selected.push_back(grp_idx);
 
-        // now loop over groups to see which ones belong into permanent storage
-        for (size_t grp_idx=0; grp_idx != Ngrp_this_file; ++grp_idx, grp.advance())
-            if (callback.grp_select(grp))
+        radii.resize(selected.size());
+        apertures.resize((grp_Napertures > 1UL) ? grp_Napertures * selected.size() : 0UL);
+
+        for (size_t ii=0; ii != selected.size(); ++ii)
+        {
+            typename Callback<AFields>::GrpProperties grp (chunk_idx, tmp_grp_properties, selected[ii]);
+
+            // let the user do some stuff
+            callback.grp_action(grp);
+
+            if (grp_Napertures > 1UL)
             {
-                realloc_grp_storage_if_necessary ();
-
-                // let the user do some stuff
-                callback.grp_action(grp);
-                
-                // compute group radius
-                grp_radii[Ngrp]    = callback.grp_radius(grp);
-                grp_radii_sq[Ngrp] = grp_radii[Ngrp] * grp_radii[Ngrp];
-
-                // copy properties into permanent storage
-                for (size_t ii=0; ii != AFields::GroupFields::Nfields; ++ii)
-                    std::memcpy((char *)(grp_properties[ii]) + Ngrp * AFields::GroupFields::strides_fcoord[ii],
-                                grp[ii], AFields::GroupFields::strides_fcoord[ii]);
-                
-                // advance the counter
-                ++Ngrp;
+                // the largest aperture is the radius
+                coord_t *R = apertures.data() + ii * grp_Napertures;
+                callback.grp_apertures(grp, R);
+                assert(std::is_sorted(R, R + grp_Napertures));
+                radii[ii] = R[grp_Napertures-1UL];
             }
+            else
+                radii[ii] = callback.grp_radius(grp);
+        }
+
+        // copy them
+        #ifdef PRECISE_COORDS
+        store_grps(tmp_grp_properties, selected, radii, apertures, coord_residuals.data());
+        #else // PRECISE_COORDS
+        store_grps(tmp_grp_properties, selected, radii, apertures, nullptr);
+        #endif // PRECISE_COORDS
 
         #ifndef NDEBUG
         std::fprintf(stderr, "In Workspace::grp_loop : did %lu chunks.\n", chunk_idx+1UL);
         #endif // NDEBUG
     }// for chunk_idx
 
-    // save memory by shrinking the temporary buffers
-    realloc_tmp_storage<typename AFields::GroupFields>(1, tmp_grp_properties);
+    // the temporary buffers can be reused for the particles
+    free_tmp_storage<typename AFields::GroupFields>(tmp_grp_properties);
+
+    assert(Ngrp == alloced_grp);
 
-    // save memory by reallocating the perhaps too large buffers
-    shrink_grp_storage();
+    report_rss("grp_loop");
 
     #ifndef NDEBUG
     std::fprintf(stderr, "Ended Workspace::grp_loop, %lu groups loaded.\n", Ngrp);
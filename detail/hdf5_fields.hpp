@@ -2,9 +2,11 @@
 #define HDF5_FIELDS_HPP
 
 #include <cassert>
+#include <cstring>
 #include <memory>
 #include <string>
 #include <cstddef>
+#include <algorithm>
 
 #include "H5Cpp.h"
 
@@ -15,12 +17,13 @@ namespace grp_prt_detail {
 
 namespace hdf5Utils {
 
-// It is assumed that data is already allocated storage of the required size
+// It is assumed that data is already allocated storage of the required size.
+// Reads the items [first, first+Nitems)
 static void
 read_field (std::shared_ptr<H5::H5File> fptr, const std::string &name,
             // these are only for debugging purposes
             size_t element_size, size_t Nitems, size_t dim,
-            void * data)
+            void * data, size_t first=0UL)
 {// {{{
     auto dset   = fptr->openDataSet(name);
     auto dspace = dset.getSpace();
@@ -31,35 +34,58 @@ read_field (std::shared_ptr<H5::H5File> fptr, const std::string &name,
 
     // some easy consistency checks
     assert(Dtype.getSize() == element_size);
-    assert(Nitems == dim_lengths[0]);
+    assert(first + Nitems <= dim_lengths[0]);
     assert((Ndims==1 && dim==1) || (Ndims==2 && dim_lengths[1]==dim));
 
+    // select the rows we want
+    hsize_t start[16] = { (hsize_t)first }, count[16];
+    std::copy(dim_lengths, dim_lengths+Ndims, count);
+    count[0] = Nitems;
+    dspace.selectHyperslab(H5S_SELECT_SET, count, start);
+
     // read into memory
-    auto memspace = H5::DataSpace(Ndims, dim_lengths);
+    auto memspace = H5::DataSpace(Ndims, count);
     dset.read(data, Dtype, memspace, dspace);
 }// }}}
 
 // it is assumed that data is already of the correct size
 // and the individual pointers are already allocated
 // T is one of GroupFields, ParticleFields
+// Reads the items [first, first+Nitems) of particle type type_idx
+// (if there are several types, fields missing for a type are zero-filled)
 template<typename AFields, typename T>
 static void
 read_fields (const Callback<AFields> &callback,
-             std::shared_ptr<H5::H5File> fptr, size_t Nitems, void **data)
+             std::shared_ptr<H5::H5File> fptr, size_t Nitems, void **data,
+             size_t first=0UL, size_t type_idx=0UL)
 {// {{{
     // where to find our data sets in the hdf5 file
     std::string name_prefix;
+    bool allow_missing = false;
     if constexpr (T::field_type == FieldTypes::GrpFld)
         name_prefix = callback.grp_name();
     else
-        name_prefix = callback.prt_name();
+    {
+        name_prefix = callback.prt_type_name(type_idx);
+        allow_missing = callback.prt_types() > 1UL;
+    }
 
     // loop over the fields
     for (size_t ii=0; ii != T::Nfields; ++ii)
+    {
+        const std::string name = name_prefix + T::names[ii];
+
+        if (allow_missing && H5Lexists(fptr->getId(), name.c_str(), H5P_DEFAULT) <= 0)
+        {
+            std::memset(data[ii], 0, Nitems * T::sizes[ii] * T::dims[ii]);
+            continue;
+        }
+
         // read from disk
-        read_field(fptr, name_prefix + T::names[ii],
+        read_field(fptr, name,
                    T::sizes[ii], Nitems, T::dims[ii],
-                   data[ii]);
+                   data[ii], first);
+    }
 }// }}}
 
 } // namespace hdf5Utils
@@ -0,0 +1,69 @@
+#ifndef MPI_REDUCE_HPP
+#define MPI_REDUCE_HPP
+
+#include <cassert>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+#include "mpi.h"
+
+#include "callback.hpp"
+
+namespace grp_prt_detail {
+
+// MPI message sizes are int, so we send the serialized data in pieces of this size
+static constexpr const size_t mpi_max_msg = 1UL << 30;
+
+// combines the per-group data of all ranks on rank 0 in a binary tree :
+// in step k, rank r with r % 2^(k+1) == 2^k sends its data to rank r - 2^k, which merges it.
+// So there are log2(Nranks) steps, and the order of the merges is fixed so the result is deterministic.
+template<typename AFields>
+void
+mpi_reduce_grp_state (Callback<AFields> &callback, MPI_Comm comm)
+{// {{{
+    int rank, Nranks;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &Nranks);
+
+    std::vector<char> buf;
+
+    for (int step=1; step < Nranks; step *= 2)
+    {
+        if (rank % (2*step) == step)
+        {
+            // grp_state_pack appends
+            buf.clear();
+            callback.grp_state_pack(buf);
+
+            uint64_t size = buf.size();
+            MPI_Send(&size, 1, MPI_UINT64_T, rank-step, 0, comm);
+
+            for (size_t offset=0UL; offset < buf.size(); offset += mpi_max_msg)
+                MPI_Send(buf.data()+offset, (int)std::min(mpi_max_msg, buf.size()-offset),
+                         MPI_BYTE, rank-step, 0, comm);
+
+            // our data is now part of the sum
+            return;
+        }
+
+        if (rank % (2*step) == 0 && rank + step < Nranks)
+        {
+            const int src = rank + step;
+
+            uint64_t size;
+            MPI_Recv(&size, 1, MPI_UINT64_T, src, 0, comm, MPI_STATUS_IGNORE);
+
+            buf.resize(size);
+            for (size_t offset=0UL; offset < buf.size(); offset += mpi_max_msg)
+                MPI_Recv(buf.data()+offset, (int)std::min(mpi_max_msg, buf.size()-offset),
+                         MPI_BYTE, src, 0, comm, MPI_STATUS_IGNORE);
+
+            callback.grp_state_merge(buf.data());
+        }
+    }
+}// }}}
+
+} // namespace grp_prt_detail
+
+#endif // MPI_REDUCE_HPP
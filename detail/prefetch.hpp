@@ -0,0 +1,41 @@
+#ifndef PREFETCH_HPP
+#define PREFETCH_HPP
+
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "callback.hpp"
+
+namespace grp_prt_detail {
+
+// asks the kernel to read the file into the page cache, so a later run
+// finds it there. This is only a hint, so errors are ignored.
+inline void
+prefetch_file (const std::string &fname)
+{// {{{
+    const int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) return;
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+}// }}}
+
+// all group and particle files of a run
+template<typename AFields>
+void
+prefetch_files (const Callback<AFields> &callback)
+{// {{{
+    std::string fname;
+
+    for (size_t chunk_idx=0; callback.grp_chunk(chunk_idx, fname); ++chunk_idx)
+        prefetch_file(fname);
+
+    for (size_t chunk_idx=0; callback.prt_chunk(chunk_idx, fname); ++chunk_idx)
+        prefetch_file(fname);
+}// }}}
+
+} // namespace grp_prt_detail
+
+#endif // PREFETCH_HPP
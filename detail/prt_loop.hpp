@@ -4,11 +4,21 @@
 #include <algorithm>
 #include <cmath>
 #include <cstdio>
+#include <cstring>
 #include <iterator>
-#include <sys/resource.h>
 #include <tuple>
 #include <array>
 #include <string>
+#include <vector>
+#include <limits>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <type_traits>
+
+#ifdef _OPENMP
+#   include <omp.h>
+#endif // _OPENMP
 
 #include "callback.hpp"
 #include "fields.hpp"
@@ -17,130 +27,765 @@
 #include "workspace_memory.hpp"
 #include "workspace_sorting.hpp"
 #include "geom_utils.hpp"
+#include "bounded_queue.hpp"
+#include "task_pool.hpp"
 #include "timing.hpp"
+#include "rss.hpp"
 
 namespace grp_prt_detail {
 
-template<typename AFields>
+// number of threads available to the parallel regions in the particle loop
+static inline int
+prt_loop_max_threads ()
+{// {{{
+    #ifdef _OPENMP
+    return omp_get_max_threads();
+    #else // _OPENMP
+    return 1;
+    #endif // _OPENMP
+}// }}}
+
+// index of the calling thread inside a parallel region
+static inline int
+prt_loop_thread_num ()
+{// {{{
+    #ifdef _OPENMP
+    return omp_get_thread_num();
+    #else // _OPENMP
+    return 0;
+    #endif // _OPENMP
+}// }}}
+
+#ifndef NDEBUG
+// prints max/mean of the time the threads spent in the group loop,
+// the mean being taken over the Nthreads threads that could work on it
+static inline void
+prt_loop_report_imbalance (const std::vector<double> &thread_busy, size_t Nthreads)
+{// {{{
+    double busy_max = 0.0, busy_sum = 0.0;
+    for (auto t : thread_busy)
+    {
+        busy_max = std::max(busy_max, t);
+        busy_sum += t;
+    }
+    std::fprintf(stderr, "\tLoad imbalance in group loop : max/mean thread time = %.3f "
+                         "(%lu threads)\n",
+                         (busy_sum > 0.0) ? busy_max * Nthreads / busy_sum : 1.0,
+                         Nthreads);
+}// }}}
+#endif // NDEBUG
+
+// sets the number of threads used by parallel regions started from the calling thread
+static inline void
+prt_loop_set_threads (int Nthreads)
+{// {{{
+    #ifndef NO_WORK_STEALING
+    TaskPool::set_max_threads((size_t)Nthreads);
+    #endif // NO_WORK_STEALING
+
+    #ifdef _OPENMP
+    omp_set_num_threads(Nthreads);
+    #endif // _OPENMP
+}// }}}
+
+// undoes prt_loop_set_threads, Nthreads is the value of prt_loop_max_threads before
+static inline void
+prt_loop_reset_threads (int Nthreads)
+{// {{{
+    #ifndef NO_WORK_STEALING
+    TaskPool::set_max_threads(0UL);
+    #endif // NO_WORK_STEALING
+
+    #ifdef _OPENMP
+    omp_set_num_threads(Nthreads);
+    #endif // _OPENMP
+}// }}}
+
+template<typename AFields, typename CB>
+void
+Workspace<AFields, CB>::prt_shard (size_t shard_idx, size_t Nshards)
+{// {{{
+    assert(shard_idx < Nshards);
+    prt_shard_idx = shard_idx;
+    prt_Nshards   = Nshards;
+}// }}}
+
+template<typename AFields, typename CB>
+void
+Workspace<AFields, CB>::memory_budget (size_t bytes)
+{// {{{
+    mem_budget = bytes;
+    if (!bytes)
+        return;
+
+    // the arena's buffers from earlier runs (group_particles_batch) will be reused
+    // for our chunks, so they are not part of the baseline
+    const size_t rss = current_rss();
+    mem_baseline = rss - std::min(rss, arena.free_bytes());
+}// }}}
+
+template<typename AFields, typename CB>
+size_t
+Workspace<AFields, CB>::grp_footprint () const
+{// {{{
+    size_t per_grp = sizeof(coord_t) + sizeof(GrpQuery); // radius, query data
+    if (grp_Napertures > 1UL)
+        per_grp += grp_Napertures * sizeof(coord_t);
+    for (size_t ii=0; ii != AFields::GroupFields::Nfields; ++ii)
+        per_grp += AFields::GroupFields::strides_fcoord[ii];
+
+    #ifdef PRECISE_COORDS
+    per_grp += 3UL * sizeof(coord_t);
+    #endif // PRECISE_COORDS
+
+    return alloced_grp * per_grp;
+}// }}}
+
+template<typename AFields, typename CB>
+size_t
+Workspace<AFields, CB>::prt_footprint (size_t Nprt, bool inplace) const
+{// {{{
+    // the buffers are large enough to convert the coordinates in place
+    size_t out = 0UL;
+    for (size_t ii=0; ii != AFields::ParticleFields::Nfields; ++ii)
+        out += Nprt * std::max(AFields::ParticleFields::strides[ii],
+                               AFields::ParticleFields::strides_fcoord[ii]);
+
+    #ifndef NAIVE
+    out += Sorting::footprint(Nprt, inplace);
+    #endif // NAIVE
+
+    return out;
+}// }}}
+
+template<typename AFields, typename CB>
+void
+Workspace<AFields, CB>::prt_plan_chunk (size_t Nprt_file, PrtChunk &chunk) const
+{// {{{
+    chunk.Nsub = 1UL;
+
+    #ifdef INPLACE_PERMUTATION
+    chunk.inplace = true;
+    #else // INPLACE_PERMUTATION
+    chunk.inplace = false;
+    #endif // INPLACE_PERMUTATION
+
+    if (!mem_budget) return;
+
+    // in the pipeline, several chunks are in memory at the same time
+    const size_t Nchunks = callback.prt_pipeline() ? prt_pipeline_depth : 1UL;
+    const size_t used = mem_baseline + grp_footprint();
+    const size_t available = (mem_budget > used) ? (mem_budget - used) / Nchunks : 0UL;
+
+    auto fits = [this, Nprt_file, available](size_t Nsub, bool inplace)
+                { return prt_footprint((Nprt_file + Nsub - 1UL) / Nsub, inplace) <= available; };
+
+    // first we try to keep the faster out-of-place sorting,
+    // then to process the file in one go
+    if (!chunk.inplace && fits(1UL, false))
+        return;
+
+    chunk.inplace = true;
+
+    while (!fits(chunk.Nsub, true) && Nprt_file / (chunk.Nsub+1UL) >= prt_sub_min)
+        ++chunk.Nsub;
+
+    // warn only once per file
+    if (!fits(chunk.Nsub, true) && !chunk.sub_idx)
+        std::fprintf(stderr, "group_particles : WARNING memory budget of %.1f MB cannot be met "
+                             "for particle chunk %lu (predicted %.1f MB)\n",
+                             (double)mem_budget / 1024.0 / 1024.0, chunk.chunk_idx+1UL,
+                             (double)(used + Nchunks * prt_footprint((Nprt_file + chunk.Nsub - 1UL) / chunk.Nsub, true))
+                             / 1024.0 / 1024.0);
+}// }}}
+
+template<typename AFields, typename CB>
+void
+Workspace<AFields, CB>::report_rss (const std::string &phase) const
+{// {{{
+    #ifdef NDEBUG
+    if (!mem_budget) return;
+    #endif // NDEBUG
+
+    // not the peak, which would stay at its largest value for all later phases
+    const size_t rss = current_rss();
+
+    std::fprintf(stderr, "RSS after %s : %.1f MB", phase.c_str(), (double)rss / 1024.0 / 1024.0);
+
+    if (mem_budget)
+        std::fprintf(stderr, " (budget %.1f MB%s)", (double)mem_budget / 1024.0 / 1024.0,
+                             (rss > mem_budget) ? ", EXCEEDED" : "");
+
+    std::fprintf(stderr, "\n");
+}// }}}
+
+template<typename AFields, typename CB>
+std::string
+Workspace<AFields, CB>::prt_chunk_str (const PrtChunk &chunk) const
+{// {{{
+    return "chunk " + std::to_string(chunk.chunk_idx+1UL)
+           + ((prt_Ntypes > 1UL) ? " (type " + std::to_string(chunk.type_idx) + ")" : "")
+           + " (part " + std::to_string(chunk.sub_idx+1UL) + "/" + std::to_string(chunk.Nsub) + ")";
+}// }}}
+
+template<typename AFields, typename CB>
 void
-Workspace<AFields>::prt_loop ()
+Workspace<AFields, CB>::prt_loop ()
 {// {{{
     #ifndef NDEBUG
     std::fprintf(stderr, "Started Workspace::prt_loop ...\n");
     #endif // NDEBUG
-    
-    // the file name for the current chunk will be written here
-    std::string fname;
 
+    if (callback.prt_multipass())
+        prt_loop_multipass();
+    else if (callback.prt_pipeline())
+        prt_loop_pipeline();
+    else
+        prt_loop_serial();
+
+    report_rss("prt_loop");
+}// }}}
+
+template<typename AFields, typename CB>
+void
+Workspace<AFields, CB>::prt_loop_serial ()
+{// {{{
     // loop until the callback function returns false
-    for (size_t chunk_idx=0; callback.prt_chunk(chunk_idx, fname); ++chunk_idx)
+    for (size_t chunk_idx=0; prt_loop_chunk(chunk_idx); ++chunk_idx)
     {
         #ifndef NDEBUG
-        TIME_PT(t1);
+        std::fprintf(stderr, "In Workspace::prt_loop : did %lu chunks.\n", chunk_idx+1UL);
         #endif // NDEBUG
+    }
+}// }}}
 
-        // open the hdf5 file
-        auto fptr = std::make_shared<H5::H5File>(fname, H5F_ACC_RDONLY);
+template<typename AFields, typename CB>
+bool
+Workspace<AFields, CB>::prt_loop_chunk (size_t chunk_idx)
+{// {{{
+    // each particle type is sorted and queried on its own
+    for (size_t type_idx=0; type_idx != prt_Ntypes; ++type_idx)
+    for (size_t sub_idx=0; ; ++sub_idx)
+    {
+        // on the heap, since the sorted data refers to it and may be kept
+        auto chunk_ptr = std::make_unique<PrtChunk>();
+        PrtChunk &chunk = *chunk_ptr;
 
-        // read metadata
-        size_t Nprt_this_file;
-        coord_t Bsize_this_file;
-        callback.read_prt_meta(chunk_idx, fptr, Bsize_this_file, Nprt_this_file);
+        if (!prt_read_chunk(chunk_idx, type_idx, sub_idx, chunk))
+            return false;
 
-        Bsize_this_file *= callback.prt_coord_rescale();
+        if (chunk.Nprt)
+        {
+            #ifndef NDEBUG
+            TIME_PT(t1);
+            #endif // NDEBUG
 
-        if (chunk_idx==0)
-            Bsize = Bsize_this_file;
-        else
-            assert(std::fabs(Bsize/Bsize_this_file - 1.0F) < 1e-5F);
+            prt_prepare_chunk(chunk);
+            prt_sort_chunk(chunk);
+            prt_query_chunk(chunk);
 
-        if (!Nprt_this_file) continue;
+            // save memory
+            if (prt_keep_resident)
+                prt_resident.push_back(std::move(chunk_ptr));
+            else
+                prt_free_chunk(chunk);
 
-        // allocate storage
-        #ifndef NDEBUG
-        TIME_PT(t2);
-        #endif // NDEBUG
-        realloc_tmp_storage<typename AFields::ParticleFields>(Nprt_this_file, tmp_prt_properties);
-        #ifndef NDEBUG
-        TIME_MSG(t2, "prt_loop memory allocation for particle chunk data");
-        #endif // NDEBUG
+            #ifndef NDEBUG
+            TIME_MSG(t1, "chunk %lu (type %lu, part %lu/%lu) in Workspace::prt_loop (excluding reading)",
+                         chunk_idx+1UL, type_idx, sub_idx+1UL, chunk.Nsub);
+            #endif // NDEBUG
 
-        // read the file data
-        #ifndef NDEBUG
-        TIME_PT(t3);
-        #endif // NDEBUG
-        hdf5Utils::read_fields<AFields, typename AFields::ParticleFields>(callback, fptr, Nprt_this_file,
-                                                                          tmp_prt_properties);
-        #ifndef NDEBUG
-        TIME_MSG(t3, "prt_loop read_fields for particle chunk data");
-        #endif // NDEBUG
+            report_rss(prt_chunk_str(chunk));
+        }
 
-        // file not needed anymore
-        fptr->close();
+        if (sub_idx+1UL >= chunk.Nsub)
+            break;
+    }
 
-        // convert the particle coordinates
-        #ifndef NDEBUG
-        TIME_PT(t4);
-        #endif // NDEBUG
-        AFields::ParticleFields::convert_coords(Nprt_this_file, tmp_prt_properties[0],
-                                                callback.prt_coord_rescale());
-        #ifndef NDEBUG
-        TIME_MSG(t4, "prt_loop convert coords");
-        #endif // NDEBUG
-        
-        // if requested, modify the particle
+    return true;
+}// }}}
+
+template<typename AFields, typename CB>
+void
+Workspace<AFields, CB>::prt_loop_multipass ()
+{// {{{
+    // the first pass reads and sorts the chunks
+    prt_keep_resident = true;
+    prt_loop_serial();
+    prt_keep_resident = false;
+
+    for (size_t pass_idx=0; callback.pass_end(pass_idx); ++pass_idx)
+    {
         #ifndef NDEBUG
-        TIME_PT(t5);
+        TIME_PT(t1);
         #endif // NDEBUG
-        typename Callback<AFields>::PrtProperties prt (Bsize, tmp_prt_properties);
-        for (size_t prt_idx=0; prt_idx != Nprt_this_file; ++prt_idx, prt.advance())
-            callback.prt_modify(prt);
-        #ifndef NDEBUG
-        TIME_MSG(t5, "prt_loop modify particles");
-        #endif
-	
-        // run the loop
-        #ifndef NAIVE
-        #   ifndef NDEBUG
-        TIME_PT(t6);
-        #   endif // NDEBUG
-        prt_loop_sorted(Nprt_this_file);
-        #   ifndef NDEBUG
-        TIME_MSG(t6, "prt_loop->prt_loop_sorted");
-        #   endif // NDEBUG
-        #else // NAIVE
-        #   ifndef NDEBUG
-        TIME_PT(t6);
-        #   endif // NDEBUG
-        #   warning "Compiling with the naive particle loop instead of the (much faster) sorted one."
-        prt_loop_naive(Nprt_this_file);
-        #   ifndef NDEBUG
-        TIME_MSG(t6, "prt_loop->prt_loop_naive");
-        #   endif // NDEBUG
-        #endif // NAIVE
+
+        grp_update_all();
+
+        for (auto &chunk : prt_resident)
+            prt_query_chunk(*chunk);
 
         #ifndef NDEBUG
-        TIME_MSG(t1, "chunk %lu in Workspace::prt_loop", chunk_idx+1UL);
+        TIME_MSG(t1, "pass %lu over %lu resident chunks in Workspace::prt_loop",
+                     pass_idx+2UL, prt_resident.size());
         #endif // NDEBUG
+    }
+
+    for (auto &chunk : prt_resident)
+        prt_free_chunk(*chunk);
+    prt_resident.clear();
+}// }}}
+
+template<typename AFields, typename CB>
+void
+Workspace<AFields, CB>::grp_update_all ()
+{// {{{
+    typename Callback<AFields>::GrpProperties grp (grp_properties);
+
+    for (size_t grp_idx=0; grp_idx != Ngrp; ++grp_idx, grp.advance())
+    {
+        // the coordinates are the zeroth field, already converted to coord_t
+        coord_t *coord = (coord_t *)(grp_properties[0]) + 3UL * grp_idx;
+        const coord_t R_old = grp_radii[grp_idx];
+        coord_t R = R_old;
+
+        callback.grp_update(grp_idx, grp, coord, R);
+
+        // the group may have moved across the boundary
+        for (size_t kk=0; kk != 3; ++kk)
+        {
+            if (coord[kk] < (coord_t)0.0) coord[kk] += Bsize;
+            else if (coord[kk] >= Bsize) coord[kk] -= Bsize;
+        }
+
+        grp_radii[grp_idx] = R;
+
+        GrpQuery &q = grp_query[grp_idx];
+        for (size_t kk=0; kk != 3; ++kk)
+            q.coord[kk] = coord[kk];
+        q.Rsq = R * R;
+
+        if (grp_Napertures > 1UL)
+        {
+            coord_t *aperture_Rsq = grp_aperture_Rsq + grp_idx * grp_Napertures;
+            if (R_old > (coord_t)0.0)
+            {
+                const coord_t scale_sq = (R * R) / (R_old * R_old);
+                for (size_t kk=0; kk != grp_Napertures-1UL; ++kk)
+                    aperture_Rsq[kk] *= scale_sq;
+            }
+            else
+            {
+                // nothing to scale, start again from the ratios of the catalog apertures
+                callback.grp_apertures(grp, aperture_Rsq);
+                const coord_t R_cat = aperture_Rsq[grp_Napertures-1UL];
+                for (size_t kk=0; kk != grp_Napertures-1UL; ++kk)
+                {
+                    aperture_Rsq[kk] = (R_cat > (coord_t)0.0) ? aperture_Rsq[kk] * R / R_cat : R;
+                    aperture_Rsq[kk] *= aperture_Rsq[kk];
+                }
+            }
+            // exactly the radius, so every particle in the group is in an aperture
+            aperture_Rsq[grp_Napertures-1UL] = q.Rsq;
+        }
+
+        #ifdef PRECISE_COORDS
+        for (size_t kk=0; kk != 3; ++kk)
+            grp_coord_residuals[3UL*grp_idx+kk] = (coord_t)0.0;
+        #endif // PRECISE_COORDS
+    }
+}// }}}
+
+template<typename AFields, typename CB>
+void
+Workspace<AFields, CB>::prt_loop_pipeline ()
+{// {{{
+    // reading is done by a single thread since HDF5 is not necessarily thread safe,
+    // the remaining OpenMP threads are distributed among the other stages
+    // (each stage limits the number of pool threads its parallel loops use)
+    const int Nthreads  = prt_loop_max_threads();
+    const int Nprepare  = std::max(1, Nthreads / 8);
+    const int Nsort     = std::max(1, Nthreads / 4);
+    const int Nquery    = std::max(1, Nthreads - Nprepare - Nsort);
+
+    #ifndef NDEBUG
+    std::fprintf(stderr, "Running prt_loop as pipeline with threads : "
+                         "prepare=%d, sort=%d, query=%d\n", Nprepare, Nsort, Nquery);
+    #endif // NDEBUG
+
+    // the chunks that can be in memory at the same time
+    std::vector<PrtChunk> chunks (prt_pipeline_depth);
+
+    // the chunks that are not in use, and those passed between the stages
+    BoundedQueue<PrtChunk *> free_q (prt_pipeline_depth),
+                             read_q (prt_pipeline_depth),
+                             prepared_q (prt_pipeline_depth),
+                             sorted_q (prt_pipeline_depth);
+
+    for (auto &chunk : chunks)
+        free_q.push(&chunk);
+
+    std::thread reader ([&]()
+    {
+        PrtChunk *chunk;
+        size_t chunk_idx = 0UL, type_idx = 0UL, sub_idx = 0UL;
+        while (free_q.pop(chunk))
+        {
+            if (!prt_read_chunk(chunk_idx, type_idx, sub_idx, *chunk))
+                break;
+
+            // the next part of a file, particle type, or file
+            if (++sub_idx >= chunk->Nsub)
+            {
+                sub_idx = 0UL;
+                if (++type_idx >= prt_Ntypes)
+                {
+                    type_idx = 0UL;
+                    ++chunk_idx;
+                }
+            }
+
+            if (chunk->Nprt)
+                read_q.push(chunk);
+            else
+                free_q.push(chunk);
+        }
+        read_q.close();
+    });
+
+    std::thread preparer ([&]()
+    {
+        prt_loop_set_threads(Nprepare);
+        PrtChunk *chunk;
+        while (read_q.pop(chunk))
+        {
+            prt_prepare_chunk(*chunk);
+            prepared_q.push(chunk);
+        }
+        prepared_q.close();
+    });
+
+    std::thread sorter ([&]()
+    {
+        prt_loop_set_threads(Nsort);
+        PrtChunk *chunk;
+        while (prepared_q.pop(chunk))
+        {
+            prt_sort_chunk(*chunk);
+            sorted_q.push(chunk);
+        }
+        sorted_q.close();
+    });
+
+    // the loop over groups runs on this thread
+    prt_loop_set_threads(Nquery);
+
+    PrtChunk *chunk;
+    for (size_t Nchunks=1UL; sorted_q.pop(chunk); ++Nchunks)
+    {
+        prt_query_chunk(*chunk);
+        prt_free_chunk(*chunk);
+
+        report_rss(prt_chunk_str(*chunk));
+
+        free_q.push(chunk);
 
         #ifndef NDEBUG
-        std::fprintf(stderr, "In Workspace::prt_loop : did %lu chunks.\n", chunk_idx+1UL);
+        std::fprintf(stderr, "In Workspace::prt_loop : did %lu chunks.\n", Nchunks);
         #endif // NDEBUG
-    }// for chunk_idx
+    }
+
+    // the reader may still be waiting for a free chunk
+    free_q.close();
+
+    reader.join();
+    preparer.join();
+    sorter.join();
+
+    prt_loop_reset_threads(Nthreads);
+}// }}}
+
+template<typename AFields, typename CB>
+bool
+Workspace<AFields, CB>::prt_read_chunk (size_t chunk_idx, size_t type_idx, size_t sub_idx, PrtChunk &chunk)
+{// {{{
+    // the file name for the current chunk will be written here
+    std::string fname;
+
+    if (!callback.prt_chunk(chunk_idx, fname))
+        return false;
+
+    chunk.chunk_idx = chunk_idx;
+    chunk.type_idx  = type_idx;
+    chunk.sub_idx   = sub_idx;
+
+    // chunks belonging to other shards are skipped
+    if (chunk_idx % prt_Nshards != prt_shard_idx)
+    {
+        chunk.Nsub = 1UL;
+        chunk.Nprt = 0UL;
+        return true;
+    }
+
+    #ifndef NDEBUG
+    TIME_PT(t1);
+    #endif // NDEBUG
+
+    // open the hdf5 file, unless we are still working on it
+    if (!prt_fptr || prt_fptr_chunk_idx != chunk_idx)
+    {
+        if (prt_fptr) prt_fptr->close();
+        prt_fptr = std::make_shared<H5::H5File>(fname, H5F_ACC_RDONLY);
+        prt_fptr_chunk_idx = chunk_idx;
+    }
+    auto fptr = prt_fptr;
+
+    // read metadata
+    coord_t Bsize_this_file;
+    size_t Nprt_file;
+    callback.read_prt_meta(chunk_idx, fptr, Bsize_this_file, Nprt_file);
+    if (prt_Ntypes > 1UL)
+        callback.read_prt_type_meta(chunk_idx, fptr, type_idx, Nprt_file);
+
+    Bsize_this_file *= callback.prt_coord_rescale();
+
+    // Bsize has been read in meta_init
+    assert(std::fabs(Bsize/Bsize_this_file - 1.0F) < 1e-5F);
+
+    // the part of the file we work on
+    prt_plan_chunk(Nprt_file, chunk);
+    assert(sub_idx < chunk.Nsub);
+    chunk.prt_offset = Nprt_file * sub_idx / chunk.Nsub;
+    chunk.Nprt       = Nprt_file * (sub_idx+1UL) / chunk.Nsub - chunk.prt_offset;
+
+    // file not needed anymore after the last part of the last particle type
+    const bool last = type_idx+1UL == prt_Ntypes && sub_idx+1UL == chunk.Nsub;
+
+    if (!chunk.Nprt)
+    {
+        if (last)
+        {
+            prt_fptr->close();
+            prt_fptr.reset();
+        }
+        return true;
+    }
+
+    // allocate storage
+    #ifndef NDEBUG
+    TIME_PT(t2);
+    #endif // NDEBUG
+    realloc_tmp_storage<typename AFields::ParticleFields>(chunk.Nprt, chunk.prt_properties);
+    #ifndef NDEBUG
+    TIME_MSG(t2, "prt_loop memory allocation for particle chunk data");
+    #endif // NDEBUG
+
+    // read the file data
+    #ifndef NDEBUG
+    TIME_PT(t3);
+    #endif // NDEBUG
+    hdf5Utils::read_fields<AFields, typename AFields::ParticleFields>(callback, fptr, chunk.Nprt,
+                                                                      chunk.prt_properties,
+                                                                      chunk.prt_offset, type_idx);
+    #ifndef NDEBUG
+    TIME_MSG(t3, "prt_loop read_fields for particle chunk data");
+    #endif // NDEBUG
+
+    if (last)
+    {
+        prt_fptr->close();
+        prt_fptr.reset();
+    }
+
+    #ifndef NDEBUG
+    TIME_MSG(t1, "reading chunk %lu (type %lu, part %lu/%lu)", chunk_idx+1UL, type_idx, sub_idx+1UL, chunk.Nsub);
+    #endif // NDEBUG
+
+    return true;
+}// }}}
+
+template<typename AFields, typename CB>
+void
+Workspace<AFields, CB>::prt_prepare_chunk (PrtChunk &chunk)
+{// {{{
+    // convert the particle coordinates
+    #ifndef NDEBUG
+    TIME_PT(t4);
+    #endif // NDEBUG
+    #ifdef PRECISE_COORDS
+    // relative to the cell origins, computed from the coordinates in the file
+    chunk.prt_cell_keys = (uint32_t *)arena.acquire(chunk.Nprt * sizeof(uint32_t));
+    Sorting::template cell_coords<typename AFields::ParticleFields::sim_coord_t>
+        (chunk.Nprt, Bsize, callback.prt_coord_rescale(), chunk.prt_properties[0], chunk.prt_cell_keys);
+    #else // PRECISE_COORDS
+    AFields::ParticleFields::convert_coords(chunk.Nprt, chunk.prt_properties[0],
+                                            callback.prt_coord_rescale());
+    #endif // PRECISE_COORDS
+    #ifndef NDEBUG
+    TIME_MSG(t4, "prt_loop convert coords");
+    #endif // NDEBUG
+    
+    // if requested, modify the particle
+    #ifndef NDEBUG
+    TIME_PT(t5);
+    #endif // NDEBUG
+    #ifdef PRECISE_COORDS
+    // the user works with the absolute coordinates.
+    // If the file has wider coordinates than coord_t, the buffer has room for the cell-relative
+    // ones behind the absolute ones, so the coordinates the user does not change stay precise.
+    // Otherwise the absolute coordinates were exact to begin with
+    // (up to the rounding after prt_coord_rescale)
+    coord_t *cell_coords_before = nullptr;
+    if (callback.prt_modifies())
+    {
+        coord_t *x = (coord_t *)chunk.prt_properties[0];
+        if constexpr (sizeof(typename AFields::ParticleFields::sim_coord_t) >= 2UL * sizeof(coord_t))
+        {
+            cell_coords_before = x + 3UL * chunk.Nprt;
+            std::memcpy(cell_coords_before, x, 3UL * chunk.Nprt * sizeof(coord_t));
+        }
+        Sorting::abs_coords(chunk.Nprt, Bsize, x, chunk.prt_cell_keys);
+    }
+    #endif // PRECISE_COORDS
+    prt_modify_chunk(chunk);
+    #ifdef PRECISE_COORDS
+    if (callback.prt_modifies())
+        // a modified coordinate is exactly what the user computed
+        Sorting::cell_coords_modified(chunk.Nprt, Bsize, (coord_t *)chunk.prt_properties[0],
+                                      chunk.prt_cell_keys, cell_coords_before);
+    #endif // PRECISE_COORDS
+    #ifndef NDEBUG
+    TIME_MSG(t5, "prt_loop modify particles");
+    #endif
+}// }}}
+
+template<typename AFields, typename CB>
+void
+Workspace<AFields, CB>::prt_sort_chunk (PrtChunk &chunk)
+{// {{{
+    #ifndef NAIVE
+    // create a Sorting instance, constructing it will perform the main work
+    // associated with this object
+    #   ifndef NDEBUG
+    TIME_PT(t1);
+    #   endif // NDEBUG
+
+    #   ifdef PRECISE_COORDS
+    // the cells have already been computed with the coordinates
+    chunk.prt_sort = std::make_unique<Sorting>(chunk.Nprt, Bsize, chunk.prt_properties, arena, chunk.inplace,
+                                               chunk.prt_cell_keys);
+    chunk.prt_cell_keys = nullptr;
+    #   else // PRECISE_COORDS
+    chunk.prt_sort = std::make_unique<Sorting>(chunk.Nprt, Bsize, chunk.prt_properties, arena, chunk.inplace);
+    #   endif // PRECISE_COORDS
+
+    #   ifndef NDEBUG
+    TIME_MSG(t1, "initialization of Sorting instance (Nprt=%lu)", chunk.Nprt);
+    #   endif // NDEBUG
+    #endif // NAIVE
+}// }}}
+
+template<typename AFields, typename CB>
+void
+Workspace<AFields, CB>::prt_query_chunk (PrtChunk &chunk)
+{// {{{
+    prt_type_idx = chunk.type_idx;
+
+    // run the loop
+    #ifndef NAIVE
+    #   ifndef NDEBUG
+    TIME_PT(t6);
+    #   endif // NDEBUG
+    prt_loop_sorted(chunk);
+    #   ifndef NDEBUG
+    TIME_MSG(t6, "prt_loop->prt_loop_sorted");
+    #   endif // NDEBUG
+    #else // NAIVE
+    #   ifndef NDEBUG
+    TIME_PT(t6);
+    #   endif // NDEBUG
+    #   warning "Compiling with the naive particle loop instead of the (much faster) sorted one."
+    prt_loop_naive(chunk);
+    #   ifndef NDEBUG
+    TIME_MSG(t6, "prt_loop->prt_loop_naive");
+    #   endif // NDEBUG
+    #endif // NAIVE
+}// }}}
+
+template<typename AFields, typename CB>
+void
+Workspace<AFields, CB>::prt_free_chunk (PrtChunk &chunk)
+{// {{{
+    #ifndef NAIVE
+    chunk.prt_sort.reset();
+    #endif // NAIVE
+
+    free_tmp_storage<typename AFields::ParticleFields>(chunk.prt_properties);
+
+    #ifdef PRECISE_COORDS
+    arena.release(chunk.prt_cell_keys);
+    chunk.prt_cell_keys = nullptr;
+    #endif // PRECISE_COORDS
+}// }}}
+
+template<typename AFields, typename CB>
+void
+Workspace<AFields, CB>::prt_modify_chunk (PrtChunk &chunk)
+{// {{{
+    if (!callback.prt_modifies())
+        return;
+
+    if (callback.prt_modify_is_bulk())
+    {
+        const size_t Nspans = (chunk.Nprt + prt_modify_span - 1UL) / prt_modify_span;
+
+        parallel_for(0UL, Nspans, 1UL, [this, &chunk](size_t span_begin, size_t span_end)
+        {
+            for (size_t span_idx=span_begin; span_idx != span_end; ++span_idx)
+            {
+                const size_t begin = span_idx * prt_modify_span;
+                const size_t end   = std::min(begin + prt_modify_span, chunk.Nprt);
+
+                void *span_properties[AFields::ParticleFields::Nfields];
+                for (size_t ii=0; ii != AFields::ParticleFields::Nfields; ++ii)
+                    span_properties[ii] = (char *)(chunk.prt_properties[ii])
+                                          + begin * AFields::ParticleFields::strides_fcoord[ii];
 
-    // save memory by shrinking the temporary particle storage
-    realloc_tmp_storage<typename AFields::ParticleFields>(1, tmp_prt_properties);
+                callback.prt_modify_bulk(end-begin, Bsize, span_properties, chunk.type_idx);
+            }
+        });
+
+        return;
+    }
+
+    typename Callback<AFields>::PrtProperties prt (Bsize, chunk.prt_properties, 0UL, chunk.type_idx);
+
+    for (size_t prt_idx=0UL; prt_idx != chunk.Nprt; ++prt_idx, prt.advance())
+        callback.prt_modify(prt);
 }// }}}
 
 #ifdef NAIVE
-template<typename AFields>
+template<typename AFields, typename CB>
 void
-Workspace<AFields>::prt_loop_naive (size_t Nprt_this_file)
+Workspace<AFields, CB>::prt_loop_naive (PrtChunk &chunk)
 {// {{{
-    typename Callback<AFields>::PrtProperties prt (Bsize, tmp_prt_properties);
+    if (prt_batch)
+    {
+        typename Callback<AFields>::GrpProperties grp (grp_properties);
+
+        // loop over groups, and over the particles in batches
+        for (size_t grp_idx=0; grp_idx != Ngrp; ++grp_idx, grp.advance())
+            for (size_t begin=0; begin < chunk.Nprt; begin += prt_modify_span)
+                prt_loop_batch(chunk.prt_properties, nullptr,
+                               begin, std::min(prt_modify_span, chunk.Nprt-begin), nullptr,
+                               grp_idx, grp, grp_idx);
+        return;
+    }
+
+    typename Callback<AFields>::PrtProperties prt (Bsize, chunk.prt_properties, 0UL, chunk.type_idx);
 
     // loop over particles
-    for (size_t prt_idx=0; prt_idx != Nprt_this_file; ++prt_idx, prt.advance())
+    for (size_t prt_idx=0; prt_idx != chunk.Nprt; ++prt_idx, prt.advance())
     {
         typename Callback<AFields>::GrpProperties grp (grp_properties);
 
@@ -151,77 +796,556 @@ Workspace<AFields>::prt_loop_naive (size_t Nprt_this_file)
     }// for prt_idx
 }// }}}
 #else // NAIVE
-template<typename AFields>
+template<typename AFields, typename CB>
 void
-Workspace<AFields>::prt_loop_sorted (size_t Nprt_this_file)
+Workspace<AFields, CB>::prt_loop_sorted (PrtChunk &chunk)
 {// {{{
-    // create a Sorting instance, constructing it will perform the main work
-    // associated with this object
+    Sorting &prt_sort = *chunk.prt_sort;
+
+    // estimate the work associated with each group and arrange the groups accordingly
     #ifndef NDEBUG
-    TIME_PT(t1);
+    TIME_PT(t2);
     #endif // NDEBUG
 
-    Sorting prt_sort (Nprt_this_file, Bsize, tmp_prt_properties);
+    std::vector<size_t> grp_order, task_offsets, heavy_grps;
+    schedule_grps(prt_sort, grp_order, task_offsets, heavy_grps);
 
     #ifndef NDEBUG
-    TIME_MSG(t1, "initialization of Sorting instance (Nprt=%lu)", Nprt_this_file);
+    TIME_MSG(t2, "scheduling %lu groups in %lu tasks (%lu groups will be split)",
+                 grp_order.size(), task_offsets.size()-1UL, heavy_grps.size());
     #endif // NDEBUG
 
+    #ifndef NO_WORK_STEALING
+    #   ifndef NDEBUG
+    TIME_PT(t3);
+    #   endif // NDEBUG
+
+    // the heavy groups are split into blocks of cells which are processed
+    // concurrently with the other groups, each block with its own copy of the group's data
+    std::vector<SplitBlock> split_blocks;
+    for (auto grp_idx : heavy_grps)
+        prt_split_blocks(prt_sort, grp_idx, split_blocks);
+
+    const size_t Ntasks = task_offsets.size() - 1UL;
+
+    #   ifndef NDEBUG
+    // time each thread spends working on groups, to measure load imbalance
+    // (the blocks are timed one by one, as a thread may join the loop late)
+    TaskPool &pool = TaskPool::instance();
+    std::vector<double> thread_busy (pool.max_thread_idx(), 0.0);
+    #   endif // NDEBUG
+
+    // blocks first since they belong to the most expensive groups
+    parallel_for(0UL, split_blocks.size() + Ntasks, 1UL,
+                 [&, this](size_t begin, size_t end)
+    {
+        #ifndef NDEBUG
+        TIME_PT(t_task);
+        #endif // NDEBUG
+
+        for (size_t idx=begin; idx != end; ++idx)
+            if (idx < split_blocks.size())
+                prt_loop_block(prt_sort, split_blocks[idx]);
+            else
+            {
+                const size_t task_idx = idx - split_blocks.size();
+                for (size_t ii=task_offsets[task_idx]; ii != task_offsets[task_idx+1UL]; ++ii)
+                    prt_loop_grp(prt_sort, grp_order[ii]);
+            }
+
+        #ifndef NDEBUG
+        std::chrono::duration<double> diff = std::chrono::steady_clock::now() - t_task;
+        thread_busy[pool.thread_idx()] += diff.count();
+        #endif // NDEBUG
+    });
+
+    // reduce in a fixed order
+    for (const auto &block : split_blocks)
+        callback.grp_merge(block.grp_idx, block.clone_idx);
+
+    if (!split_blocks.empty())
+        callback.grp_clones_release();
+
+    #   ifndef NDEBUG
+    TIME_MSG(t3, "work-stealing group loop (%lu tasks, %lu blocks of split groups, %lu threads)",
+                 Ntasks, split_blocks.size(), parallel_threads());
+    prt_loop_report_imbalance(thread_busy, parallel_threads());
+    #   endif // NDEBUG
+    #else // NO_WORK_STEALING
+    #ifndef NDEBUG
+    // time each thread spends working on groups, to measure load imbalance
+    std::vector<double> thread_busy (prt_loop_max_threads(), 0.0);
+    #   endif // NDEBUG
+
     #pragma omp parallel
     {
+        #ifndef NDEBUG
+        TIME_PT(t_thread);
+        #endif // NDEBUG
+
+        // loop over tasks, each consisting of one or more groups
+        #if defined(GRP_AFFINITY) && !defined(NO_COST_MODEL)
+        // task i belongs to thread i
+        #pragma omp for schedule(static,1) nowait
+        #else // GRP_AFFINITY
+        #pragma omp for schedule(dynamic,1) nowait
+        #endif // GRP_AFFINITY
+        for (size_t task_idx=0; task_idx < task_offsets.size()-1UL; ++task_idx)
+            for (size_t ii=task_offsets[task_idx]; ii != task_offsets[task_idx+1UL]; ++ii)
+                prt_loop_grp(prt_sort, grp_order[ii]);
+
+        #ifndef NDEBUG
+        std::chrono::duration<double> diff = std::chrono::steady_clock::now() - t_thread;
+        thread_busy[prt_loop_thread_num()] = diff.count();
+        #endif // NDEBUG
+    } // parallel
+
+    #   ifndef NDEBUG
+    prt_loop_report_imbalance(thread_busy, thread_busy.size());
+    #   endif // NDEBUG
+
+    #   ifndef NDEBUG
+    TIME_PT(t3);
+    #   endif // NDEBUG
+
+    for (auto grp_idx : heavy_grps)
+        prt_loop_split(prt_sort, grp_idx);
+
+    #   ifndef NDEBUG
+    if (!heavy_grps.empty())
+        TIME_MSG(t3, "split loop over %lu heavy groups", heavy_grps.size());
+    #   endif // NDEBUG
+    #endif // NO_WORK_STEALING
+}// }}}
+
+template<typename AFields, typename CB>
+inline void
+Workspace<AFields, CB>::prt_loop_grp (Sorting &prt_sort, size_t grp_idx)
+{// {{{
+    typename Callback<AFields>::GrpProperties grp (grp_properties, grp_idx);
+
+    // compute which cells have intersection with this group
+    const std::vector<std::tuple<size_t,size_t,std::array<int,3>>> prt_idx_ranges
+        = prt_sort.prt_idx_ranges(grp.coord(), grp_radii[grp_idx], grp_query[grp_idx].Rsq);
+
+    // loop over cells
+    for (auto &prt_idx_range : prt_idx_ranges)
+        prt_loop_range(prt_sort, grp_idx, grp, prt_idx_range, grp_idx);
+}// }}}
+
+template<typename AFields, typename CB>
+inline void
+Workspace<AFields, CB>::prt_loop_range (Sorting &prt_sort, size_t grp_idx,
+                                    const typename Callback<AFields>::GrpProperties &grp,
+                                    const std::tuple<size_t,size_t,std::array<int,3>> &range,
+                                    size_t action_idx)
+{// {{{
+    #if defined(QUANTIZED_COORDS) || defined(PRECISE_COORDS)
+    if (std::get<0>(range) == std::get<1>(range)) return;
+    #endif // QUANTIZED_COORDS, PRECISE_COORDS
+
+    #ifdef PRECISE_COORDS
+    // the particle coordinates are relative to the cell origin
+    CellFrame frame;
+    {
+        prt_sort.cell_origin(std::get<0>(range), frame.origin);
+        const double acell = prt_sort.cell_size();
+        const coord_t *grp_residual = grp_coord_residuals + 3UL * grp_idx;
 
-        // loop over groups
-        #pragma omp for schedule(dynamic,1)
-        for (size_t grp_idx=0; grp_idx != Ngrp; ++grp_idx)
+        for (size_t ii=0; ii != 3; ++ii)
         {
-            // we have to initialize this on each iteration,
-            // otherwise the loop doesn't work with OpenMP
-            typename Callback<AFields>::GrpProperties grp (grp_properties, grp_idx);
+            // the periodic image of the cell whose center is closest to the group
+            double d = frame.origin[ii] + 0.5 * acell
+                       - ((double)grp_query[grp_idx].coord[ii] + (double)grp_residual[ii]);
+            d -= (double)Bsize * std::round(d / (double)Bsize);
+            frame.grp_to_cell[ii] = (coord_t)(d - 0.5 * acell);
+        }
+    }
+    #else // PRECISE_COORDS
+    const CellFrame *frame_ptr = nullptr;
+    #endif // PRECISE_COORDS
+
+    #ifdef QUANTIZED_COORDS
+    const coord_t qstep = prt_sort.qstep();
+
+    // the vector from the group to the center of the first quantization step in this cell
+    coord_t grp_to_cell[3];
+    #   ifdef PRECISE_COORDS
+    for (size_t ii=0; ii != 3; ++ii)
+        grp_to_cell[ii] = frame.grp_to_cell[ii] + (coord_t)0.5 * qstep;
+    #   else // PRECISE_COORDS
+    prt_sort.cell_origin(std::get<0>(range), grp_to_cell);
+    for (size_t ii=0; ii != 3; ++ii)
+        grp_to_cell[ii] = GeomUtils::periodic_dist(grp.coord()[ii], grp_to_cell[ii], Bsize)
+                          + (coord_t)0.5 * qstep;
+    #   endif // PRECISE_COORDS
+
+    // the quantization error is half a step, the rest is a safety margin for
+    // the rounding errors in the float computations here and in prt_loop_inner
+    const coord_t margin = (coord_t)2.0 * qstep;
+    #endif // QUANTIZED_COORDS
+
+    if (prt_batch)
+    {
+        #ifdef PRECISE_COORDS
+        const CellFrame *frame_ptr = &frame;
+        #endif // PRECISE_COORDS
+
+        #ifdef QUANTIZED_COORDS
+        const size_t Nprt = std::get<1>(range) - std::get<0>(range);
+        const coord_t Rsq_max = grp_query[grp_idx].Rsq;
+
+        // if the cell is entirely inside the group, there is nothing to reject
+        coord_t Rsq_cell_max = (coord_t)0.0;
+        for (size_t kk=0; kk != 3; ++kk)
+        {
+            const coord_t dx_max = std::max(std::fabs(grp_to_cell[kk]),
+                                            std::fabs(grp_to_cell[kk] + prt_sort.cell_size()))
+                                   + margin;
+            Rsq_cell_max += dx_max * dx_max;
+        }
+
+        if (Rsq_cell_max <= Rsq_max)
+        {
+            prt_loop_batch(prt_sort.tmp_prt_properties_sorted, frame_ptr,
+                           std::get<0>(range), Nprt, nullptr, grp_idx, grp, action_idx);
+            return;
+        }
+
+        // the same rejection as below, but the lower bounds are computed in a vectorizable
+        // loop and the remaining candidates are collected without branches
+        static thread_local std::vector<coord_t> Rsq_min_all;
+        static thread_local std::vector<size_t> candidates_all;
+
+        if (Rsq_min_all.size() < Nprt)
+        {
+            Rsq_min_all.resize(Nprt);
+            candidates_all.resize(Nprt);
+        }
+
+        coord_t *Rsq_min = Rsq_min_all.data();
+        size_t *candidates = candidates_all.data();
+        const uint16_t *q = prt_sort.qcoord(std::get<0>(range));
 
-            // compute which cells have intersection with this group
-            const std::vector<std::tuple<size_t,size_t,std::array<int,3>>> prt_idx_ranges
-                = prt_sort.prt_idx_ranges(grp.coord(), grp_radii[grp_idx], grp_radii_sq[grp_idx]);
+        size_t Ncandidates = 0UL;
 
-            // no particles in the vicinity of this group
-            if (prt_idx_ranges.empty()) continue;
-            
-            // loop over cells
-            for (auto &prt_idx_range : prt_idx_ranges)
+        #pragma omp simd reduction(+:Ncandidates)
+        for (size_t ii=0; ii < Nprt; ++ii)
+        {
+            coord_t this_Rsq_min = (coord_t)0.0;
+            for (size_t kk=0; kk != 3; ++kk)
             {
-                typename Callback<AFields>::PrtProperties prt (Bsize,
-                                                               prt_sort.tmp_prt_properties_sorted,
-                                                               std::get<0>(prt_idx_range));
-
-                // loop over particles
-                for (size_t prt_idx=std::get<0>(prt_idx_range);
-                            prt_idx != std::get<1>(prt_idx_range);
-                            ++prt_idx, prt.advance())
-                    prt_loop_inner(grp_idx, grp, prt, std::get<2>(prt_idx_range));
-            }// for prt_idx_range
-        }// for grp_idx
+                const coord_t dx = std::fabs(grp_to_cell[kk] + (coord_t)q[3UL*ii+kk] * qstep);
+                const coord_t dx_min = std::max(std::min(dx, Bsize-dx) - margin, (coord_t)0.0);
+                this_Rsq_min += dx_min * dx_min;
+            }
+            Rsq_min[ii] = this_Rsq_min;
+            Ncandidates += (this_Rsq_min <= Rsq_max);
+        }
 
-    } // parallel
+        if (!Ncandidates)
+            return;
+
+        // if most particles remain, the contiguous loop is cheaper than the indirect one
+        if (2UL * Ncandidates > Nprt)
+        {
+            prt_loop_batch(prt_sort.tmp_prt_properties_sorted, frame_ptr,
+                           std::get<0>(range), Nprt, nullptr, grp_idx, grp, action_idx);
+            return;
+        }
+
+        Ncandidates = 0UL;
+        for (size_t ii=0; ii != Nprt; ++ii)
+        {
+            candidates[Ncandidates] = std::get<0>(range) + ii;
+            Ncandidates += (Rsq_min[ii] <= Rsq_max);
+        }
+
+        prt_loop_batch(prt_sort.tmp_prt_properties_sorted, frame_ptr,
+                       0UL, Ncandidates, candidates, grp_idx, grp, action_idx);
+        #else // QUANTIZED_COORDS
+        prt_loop_batch(prt_sort.tmp_prt_properties_sorted, frame_ptr,
+                       std::get<0>(range), std::get<1>(range) - std::get<0>(range), nullptr,
+                       grp_idx, grp, action_idx);
+        #endif // QUANTIZED_COORDS
+        return;
+    }
+
+    typename Callback<AFields>::PrtProperties prt (Bsize,
+                                                   prt_sort.tmp_prt_properties_sorted,
+                                                   std::get<0>(range), prt_type_idx);
+
+    // loop over particles
+    for (size_t prt_idx=std::get<0>(range); prt_idx != std::get<1>(range); ++prt_idx, prt.advance())
+    {
+        #ifdef QUANTIZED_COORDS
+        // lower bound on the distance
+        const uint16_t *q = prt_sort.qcoord(prt_idx);
+        coord_t Rsq_min = (coord_t)0.0;
+        for (size_t ii=0; ii != 3; ++ii)
+        {
+            const coord_t dx = std::fabs(grp_to_cell[ii] + (coord_t)q[ii] * qstep);
+            const coord_t dx_min = std::max(std::min(dx, Bsize-dx) - margin, (coord_t)0.0);
+            Rsq_min += dx_min * dx_min;
+        }
+
+        if (Rsq_min > grp_query[grp_idx].Rsq)
+            continue;
+        #endif // QUANTIZED_COORDS
 
+        #ifdef PRECISE_COORDS
+        prt_loop_inner_precise(grp_idx, grp, prt, frame, action_idx);
+        #else // PRECISE_COORDS
+        prt_loop_inner(grp_idx, grp, prt, std::get<2>(range), action_idx);
+        #endif // PRECISE_COORDS
+    }
 }// }}}
+
+template<typename AFields, typename CB>
+void
+Workspace<AFields, CB>::schedule_grps (Sorting &prt_sort,
+                                   std::vector<size_t> &grp_order,
+                                   std::vector<size_t> &task_offsets,
+                                   std::vector<size_t> &heavy_grps)
+{// {{{
+    #ifdef NO_COST_MODEL
+    // catalog order, one group per task (this is mainly useful for comparison)
+    grp_order.resize(Ngrp);
+    task_offsets.resize(Ngrp+1UL);
+    for (size_t grp_idx=0; grp_idx != Ngrp; ++grp_idx)
+        grp_order[grp_idx] = task_offsets[grp_idx] = grp_idx;
+    task_offsets[Ngrp] = Ngrp;
+    #else // NO_COST_MODEL
+    // the number of candidate particles in the cells intersected by a group
+    // (plus some overhead per cell) is a good proxy for the work associated with it
+    std::vector<size_t> costs (Ngrp);
+
+    parallel_for(0UL, Ngrp, 64UL, [this, &prt_sort, &costs](size_t begin, size_t end)
+    {
+        for (size_t grp_idx=begin; grp_idx != end; ++grp_idx)
+        {
+            typename Callback<AFields>::GrpProperties grp (grp_properties, grp_idx);
+
+            const auto prt_idx_ranges = prt_sort.prt_idx_ranges(grp.coord(),
+                                                                 grp_radii[grp_idx], grp_query[grp_idx].Rsq);
+
+            size_t Ncandidates = 0UL;
+            for (const auto &prt_idx_range : prt_idx_ranges)
+                Ncandidates += std::get<1>(prt_idx_range) - std::get<0>(prt_idx_range);
+
+            // groups without any candidate particles do not need to be visited at all
+            costs[grp_idx] = (Ncandidates) ? Ncandidates + prt_cost_per_range * prt_idx_ranges.size() : 0UL;
+        }
+    });
+
+    size_t cost_tot = 0UL;
+    for (auto cost : costs)
+        cost_tot += cost;
+
+    const size_t Nthreads = parallel_threads();
+
+    // if the user allows it, groups that alone would keep a thread busy for a considerable
+    // fraction of the loop are split across threads
+    const size_t heavy_threshold = (callback.grp_splittable() && Nthreads > 1UL)
+                                   ? std::max(prt_split_min, cost_tot / (prt_split_factor * Nthreads))
+                                   : std::numeric_limits<size_t>::max();
+
+    grp_order.reserve(Ngrp);
+    for (size_t grp_idx=0; grp_idx != Ngrp; ++grp_idx)
+        if (costs[grp_idx] > heavy_threshold)
+            heavy_grps.push_back(grp_idx);
+        else if (costs[grp_idx])
+            grp_order.push_back(grp_idx);
+
+    #   ifdef GRP_AFFINITY
+    // each thread works on the groups whose particles are in the slab it has first touched
+    // in Sorting::reorder_prt_properties (so they are in its NUMA node's memory),
+    // largest first within each thread
+    std::vector<size_t> slabs (Ngrp);
+    for (auto grp_idx : grp_order)
+    {
+        typename Callback<AFields>::GrpProperties grp (grp_properties, grp_idx);
+        slabs[grp_idx] = prt_sort.slab_of(grp.coord(), Nthreads);
+    }
+
+    std::stable_sort(grp_order.begin(), grp_order.end(),
+                     [&costs, &slabs](size_t a, size_t b)
+                     { return slabs[a] < slabs[b] || (slabs[a] == slabs[b] && costs[a] > costs[b]); });
+
+    // one task per thread
+    task_offsets.assign(Nthreads+1UL, 0UL);
+    for (auto grp_idx : grp_order)
+        ++task_offsets[slabs[grp_idx]+1UL];
+    for (size_t ii=0; ii != Nthreads; ++ii)
+        task_offsets[ii+1UL] += task_offsets[ii];
+    #   else // GRP_AFFINITY
+    // largest first, so the expensive groups do not determine the tail of the loop
+    std::stable_sort(grp_order.begin(), grp_order.end(),
+                     [&costs](size_t a, size_t b) { return costs[a] > costs[b]; });
+
+    // batch cheap groups into tasks of roughly equal cost
+    const size_t task_cost = std::max(1UL, cost_tot / (prt_tasks_per_thread * Nthreads));
+
+    task_offsets.push_back(0UL);
+    size_t this_task_cost = 0UL;
+    for (size_t ii=0; ii != grp_order.size(); ++ii)
+    {
+        this_task_cost += costs[grp_order[ii]];
+        if (this_task_cost >= task_cost)
+        {
+            task_offsets.push_back(ii+1UL);
+            this_task_cost = 0UL;
+        }
+    }
+    if (task_offsets.back() != grp_order.size())
+        task_offsets.push_back(grp_order.size());
+    #   endif // GRP_AFFINITY
+    #endif // NO_COST_MODEL
+}// }}}
+
+template<typename AFields, typename CB>
+void
+Workspace<AFields, CB>::prt_split_pieces
+    (Sorting &prt_sort, size_t grp_idx,
+     std::vector<std::tuple<size_t,size_t,std::array<int,3>>> &pieces)
+{// {{{
+    typename Callback<AFields>::GrpProperties grp (grp_properties, grp_idx);
+
+    const std::vector<std::tuple<size_t,size_t,std::array<int,3>>> prt_idx_ranges
+        = prt_sort.prt_idx_ranges(grp.coord(), grp_radii[grp_idx], grp_query[grp_idx].Rsq);
+
+    // split the cells into pieces of roughly equal size
+    for (const auto &prt_idx_range : prt_idx_ranges)
+        for (size_t begin=std::get<0>(prt_idx_range); begin < std::get<1>(prt_idx_range);
+                    begin += prt_split_piece)
+            pieces.emplace_back(begin, std::min(begin+prt_split_piece, std::get<1>(prt_idx_range)),
+                                std::get<2>(prt_idx_range));
+}// }}}
+
+#ifndef NO_WORK_STEALING
+template<typename AFields, typename CB>
+void
+Workspace<AFields, CB>::prt_split_blocks (Sorting &prt_sort, size_t grp_idx,
+                                      std::vector<SplitBlock> &blocks)
+{// {{{
+    std::vector<std::tuple<size_t,size_t,std::array<int,3>>> pieces;
+    prt_split_pieces(prt_sort, grp_idx, pieces);
+
+    // one block per thread, consecutive pieces so the assignment
+    // of particles to copies is reproducible
+    const size_t Nblocks = std::min(parallel_threads(), pieces.size());
+    for (size_t block_idx=0; block_idx != Nblocks; ++block_idx)
+    {
+        SplitBlock block;
+        block.grp_idx   = grp_idx;
+        block.clone_idx = callback.grp_clone(grp_idx);
+        block.pieces.assign(pieces.begin() + pieces.size() * block_idx / Nblocks,
+                            pieces.begin() + pieces.size() * (block_idx+1UL) / Nblocks);
+        blocks.push_back(std::move(block));
+    }
+}// }}}
+
+template<typename AFields, typename CB>
+void
+Workspace<AFields, CB>::prt_loop_block (Sorting &prt_sort, const SplitBlock &block)
+{// {{{
+    typename Callback<AFields>::GrpProperties grp (grp_properties, block.grp_idx);
+
+    for (const auto &piece : block.pieces)
+        prt_loop_range(prt_sort, block.grp_idx, grp, piece, block.clone_idx);
+}// }}}
+#else // NO_WORK_STEALING
+template<typename AFields, typename CB>
+void
+Workspace<AFields, CB>::prt_loop_split (Sorting &prt_sort, size_t grp_idx)
+{// {{{
+    typename Callback<AFields>::GrpProperties grp (grp_properties, grp_idx);
+
+    std::vector<std::tuple<size_t,size_t,std::array<int,3>>> pieces;
+    prt_split_pieces(prt_sort, grp_idx, pieces);
+
+    // each thread gets its own temporary copy of this group's data
+    const int Nthreads = prt_loop_max_threads();
+    std::vector<size_t> clone_idx (Nthreads);
+    for (int ii=0; ii != Nthreads; ++ii)
+        clone_idx[ii] = callback.grp_clone(grp_idx);
+
+    // static schedule so the assignment of particles to copies is reproducible
+    #pragma omp parallel for schedule(static)
+    for (size_t piece_idx=0; piece_idx < pieces.size(); ++piece_idx)
+    {
+        const size_t this_clone_idx = clone_idx[prt_loop_thread_num()];
+
+        prt_loop_range(prt_sort, grp_idx, grp, pieces[piece_idx], this_clone_idx);
+    }
+
+    // reduce in a fixed order
+    for (int ii=0; ii != Nthreads; ++ii)
+        callback.grp_merge(grp_idx, clone_idx[ii]);
+
+    callback.grp_clones_release();
+}// }}}
+#endif // NO_WORK_STEALING
 #endif // NAIVE
 
-template<typename AFields>
+template<typename AFields, typename CB>
+inline void
+Workspace<AFields, CB>::prt_action (size_t grp_idx,
+                                    const typename Callback<AFields>::GrpProperties &grp,
+                                    const typename Callback<AFields>::PrtProperties &prt,
+                                    coord_t Rsq)
+{// {{{
+    if constexpr (std::is_same<CB, Callback<AFields>>::value)
+        callback.prt_action(grp_idx, grp, prt, Rsq);
+    else
+        // the qualified name suppresses the virtual call, so this can be inlined
+        callback_static.CB::prt_action(grp_idx, grp, prt, Rsq);
+}// }}}
+
+template<typename AFields, typename CB>
+inline void
+Workspace<AFields, CB>::prt_action (size_t query_idx, size_t action_idx,
+                                    const typename Callback<AFields>::GrpProperties &grp,
+                                    const typename Callback<AFields>::PrtProperties &prt,
+                                    coord_t Rsq)
+{// {{{
+    if (grp_Napertures == 1UL)
+    {
+        prt_action(action_idx, grp, prt, Rsq);
+        return;
+    }
+
+    // the apertures are sorted, so we count the ones the particle is outside of
+    const coord_t *aperture_Rsq = grp_aperture_Rsq + query_idx * grp_Napertures;
+    size_t aperture_idx = 0UL;
+    for (size_t ii=0; ii != grp_Napertures; ++ii)
+        aperture_idx += (Rsq > aperture_Rsq[ii]);
+    assert(aperture_idx < grp_Napertures);
+
+    typename Callback<AFields>::PrtProperties prt_aperture (prt);
+    prt_aperture.aperture_idx = aperture_idx;
+    prt_action(action_idx, grp, prt_aperture, Rsq);
+}// }}}
+
+template<typename AFields, typename CB>
 __attribute__((hot))
 inline void
 #ifdef NAIVE
-Workspace<AFields>::prt_loop_inner
+Workspace<AFields, CB>::prt_loop_inner
     (size_t grp_idx,
      const typename Callback<AFields>::GrpProperties &grp,
      const typename Callback<AFields>::PrtProperties &prt)
 #else // NAIVE
-Workspace<AFields>::prt_loop_inner
+Workspace<AFields, CB>::prt_loop_inner
     (size_t grp_idx,
      const typename Callback<AFields>::GrpProperties &grp,
      const typename Callback<AFields>::PrtProperties &prt,
-     const std::array<int, 3> &periodic_to_add)
+     const std::array<int, 3> &periodic_to_add,
+     size_t action_idx)
 #endif // NAIVE
 {// {{{
-    const coord_t *rgrp = grp.coord();
+    const GrpQuery &q = grp_query[grp_idx];
+    const coord_t *rgrp = q.coord;
     const coord_t *rprt = prt.coord();
 
     #ifdef EARLY_RETURN
@@ -252,12 +1376,186 @@ Workspace<AFields>::prt_loop_inner
     #endif // EARLY_RETURN
 
     // check if this particle belongs to the group
-    if (Rsq > grp_radii_sq[grp_idx])
+    if (Rsq > q.Rsq)
         return;
 
     // particle belongs to group: do the user-defined thing with it
-    callback.prt_action(grp_idx, grp, prt, Rsq);
+    #ifdef NAIVE
+    prt_action(grp_idx, grp_idx, grp, prt, Rsq);
+    #else // NAIVE
+    prt_action(grp_idx, action_idx, grp, prt, Rsq);
+    #endif // NAIVE
+}// }}}
+
+template<typename AFields, typename CB>
+__attribute__((hot))
+void
+Workspace<AFields, CB>::prt_loop_batch (void **prt_properties, const CellFrame *frame,
+                                        size_t begin, size_t Nprt, const size_t *candidates,
+                                        size_t grp_idx,
+                                        const typename Callback<AFields>::GrpProperties &grp,
+                                        size_t action_idx)
+{// {{{
+    // kept between calls so we do not allocate for every cell
+    static thread_local std::vector<coord_t> Rsq_all, Rsq_batch;
+    static thread_local std::vector<size_t> idx_batch, aperture_batch;
+
+    const GrpQuery &q = grp_query[grp_idx];
+    const coord_t *rprt = (const coord_t *)prt_properties[0];
+
+    // only grow, so the buffers are not filled for every call
+    if (Rsq_all.size() < Nprt)
+    {
+        Rsq_all.resize(Nprt);
+        Rsq_batch.resize(Nprt);
+        idx_batch.resize(Nprt);
+    }
+    if (grp_Napertures > 1UL && aperture_batch.size() < Nprt)
+        aperture_batch.resize(Nprt);
+
+    coord_t *Rsq = Rsq_all.data();
+    coord_t *Rsq_out = Rsq_batch.data();
+    size_t *idx_out = idx_batch.data();
+
+    #ifdef PRECISE_COORDS
+    const coord_t grp_to_cell[3] = { frame->grp_to_cell[0], frame->grp_to_cell[1], frame->grp_to_cell[2] };
+
+    auto dist = [&grp_to_cell, rprt](size_t prt_idx)
+    {
+        coord_t this_Rsq = (coord_t)0.0;
+        for (size_t kk=0; kk != 3; ++kk)
+        {
+            const coord_t dx = grp_to_cell[kk] + rprt[3UL*prt_idx+kk];
+            this_Rsq += dx * dx;
+        }
+        return this_Rsq;
+    };
+    #else // PRECISE_COORDS
+    (void)frame;
+
+    const coord_t rgrp[3] = { q.coord[0], q.coord[1], q.coord[2] };
+
+    auto dist = [this, &rgrp, rprt](size_t prt_idx)
+    {
+        return GeomUtils::periodic_hypotsq(rgrp, rprt + 3UL*prt_idx, Bsize);
+    };
+    #endif // PRECISE_COORDS
+
+    // two loops, so the contiguous case does not pay for the indirection
+    if (candidates)
+    {
+        #pragma omp simd
+        for (size_t ii=0; ii < Nprt; ++ii)
+            Rsq[ii] = dist(candidates[ii]);
+    }
+    else
+    {
+        #pragma omp simd
+        for (size_t ii=0; ii < Nprt; ++ii)
+            Rsq[ii] = dist(begin+ii);
+    }
+
+    // keep the particles inside the group (without branches, most candidates are rejected)
+    size_t Nbatch = 0UL;
+    for (size_t ii=0; ii != Nprt; ++ii)
+    {
+        idx_out[Nbatch] = (candidates) ? candidates[ii] : begin+ii;
+        Rsq_out[Nbatch] = Rsq[ii];
+        Nbatch += (Rsq[ii] <= q.Rsq);
+    }
+
+    if (!Nbatch)
+        return;
+
+    // the apertures are sorted, so we count the ones each particle is outside of
+    size_t *aperture_out = nullptr;
+    if (grp_Napertures > 1UL)
+    {
+        aperture_out = aperture_batch.data();
+        const coord_t *aperture_Rsq = grp_aperture_Rsq + grp_idx * grp_Napertures;
+
+        #pragma omp simd
+        for (size_t ii=0; ii < Nbatch; ++ii)
+        {
+            size_t aperture_idx = 0UL;
+            for (size_t kk=0; kk != grp_Napertures; ++kk)
+                aperture_idx += (Rsq_out[ii] > aperture_Rsq[kk]);
+            aperture_out[ii] = aperture_idx;
+        }
+    }
+
+    #ifdef PRECISE_COORDS
+    // the callback works with the absolute coordinates, which are written to a scratch buffer
+    // standing in for the coordinate field. The arrays passed begin at the first particle
+    // in the batch, so the scratch buffer only needs to cover the batch
+    static thread_local std::vector<coord_t> abs_coords_all;
+
+    const size_t first = idx_out[0], span = idx_out[Nbatch-1UL] - first + 1UL;
+    if (abs_coords_all.size() < 3UL * span)
+        abs_coords_all.resize(3UL * span);
+
+    coord_t *abs_coords = abs_coords_all.data();
+    for (size_t ii=0; ii != Nbatch; ++ii)
+    {
+        const size_t prt_idx = idx_out[ii];
+        for (size_t kk=0; kk != 3; ++kk)
+            abs_coords[3UL*(prt_idx-first)+kk] = (coord_t)(frame->origin[kk] + (double)rprt[3UL*prt_idx+kk]);
+        idx_out[ii] = prt_idx - first;
+    }
+
+    void *prt_properties_abs[AFields::ParticleFields::Nfields];
+    prt_properties_abs[0] = abs_coords;
+    for (size_t ii=1; ii != AFields::ParticleFields::Nfields; ++ii)
+        prt_properties_abs[ii] = (char *)prt_properties[ii] + first * AFields::ParticleFields::strides_fcoord[ii];
+
+    callback.prt_action_batch(action_idx, grp, Nbatch, idx_out, Rsq_out, aperture_out,
+                              prt_properties_abs, Bsize, prt_type_idx);
+    #else // PRECISE_COORDS
+    callback.prt_action_batch(action_idx, grp, Nbatch, idx_out, Rsq_out, aperture_out,
+                              prt_properties, Bsize, prt_type_idx);
+    #endif // PRECISE_COORDS
+}// }}}
+
+#ifdef PRECISE_COORDS
+template<typename AFields, typename CB>
+__attribute__((hot))
+inline void
+Workspace<AFields, CB>::prt_loop_inner_precise
+    (size_t grp_idx,
+     const typename Callback<AFields>::GrpProperties &grp,
+     const typename Callback<AFields>::PrtProperties &prt,
+     const CellFrame &frame,
+     size_t action_idx)
+{// {{{
+    const GrpQuery &q = grp_query[grp_idx];
+    const coord_t *rprt = prt.coord();
+
+    coord_t Rsq = (coord_t)0.0;
+    for (size_t ii=0; ii != 3; ++ii)
+    {
+        const coord_t dx = frame.grp_to_cell[ii] + rprt[ii];
+        Rsq += dx * dx;
+    }
+
+    // check if this particle belongs to the group
+    if (Rsq > q.Rsq)
+        return;
+
+    // the callback works with the absolute coordinates
+    coord_t abs_coord[3];
+    for (size_t ii=0; ii != 3; ++ii)
+        abs_coord[ii] = (coord_t)(frame.origin[ii] + (double)rprt[ii]);
+
+    void *prt_properties_abs[AFields::ParticleFields::Nfields];
+    prt_properties_abs[0] = abs_coord;
+    for (size_t ii=1; ii != AFields::ParticleFields::Nfields; ++ii)
+        prt_properties_abs[ii] = prt[ii];
+
+    typename Callback<AFields>::PrtProperties prt_abs (Bsize, prt_properties_abs, 0UL, prt.type_idx);
+
+    prt_action(grp_idx, action_idx, grp, prt_abs, Rsq);
 }// }}}
+#endif // PRECISE_COORDS
 
 } // namespace grp_prt_detail
 
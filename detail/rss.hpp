@@ -0,0 +1,44 @@
+#ifndef RSS_HPP
+#define RSS_HPP
+
+#include <cstddef>
+#include <cstdio>
+#include <sys/resource.h>
+#include <unistd.h>
+
+namespace grp_prt_detail {
+
+// the largest resident set size this process has had so far, in bytes
+static inline size_t
+peak_rss ()
+{// {{{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    // Linux reports kilobytes
+    return (size_t)usage.ru_maxrss * 1024UL;
+}// }}}
+
+// the resident set size of this process right now, in bytes
+// (falls back to peak_rss if /proc is not available)
+static inline size_t
+current_rss ()
+{// {{{
+    size_t Npages_total, Npages_resident;
+
+    std::FILE *f = std::fopen("/proc/self/statm", "r");
+    if (!f)
+        return peak_rss();
+
+    const int Nread = std::fscanf(f, "%lu %lu", &Npages_total, &Npages_resident);
+    std::fclose(f);
+
+    if (Nread != 2)
+        return peak_rss();
+
+    return Npages_resident * (size_t)sysconf(_SC_PAGESIZE);
+}// }}}
+
+} // namespace grp_prt_detail
+
+#endif // RSS_HPP
@@ -0,0 +1,499 @@
+#ifndef TASK_POOL_HPP
+#define TASK_POOL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <algorithm>
+
+#include <pthread.h>
+
+#ifdef _OPENMP
+#   include <omp.h>
+#endif // _OPENMP
+
+// GRP_AFFINITY relies on the static assignment of work to OpenMP threads
+#if defined(GRP_AFFINITY) && !defined(NO_WORK_STEALING)
+#   define NO_WORK_STEALING
+#endif // GRP_AFFINITY
+
+namespace grp_prt_detail {
+
+#ifndef NO_WORK_STEALING
+
+struct Task
+{
+    std::function<void()> fn;
+
+    // decremented when fn has returned
+    std::atomic<size_t> *pending;
+
+    // the thread limit of the submitting thread, inherited by the thread executing fn
+    size_t max_threads;
+};
+
+// lock-free work-stealing deque (Chase & Lev 2005, with the memory orderings from Le et al. 2013).
+// The owner pushes and takes at the bottom, other threads steal from the top.
+class TaskDeque
+{// {{{
+    struct Ring
+    {
+        const int64_t size; // power of two
+        std::unique_ptr<std::atomic<Task *>[]> buf;
+
+        Ring (int64_t size_) : size { size_ }, buf { new std::atomic<Task *>[size_] } { }
+
+        Task *get (int64_t idx) const { return buf[idx & (size-1)].load(std::memory_order_relaxed); }
+        void put (int64_t idx, Task *task) { buf[idx & (size-1)].store(task, std::memory_order_relaxed); }
+    };
+
+    static constexpr const int64_t initial_size = 256;
+
+    alignas(64) std::atomic<int64_t> top { 0 };
+    alignas(64) std::atomic<int64_t> bottom { 0 };
+    std::atomic<Ring *> ring;
+
+    // thieves may still read from a ring after it has been replaced,
+    // so we keep all of them until destruction (there are only logarithmically many)
+    std::vector<std::unique_ptr<Ring>> rings;
+
+public :
+    TaskDeque ();
+
+    // only called by the owner
+    void push (Task *task);
+    Task *take ();
+
+    // can be called by any thread, returns nullptr if empty or if we lost a race
+    Task *steal ();
+};// }}}
+
+// pool of worker threads with one TaskDeque each.
+// Threads outside the pool can submit tasks, these go into a shared queue.
+// Threads waiting for tasks to finish execute other tasks in the meantime,
+// so tasks can spawn and wait for their own subtasks.
+// The workers are started when a parallel_for first asks for them.
+class TaskPool
+{// {{{
+    // the deques exist for all workers that can ever be started
+    const size_t max_Nworkers;
+    std::vector<std::unique_ptr<TaskDeque>> deques;
+
+    // the workers that have been started so far
+    std::atomic<size_t> Nworkers { 0 };
+    std::mutex start_mtx;
+
+    // tasks submitted by threads outside the pool
+    std::mutex injected_mtx;
+    std::deque<Task *> injected;
+
+    // to let idle workers sleep
+    std::atomic<size_t> Nqueued { 0 }, Nsleeping { 0 };
+    std::mutex sleep_mtx;
+    std::condition_variable wake;
+
+    // the pool returned by instance, reset in a child process after fork
+    static inline std::atomic<TaskPool *> the_pool { nullptr };
+
+    // the pool the calling thread belongs to and its index in there
+    static inline thread_local TaskPool *this_pool = nullptr;
+    static inline thread_local size_t this_worker_idx = 0UL;
+
+    // limit set with set_max_threads, zero if there is none
+    static inline thread_local size_t this_max_threads = 0UL;
+
+    void worker_main (size_t worker_idx);
+
+    // returns nullptr if no task was found
+    Task *find_task (size_t &seed);
+
+    void run_task (Task *task);
+
+    void submit (Task *task);
+
+    // executes tasks until pending is zero
+    void wait (const std::atomic<size_t> &pending);
+
+    // makes sure at least N workers are running
+    void start_workers (size_t N);
+
+public :
+    TaskPool (size_t max_Nworkers_);
+
+    // the calling thread also executes tasks, so we want one worker less than threads.
+    // Without OpenMP, everything runs on the calling thread.
+    static size_t default_max_Nworkers ();
+
+    // the pool used by the code.
+    // Worker threads do not survive fork, so a child process gets its own pool
+    // (the parent's pool is never destroyed, the workers sleep when idle)
+    static TaskPool &instance ();
+
+    // number of threads a parallel_for started from the calling thread uses
+    // (the workers and the caller).
+    // Read from OpenMP on each call, so omp_set_num_threads and OMP_NUM_THREADS are respected,
+    // unless there is a limit from set_max_threads.
+    size_t Nthreads () const;
+
+    // limits the number of threads used by the parallel_for started from the calling thread,
+    // including the ones nested in them (zero removes the limit).
+    // This lets concurrent stages share the pool with fixed budgets.
+    static void set_max_threads (size_t N) { this_max_threads = N; }
+
+    // index of the calling thread among the threads that can execute this pool's tasks,
+    // one plus the worker index for the workers and zero for any other thread
+    size_t thread_idx () const { return (this_pool == this) ? this_worker_idx + 1UL : 0UL; }
+
+    // upper bound (exclusive) of thread_idx
+    size_t max_thread_idx () const { return max_Nworkers + 1UL; }
+
+    // calls f(sub_begin, sub_end) for disjoint sub-ranges of at most grain elements
+    // covering [begin, end), and returns when all calls have returned.
+    // Can be nested.
+    template<typename F>
+    void parallel_for (size_t begin, size_t end, size_t grain, const F &f);
+};// }}}
+
+// ----- Implementation -----
+
+inline
+TaskDeque::TaskDeque ()
+{// {{{
+    rings.emplace_back(new Ring(initial_size));
+    ring.store(rings.back().get(), std::memory_order_relaxed);
+}// }}}
+
+inline void
+TaskDeque::push (Task *task)
+{// {{{
+    const int64_t b = bottom.load(std::memory_order_relaxed);
+    const int64_t t = top.load(std::memory_order_acquire);
+    Ring *r = ring.load(std::memory_order_relaxed);
+
+    if (b - t > r->size - 1)
+    {
+        // full, grow
+        rings.emplace_back(new Ring(2 * r->size));
+        Ring *new_r = rings.back().get();
+        for (int64_t ii=t; ii != b; ++ii)
+            new_r->put(ii, r->get(ii));
+        ring.store(new_r, std::memory_order_release);
+        r = new_r;
+    }
+
+    r->put(b, task);
+    bottom.store(b+1, std::memory_order_release);
+}// }}}
+
+inline Task *
+TaskDeque::take ()
+{// {{{
+    const int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    Ring *r = ring.load(std::memory_order_relaxed);
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+
+    if (t > b)
+    {
+        // empty
+        bottom.store(b+1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    Task *task = r->get(b);
+
+    if (t == b)
+    {
+        // last element, compete with the thieves
+        if (!top.compare_exchange_strong(t, t+1, std::memory_order_seq_cst,
+                                                 std::memory_order_relaxed))
+            task = nullptr;
+        bottom.store(b+1, std::memory_order_relaxed);
+    }
+
+    return task;
+}// }}}
+
+inline Task *
+TaskDeque::steal ()
+{// {{{
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const int64_t b = bottom.load(std::memory_order_acquire);
+
+    if (t >= b)
+        return nullptr;
+
+    Ring *r = ring.load(std::memory_order_acquire);
+    Task *task = r->get(t);
+
+    if (!top.compare_exchange_strong(t, t+1, std::memory_order_seq_cst,
+                                             std::memory_order_relaxed))
+        return nullptr;
+
+    return task;
+}// }}}
+
+inline
+TaskPool::TaskPool (size_t max_Nworkers_) :
+    max_Nworkers { max_Nworkers_ }
+{// {{{
+    // the deques need to exist before any worker starts stealing
+    for (size_t ii=0; ii != max_Nworkers; ++ii)
+        deques.emplace_back(new TaskDeque);
+}// }}}
+
+inline size_t
+TaskPool::default_max_Nworkers ()
+{// {{{
+    #ifdef _OPENMP
+    const int Nthreads = std::max(omp_get_max_threads(), (int)std::thread::hardware_concurrency());
+    return (size_t)std::max(1, Nthreads) - 1UL;
+    #else // _OPENMP
+    return 0UL;
+    #endif // _OPENMP
+}// }}}
+
+inline size_t
+TaskPool::Nthreads () const
+{// {{{
+    #ifdef _OPENMP
+    const size_t Nrequested = (this_max_threads) ? this_max_threads
+                                                 : (size_t)std::max(1, omp_get_max_threads());
+    #else // _OPENMP
+    const size_t Nrequested = 1UL;
+    #endif // _OPENMP
+    return std::min(Nrequested, max_Nworkers + 1UL);
+}// }}}
+
+inline void
+TaskPool::start_workers (size_t N)
+{// {{{
+    std::lock_guard<std::mutex> lock (start_mtx);
+
+    for (size_t ii=Nworkers.load(); ii < N; ++ii)
+    {
+        std::thread(&TaskPool::worker_main, this, ii).detach();
+
+        // now other threads can steal from this worker
+        Nworkers.store(ii+1UL, std::memory_order_release);
+    }
+}// }}}
+
+inline TaskPool &
+TaskPool::instance ()
+{// {{{
+    // called for every parallel_for, so the common case is a single load
+    TaskPool *pool = the_pool.load(std::memory_order_acquire);
+    if (pool)
+        return *pool;
+
+    static std::mutex mtx;
+    std::lock_guard<std::mutex> lock (mtx);
+
+    pool = the_pool.load(std::memory_order_relaxed);
+    if (!pool)
+    {
+        // only the forking thread exists in the child, so nothing can race with this
+        static const int atfork_registered
+            = pthread_atfork(nullptr, nullptr, []() { the_pool.store(nullptr, std::memory_order_relaxed); });
+        (void)atfork_registered;
+
+        pool = new TaskPool(default_max_Nworkers());
+        the_pool.store(pool, std::memory_order_release);
+    }
+
+    return *pool;
+}// }}}
+
+inline void
+TaskPool::worker_main (size_t worker_idx)
+{// {{{
+    this_pool = this;
+    this_worker_idx = worker_idx;
+
+    size_t seed = worker_idx;
+
+    while (true)
+    {
+        Task *task = find_task(seed);
+
+        if (task)
+        {
+            run_task(task);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock (sleep_mtx);
+        ++Nsleeping;
+        wake.wait(lock, [this](){ return Nqueued.load() > 0; });
+        --Nsleeping;
+    }
+}// }}}
+
+inline Task *
+TaskPool::find_task (size_t &seed)
+{// {{{
+    Task *task = nullptr;
+
+    // our own work first, most recently pushed (depth first)
+    if (this_pool == this)
+        task = deques[this_worker_idx]->take();
+
+    if (!task)
+    {
+        std::lock_guard<std::mutex> lock (injected_mtx);
+        if (!injected.empty())
+        {
+            task = injected.front();
+            injected.pop_front();
+        }
+    }
+
+    // try to steal, starting at a pseudo-random victim
+    const size_t Nvictims = Nworkers.load(std::memory_order_acquire);
+    if (!task && Nvictims)
+    {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        const size_t first = (seed >> 33) % Nvictims;
+        for (size_t ii=0; ii != Nvictims && !task; ++ii)
+        {
+            const size_t victim = (first + ii) % Nvictims;
+            if (this_pool != this || victim != this_worker_idx)
+                task = deques[victim]->steal();
+        }
+    }
+
+    if (task)
+        --Nqueued;
+
+    return task;
+}// }}}
+
+inline void
+TaskPool::run_task (Task *task)
+{// {{{
+    const size_t max_threads = this_max_threads;
+    this_max_threads = task->max_threads;
+
+    task->fn();
+
+    this_max_threads = max_threads;
+    task->pending->fetch_sub(1UL, std::memory_order_release);
+    delete task;
+}// }}}
+
+inline void
+TaskPool::submit (Task *task)
+{// {{{
+    if (this_pool == this)
+        deques[this_worker_idx]->push(task);
+    else
+    {
+        std::lock_guard<std::mutex> lock (injected_mtx);
+        injected.push_back(task);
+    }
+
+    ++Nqueued;
+
+    if (Nsleeping.load())
+    {
+        std::lock_guard<std::mutex> lock (sleep_mtx);
+        wake.notify_one();
+    }
+}// }}}
+
+inline void
+TaskPool::wait (const std::atomic<size_t> &pending)
+{// {{{
+    size_t seed = (size_t)&pending;
+
+    while (pending.load(std::memory_order_acquire))
+    {
+        Task *task = find_task(seed);
+
+        if (task)
+            run_task(task);
+        else
+            std::this_thread::yield();
+    }
+}// }}}
+
+template<typename F>
+void
+TaskPool::parallel_for (size_t begin, size_t end, size_t grain, const F &f)
+{// {{{
+    if (begin >= end) return;
+
+    grain = std::max(grain, 1UL);
+    const size_t Nblocks = (end - begin + grain - 1UL) / grain;
+
+    // the caller and the helpers take blocks in order until none are left,
+    // so at most Nthreads() threads work on this loop at any time
+    const size_t Nhelpers = std::min(Nthreads(), Nblocks) - 1UL;
+
+    if (Nhelpers > Nworkers.load(std::memory_order_relaxed))
+        start_workers(Nhelpers);
+
+    std::atomic<size_t> next_block { 0UL }, pending { Nhelpers };
+
+    auto work = [&]()
+    {
+        for (size_t block_idx; (block_idx = next_block.fetch_add(1UL, std::memory_order_relaxed)) < Nblocks; )
+            f(begin + block_idx * grain, std::min(begin + (block_idx+1UL) * grain, end));
+    };
+
+    for (size_t ii=0; ii != Nhelpers; ++ii)
+        submit(new Task { work, &pending, this_max_threads });
+
+    work();
+
+    wait(pending);
+}// }}}
+
+#endif // NO_WORK_STEALING
+
+// the number of threads parallel_for uses
+inline size_t
+parallel_threads ()
+{// {{{
+    #ifndef NO_WORK_STEALING
+    return TaskPool::instance().Nthreads();
+    #elif defined(_OPENMP)
+    return (size_t)omp_get_max_threads();
+    #else // _OPENMP
+    return 1UL;
+    #endif // NO_WORK_STEALING
+}// }}}
+
+// calls f(sub_begin, sub_end) in parallel for sub-ranges of at most grain elements covering [begin, end),
+// either using the work-stealing TaskPool or (if NO_WORK_STEALING is defined) OpenMP
+template<typename F>
+void
+parallel_for (size_t begin, size_t end, size_t grain, const F &f)
+{// {{{
+    #ifndef NO_WORK_STEALING
+    TaskPool::instance().parallel_for(begin, end, grain, f);
+    #else // NO_WORK_STEALING
+    if (begin >= end) return;
+
+    grain = std::max(grain, 1UL);
+    const size_t Nblocks = (end - begin + grain - 1UL) / grain;
+
+    #pragma omp parallel for schedule(dynamic,1)
+    for (size_t block_idx=0; block_idx < Nblocks; ++block_idx)
+        f(begin + block_idx * grain, std::min(begin + (block_idx+1UL) * grain, end));
+    #endif // NO_WORK_STEALING
+}// }}}
+
+} // namespace grp_prt_detail
+
+#endif // TASK_POOL_HPP
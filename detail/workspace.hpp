@@ -2,49 +2,212 @@
 #define WORKSPACE_HPP
 
 #include <array>
+#include <vector>
+#include <tuple>
+#include <memory>
+#include <string>
+#include <cstdint>
 
 #include "callback.hpp"
 #include "fields.hpp"
+#include "task_pool.hpp"
+#include "arena.hpp"
+
+#if defined(NAIVE) && defined(PRECISE_COORDS)
+#   error "PRECISE_COORDS is only implemented for the sorted particle loop."
+#endif // NAIVE, PRECISE_COORDS
 
 namespace grp_prt_detail {
 
-template<typename AFields>
+// CB is either Callback<AFields> or a StaticCallback<AFields, CB>
+// (in the latter case, prt_action is called without going through the vtable)
+template<typename AFields, typename CB>
 class Workspace
 {
     // where to find the user's functions
     Callback<AFields> &callback;
 
+    // the same object, only used to call prt_action
+    CB &callback_static;
+
     // box size
     coord_t Bsize;
 
+    // whether the particles are passed to Callback::prt_action_batch
+    bool prt_batch = false;
+
+    // number of particle types read from each particle file (Callback::prt_types)
+    size_t prt_Ntypes = 1UL;
+
+    // the type of the particle chunk the loop over groups currently works on
+    // (only one chunk is in that stage at a time)
+    size_t prt_type_idx = 0UL;
+
+    // the particle file the reader has open, so it is opened only once
+    // for all particle types and parts
+    std::shared_ptr<H5::H5File> prt_fptr;
+    size_t prt_fptr_chunk_idx = 0UL;
+
+    // this Workspace only processes the particle chunks with
+    // chunk_idx % prt_Nshards == prt_shard_idx
+    size_t prt_shard_idx = 0UL, prt_Nshards = 1UL;
+
+    // if nonzero, the particle chunks are processed such that the predicted memory usage
+    // stays below this number of bytes (see prt_plan_chunk)
+    size_t mem_budget = 0UL;
+
+    // the memory in use when the budget was set (libraries, the user's data, ...)
+    size_t mem_baseline = 0UL;
+
     // data we need to store permanently
     // (acoording to user-defined selection and radius calculation)
     size_t Ngrp = 0UL;
     size_t alloced_grp = 0UL;
     void *grp_properties[AFields::GroupFields::Nfields];
-    coord_t *grp_radii_sq;
     coord_t *grp_radii;
 
+    // what the particle loop reads for every candidate pair, packed into one array
+    // so a group's data does not straddle cache lines
+    // (the coordinates are a copy of the ones in grp_properties)
+    struct GrpQuery
+    {
+        coord_t coord[3];
+        coord_t Rsq;
+    };
+    GrpQuery *grp_query;
+
+    // the squared apertures of each group if there are several (Callback::grp_apertures),
+    // grp_Napertures*Ngrp elements, otherwise nullptr
+    size_t grp_Napertures = 1UL;
+    coord_t *grp_aperture_Rsq;
+
+    #ifdef PRECISE_COORDS
+    // what has been lost when converting the group coordinates to coord_t
+    // (3*Ngrp elements)
+    coord_t *grp_coord_residuals;
+    #endif // PRECISE_COORDS
+
+    // the temporary buffers are taken from here
+    // (our own, unless one is passed to the constructor to be shared between runs)
+    std::unique_ptr<Arena> own_arena;
+    Arena &arena;
+
     // temporary buffers
     void *tmp_grp_properties[AFields::GroupFields::Nfields];
-    void *tmp_prt_properties[AFields::ParticleFields::Nfields];
 
     void realloc_grp_storage (size_t new_size);
 
     // T is one of GroupFields, ParticleFields
+    // (the buffers are large enough to convert the coordinates in place)
     template<typename T>
     void realloc_tmp_storage (size_t new_size, void **buf);
 
-    // we can also use this function for the initial malloc
-    void realloc_grp_storage_if_necessary ();
+    template<typename T>
+    void free_tmp_storage (void **buf);
 
-    void shrink_grp_storage ();
+    // appends the groups selected from a file
+    // (the storage has been allocated for exactly the selected groups by grp_loop)
+    void store_grps (const void * const *grp_properties_file,
+                     const std::vector<size_t> &selected,
+                     const std::vector<coord_t> &radii,
+                     const std::vector<coord_t> &apertures,
+                     const coord_t *coord_residuals_file);
 
     // everything we need to sort particles
     class Sorting;
 
+    // a particle chunk as it passes through the stages of prt_loop
+    struct PrtChunk
+    {
+        size_t chunk_idx;
+        // the particle type (see Callback::prt_types)
+        size_t type_idx = 0UL;
+        // a file may be processed in several parts to stay within the memory budget,
+        // this one contains the particles [prt_offset, prt_offset+Nprt) of the file
+        size_t sub_idx = 0UL, Nsub = 1UL;
+        size_t prt_offset = 0UL;
+        size_t Nprt = 0UL;
+        // whether the sorted fields replace the unsorted ones (see Sorting)
+        bool inplace = false;
+        void *prt_properties[AFields::ParticleFields::Nfields] = { };
+        #ifdef PRECISE_COORDS
+        // the coordinates are relative to the origin of the cell each particle belongs to,
+        // these are the cell indices (Nprt elements, taken over by prt_sort once that exists)
+        uint32_t *prt_cell_keys = nullptr;
+        #endif // PRECISE_COORDS
+        #ifndef NAIVE
+        std::unique_ptr<Sorting> prt_sort;
+        #endif // NAIVE
+    };
+
+    // maximum number of particle chunks in memory at the same time if Callback::prt_pipeline
+    static constexpr const size_t prt_pipeline_depth = 3UL;
+
+    // number of particles passed to a single call of Callback::prt_modify_bulk
+    static constexpr const size_t prt_modify_span = 65536UL;
+
+    // a file is not split into parts with fewer particles than this
+    static constexpr const size_t prt_sub_min = 65536UL;
+
+    // the memory taken by the group data
+    size_t grp_footprint () const;
+
+    // the memory taken by a chunk of Nprt particles while it is processed
+    size_t prt_footprint (size_t Nprt, bool inplace) const;
+
+    // chooses chunk.Nsub and chunk.inplace such that the memory budget is respected
+    void prt_plan_chunk (size_t Nprt_file, PrtChunk &chunk) const;
+
+    // prints the current resident set size
+    // (in debugging mode, or if there is a memory budget)
+    void report_rss (const std::string &phase) const;
+
+    // describes the chunk for report_rss
+    std::string prt_chunk_str (const PrtChunk &chunk) const;
+
     // --- helper functions for the loops ---
-    
+
+    // the ways to run through the particle chunks
+    void prt_loop_serial ();
+    void prt_loop_pipeline ();
+    // (for Callback::prt_multipass)
+    void prt_loop_multipass ();
+
+    // if set, prt_loop_chunk keeps the sorted chunks in prt_resident instead of freeing them
+    bool prt_keep_resident = false;
+    std::vector<std::unique_ptr<PrtChunk>> prt_resident;
+
+    // applies Callback::grp_update to all groups between the passes
+    void grp_update_all ();
+
+    // the stages each particle chunk passes through :
+    // reading from disk (returns false if there is no chunk with this index),
+    bool prt_read_chunk (size_t chunk_idx, size_t type_idx, size_t sub_idx, PrtChunk &chunk);
+    // coordinate conversion and user modifications,
+    void prt_prepare_chunk (PrtChunk &chunk);
+    // sorting (no-op in the naive loop),
+    void prt_sort_chunk (PrtChunk &chunk);
+    // the loop over groups,
+    void prt_query_chunk (PrtChunk &chunk);
+    // and releasing the memory
+    void prt_free_chunk (PrtChunk &chunk);
+
+    // applies the user's modifications to the particles in the chunk
+    void prt_modify_chunk (PrtChunk &chunk);
+
+    // calls Callback::prt_action, statically dispatched if CB is a StaticCallback
+    void prt_action (size_t grp_idx,
+                     const typename Callback<AFields>::GrpProperties &grp,
+                     const typename Callback<AFields>::PrtProperties &prt,
+                     coord_t Rsq);
+
+    // the same, but fills in PrtProperties::aperture_idx if there are several apertures
+    // (query_idx indexes the stored groups, action_idx is passed to the callback)
+    void prt_action (size_t query_idx, size_t action_idx,
+                     const typename Callback<AFields>::GrpProperties &grp,
+                     const typename Callback<AFields>::PrtProperties &prt,
+                     coord_t Rsq);
+
     // the inner action, invariant under how we do the loops
     // (execept for the periodic_to_add)
     #ifdef NAIVE
@@ -52,19 +215,113 @@ class Workspace
                          const typename Callback<AFields>::GrpProperties &grp,
                          const typename Callback<AFields>::PrtProperties &prt);
     #else // NAIVE
+    // (action_idx is passed to Callback::prt_action instead of grp_idx)
     void prt_loop_inner (size_t grp_idx,
                          const typename Callback<AFields>::GrpProperties &grp,
                          const typename Callback<AFields>::PrtProperties &prt,
-                         const std::array<int,3> &periodic_to_add);
+                         const std::array<int,3> &periodic_to_add,
+                         size_t action_idx);
     #endif // NAIVE
+
+    // with PRECISE_COORDS, the particle coordinates in the sorted store are relative to the
+    // origin of their cell (see Sorting). This is the cell a range of particles belongs to,
+    // as seen from a group
+    struct CellFrame
+    {
+        // from the group to the periodic image of the cell origin closest to the group
+        // (computed in double precision, and small if the group is close)
+        coord_t grp_to_cell[3];
+        // the cell origin, to obtain the absolute coordinates passed to the callback
+        double origin[3];
+    };
+
+    // if Callback::prt_batched : the distances of the particles [begin, begin+Nprt) to the group
+    // (or of the Nprt particles candidates[...] if candidates is not nullptr)
+    // are computed in a vectorizable loop, and the ones inside the group are passed
+    // to Callback::prt_action_batch, together with their aperture indices.
+    // frame is only used if PRECISE_COORDS is defined
+    void prt_loop_batch (void **prt_properties, const CellFrame *frame,
+                         size_t begin, size_t Nprt, const size_t *candidates,
+                         size_t grp_idx,
+                         const typename Callback<AFields>::GrpProperties &grp,
+                         size_t action_idx);
+
+    #ifdef PRECISE_COORDS
+    // same as prt_loop_inner, but the particle coordinates are relative to the cell in frame,
+    // so the distance is accurate to a fraction of the cell size times the float precision
+    // even in large boxes. The callback receives the absolute coordinates
+    void prt_loop_inner_precise (size_t grp_idx,
+                                 const typename Callback<AFields>::GrpProperties &grp,
+                                 const typename Callback<AFields>::PrtProperties &prt,
+                                 const CellFrame &frame,
+                                 size_t action_idx);
+    #endif // PRECISE_COORDS
     
     #ifdef NAIVE
     // the simple loop over all particles
-    void prt_loop_naive (size_t Nprt_this_file);
+    void prt_loop_naive (PrtChunk &chunk);
     #else // NAIVE
     // the more sophisticated loop grouping particles into cells
     // and considering only a subset for each group
-    void prt_loop_sorted (size_t Nprt_this_file);
+    void prt_loop_sorted (PrtChunk &chunk);
+
+    // the cost of a group is estimated as the number of candidate particles
+    // plus prt_cost_per_range for each intersected cell
+    static constexpr const size_t prt_cost_per_range = 16UL;
+
+    // groups are batched into tasks of roughly total cost / (prt_tasks_per_thread * Nthreads)
+    static constexpr const size_t prt_tasks_per_thread = 64UL;
+
+    // groups with cost larger than
+    // max(prt_split_min, total cost / (prt_split_factor * Nthreads))
+    // are split into pieces of prt_split_piece particles
+    // (only if Callback::grp_splittable)
+    static constexpr const size_t prt_split_min    = 65536UL,
+                                  prt_split_factor = 4UL,
+                                  prt_split_piece  = 4096UL;
+
+    // computes the order in which groups are processed, the boundaries of the tasks
+    // in this order, and the groups that should be split across threads.
+    // If GRP_AFFINITY is defined, there is one task per thread containing the groups
+    // in the region of the box whose particles this thread has placed in memory
+    // (useful on multi-socket nodes, with the threads pinned through OMP_PROC_BIND=true)
+    void schedule_grps (Sorting &prt_sort,
+                        std::vector<size_t> &grp_order,
+                        std::vector<size_t> &task_offsets,
+                        std::vector<size_t> &heavy_grps);
+
+    // processes a single group
+    void prt_loop_grp (Sorting &prt_sort, size_t grp_idx);
+
+    // calls prt_loop_inner (or prt_loop_batch) for the particles in range
+    // (which all belong to the same cell).
+    // If QUANTIZED_COORDS is defined, particles that are certainly outside the group
+    // are rejected based on the quantized coordinates, without reading the exact ones
+    void prt_loop_range (Sorting &prt_sort, size_t grp_idx,
+                         const typename Callback<AFields>::GrpProperties &grp,
+                         const std::tuple<size_t,size_t,std::array<int,3>> &range,
+                         size_t action_idx);
+
+    // divides the cells intersected by a heavy group into pieces of prt_split_piece particles
+    void prt_split_pieces (Sorting &prt_sort, size_t grp_idx,
+                           std::vector<std::tuple<size_t,size_t,std::array<int,3>>> &pieces);
+
+    #ifndef NO_WORK_STEALING
+    // part of a heavy group, processed by a single task with its own copy of the group's data
+    struct SplitBlock
+    {
+        size_t grp_idx, clone_idx;
+        std::vector<std::tuple<size_t,size_t,std::array<int,3>>> pieces;
+    };
+
+    // appends one block per thread for this group
+    void prt_split_blocks (Sorting &prt_sort, size_t grp_idx, std::vector<SplitBlock> &blocks);
+
+    void prt_loop_block (Sorting &prt_sort, const SplitBlock &block);
+    #else // NO_WORK_STEALING
+    // processes a single group with all threads
+    void prt_loop_split (Sorting &prt_sort, size_t grp_idx);
+    #endif // NO_WORK_STEALING
     #endif // NAIVE
 
 public :
@@ -72,7 +329,18 @@ public :
     void grp_loop ();
     void prt_loop ();
 
-    Workspace (Callback<AFields> &callback_);
+    // restrict prt_loop to a subset of the particle chunks
+    void prt_shard (size_t shard_idx, size_t Nshards);
+
+    // the memory budget in bytes (zero means no budget)
+    void memory_budget (size_t bytes);
+
+    // runs a single particle chunk through all stages,
+    // returns false if there is no chunk with this index
+    bool prt_loop_chunk (size_t chunk_idx);
+
+    // if arena_ is given, it must outlive this instance
+    Workspace (CB &callback_, Arena *arena_=nullptr);
 
     ~Workspace ();
 
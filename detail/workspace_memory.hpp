@@ -3,88 +3,187 @@
 
 #include <cassert>
 #include <cstdlib>
+#include <cstring>
+#include <vector>
 #include <algorithm>
 
 #include "workspace.hpp"
 
 namespace grp_prt_detail {
 
-template<typename AFields>
-Workspace<AFields>::Workspace (Callback<AFields> &callback_) :
-    callback(callback_)
+template<typename AFields, typename CB>
+Workspace<AFields, CB>::Workspace (CB &callback_, Arena *arena_) :
+    callback(callback_),
+    callback_static(callback_),
+    own_arena(arena_ ? nullptr : new Arena),
+    arena(arena_ ? *arena_ : *own_arena)
 {// {{{
     for (size_t ii=0; ii != AFields::GroupFields::Nfields; ++ii)
     {
         tmp_grp_properties[ii] = nullptr;
         grp_properties[ii] = nullptr;
     }
-    for (size_t ii=0; ii != AFields::ParticleFields::Nfields; ++ii)
-        tmp_prt_properties[ii] = nullptr;
-    grp_radii_sq = nullptr;
-    grp_radii    = nullptr;
+    grp_radii = nullptr;
+    grp_query = nullptr;
+    grp_aperture_Rsq = nullptr;
+    #ifdef PRECISE_COORDS
+    grp_coord_residuals = nullptr;
+    #endif // PRECISE_COORDS
+
+    prt_batch = callback.prt_batched();
+    prt_Ntypes = callback.prt_types();
+    assert(prt_Ntypes);
+    grp_Napertures = callback.grp_Napertures();
+    assert(grp_Napertures);
+
+    #ifndef NO_WORK_STEALING
+    // create the pool now, so the number of workers it can start is determined by the calling thread
+    // and not by one of the prt_loop pipeline stages
+    TaskPool::instance();
+    #endif // NO_WORK_STEALING
 }// }}}
 
-template<typename AFields>
-Workspace<AFields>::~Workspace ()
+template<typename AFields, typename CB>
+Workspace<AFields, CB>::~Workspace ()
 {// {{{
     for (size_t ii=0; ii != AFields::GroupFields::Nfields; ++ii)
-    {
         if (grp_properties[ii])
             std::free(grp_properties[ii]);
-        if (tmp_grp_properties[ii])
-            std::free(tmp_grp_properties[ii]);
-    }
 
-    for (size_t ii=0; ii != AFields::ParticleFields::Nfields; ++ii)
-        if (tmp_prt_properties[ii])
-            std::free(tmp_prt_properties[ii]);
+    free_tmp_storage<typename AFields::GroupFields>(tmp_grp_properties);
 
-    if (grp_radii_sq)
-        std::free(grp_radii_sq);
     if (grp_radii)
         std::free(grp_radii);
+    if (grp_query)
+        std::free(grp_query);
+    if (grp_aperture_Rsq)
+        std::free(grp_aperture_Rsq);
+    #ifdef PRECISE_COORDS
+    if (grp_coord_residuals)
+        std::free(grp_coord_residuals);
+    #endif // PRECISE_COORDS
 }// }}}
 
-template<typename AFields>
-void Workspace<AFields>::realloc_grp_storage (size_t new_size)
+template<typename AFields, typename CB>
+void Workspace<AFields, CB>::realloc_grp_storage (size_t new_size)
 {// {{{
+    // realloc with zero size is implementation-defined, so release the storage explicitly
+    if (!new_size)
+    {
+        for (size_t ii=0; ii != AFields::GroupFields::Nfields; ++ii)
+        {
+            std::free(grp_properties[ii]);
+            grp_properties[ii] = nullptr;
+        }
+
+        std::free(grp_radii);
+        grp_radii = nullptr;
+        std::free(grp_query);
+        grp_query = nullptr;
+        std::free(grp_aperture_Rsq);
+        grp_aperture_Rsq = nullptr;
+        #ifdef PRECISE_COORDS
+        std::free(grp_coord_residuals);
+        grp_coord_residuals = nullptr;
+        #endif // PRECISE_COORDS
+
+        return;
+    }
+
     for (size_t ii=0; ii != AFields::GroupFields::Nfields; ++ii)
         grp_properties[ii] = std::realloc(grp_properties[ii],
                                           new_size * AFields::GroupFields::strides_fcoord[ii]);
 
-    grp_radii_sq = (coord_t *)std::realloc(grp_radii_sq, new_size * sizeof(coord_t));
-    grp_radii    = (coord_t *)std::realloc(grp_radii,    new_size * sizeof(coord_t));
+    grp_radii = (coord_t *)std::realloc(grp_radii, new_size * sizeof(coord_t));
+    grp_query = (GrpQuery *)std::realloc(grp_query, new_size * sizeof(GrpQuery));
+
+    if (grp_Napertures > 1UL)
+        grp_aperture_Rsq = (coord_t *)std::realloc(grp_aperture_Rsq,
+                                                   new_size * grp_Napertures * sizeof(coord_t));
+
+    #ifdef PRECISE_COORDS
+    grp_coord_residuals = (coord_t *)std::realloc(grp_coord_residuals, new_size * 3UL * sizeof(coord_t));
+    #endif // PRECISE_COORDS
+}// }}}
+
+template<typename AFields, typename CB>
+template<typename T>
+void Workspace<AFields, CB>::realloc_tmp_storage (size_t new_size, void **buf)
+{// {{{
+    for (size_t ii=0; ii != T::Nfields; ++ii)
+    {
+        arena.release(buf[ii]);
+        buf[ii] = arena.acquire(new_size * std::max(T::strides[ii], T::strides_fcoord[ii]));
+    }
 }// }}}
 
-template<typename AFields>
+template<typename AFields, typename CB>
 template<typename T>
-void Workspace<AFields>::realloc_tmp_storage (size_t new_size, void **buf)
+void Workspace<AFields, CB>::free_tmp_storage (void **buf)
 {// {{{
     for (size_t ii=0; ii != T::Nfields; ++ii)
     {
-        if (buf[ii]) std::free(buf[ii]);
-        buf[ii] = std::malloc(new_size * T::strides[ii]);
+        arena.release(buf[ii]);
+        buf[ii] = nullptr;
     }
 }// }}}
 
-template<typename AFields>
-void Workspace<AFields>::realloc_grp_storage_if_necessary ()
+template<typename AFields, typename CB>
+void Workspace<AFields, CB>::store_grps (const void * const *grp_properties_file,
+                                     const std::vector<size_t> &selected,
+                                     const std::vector<coord_t> &radii,
+                                     const std::vector<coord_t> &apertures,
+                                     const coord_t *coord_residuals_file)
 {// {{{
-    // check if alloc is necessary
-    if (Ngrp < alloced_grp)
+    assert(selected.size() == radii.size());
+    assert(grp_Napertures == 1UL || apertures.size() == grp_Napertures * radii.size());
+
+    if (selected.empty())
         return;
 
-    assert(Ngrp == alloced_grp);
+    // the storage has been allocated for exactly the selected groups
+    assert(Ngrp + selected.size() <= alloced_grp);
 
-    alloced_grp = std::max(128UL, 2UL * alloced_grp);
-    realloc_grp_storage(alloced_grp);
-}// }}}
+    // copy properties into permanent storage, one field at a time
+    for (size_t ii=0; ii != AFields::GroupFields::Nfields; ++ii)
+    {
+        const size_t stride = AFields::GroupFields::strides_fcoord[ii];
+        char *dst = (char *)(grp_properties[ii]) + Ngrp * stride;
+        const char *src = (const char *)(grp_properties_file[ii]);
 
-template<typename AFields>
-void Workspace<AFields>::shrink_grp_storage ()
-{// {{{
-    alloced_grp = Ngrp + 1UL;
-    realloc_grp_storage(alloced_grp);
+        for (size_t jj=0; jj != selected.size(); ++jj)
+            std::memcpy(dst + jj * stride, src + selected[jj] * stride, stride);
+    }
+
+    for (size_t jj=0; jj != selected.size(); ++jj)
+    {
+        const coord_t *coord = (const coord_t *)(grp_properties_file[0]) + 3UL * selected[jj];
+
+        grp_radii[Ngrp+jj] = radii[jj];
+
+        GrpQuery &q = grp_query[Ngrp+jj];
+        for (size_t kk=0; kk != 3; ++kk)
+            q.coord[kk] = coord[kk];
+        q.Rsq = radii[jj] * radii[jj];
+
+        if (grp_Napertures > 1UL)
+            for (size_t kk=0; kk != grp_Napertures; ++kk)
+            {
+                const coord_t R = apertures[jj * grp_Napertures + kk];
+                grp_aperture_Rsq[(Ngrp+jj) * grp_Napertures + kk] = R * R;
+            }
+
+        #ifdef PRECISE_COORDS
+        std::memcpy(grp_coord_residuals + 3UL * (Ngrp+jj), coord_residuals_file + 3UL * selected[jj],
+                    3UL * sizeof(coord_t));
+        #endif // PRECISE_COORDS
+    }
+
+    #ifndef PRECISE_COORDS
+    (void)coord_residuals_file;
+    #endif // PRECISE_COORDS
+
+    Ngrp += selected.size();
 }// }}}
 
 } // namespace grp_prt_detail
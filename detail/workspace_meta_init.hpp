@@ -7,9 +7,9 @@
 
 namespace grp_prt_detail {
 
-template<typename AFields>
+template<typename AFields, typename CB>
 void
-Workspace<AFields>::meta_init ()
+Workspace<AFields, CB>::meta_init ()
 {
     std::string fname;
 
@@ -23,6 +23,13 @@ Workspace<AFields>::meta_init ()
     callback.prt_chunk(0, fname);
     auto fptr_prt = std::make_shared<H5::H5File>(fname, H5F_ACC_RDONLY);
     callback.read_prt_meta_init(fptr_prt);
+
+    // the box size is needed before any particle chunk is read
+    // (which is not necessarily the first one)
+    size_t Nprt_0;
+    callback.read_prt_meta(0, fptr_prt, Bsize, Nprt_0);
+    Bsize *= callback.prt_coord_rescale();
+
     fptr_prt->close();
 }
 
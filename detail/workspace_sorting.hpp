@@ -5,27 +5,30 @@
 #include <utility>
 #include <tuple>
 #include <cstdlib>
+#include <cstdint>
 #include <algorithm>
 #include <cstring>
 #include <cassert>
 #include <cmath>
 
+#ifdef _OPENMP
+#   include <omp.h>
+#endif // _OPENMP
+
 #include "fields.hpp"
 #include "workspace.hpp"
 #include "geom_utils.hpp"
+#include "task_pool.hpp"
+#include "arena.hpp"
 #include "timing.hpp"
 
 // TODO
-// put parallel execution policy into std::sort
-// (depending on preprocessor flag)
-//
-//
 // choose Ncells dynamically depending on box size / group radii ratio?
 
 namespace grp_prt_detail {
 
-template<typename AFields>
-class Workspace<AFields>::Sorting
+template<typename AFields, typename CB>
+class Workspace<AFields, CB>::Sorting
 {// {{{
     coord_t Bsize;
     const size_t Nprt;
@@ -33,22 +36,88 @@ class Workspace<AFields>::Sorting
     static constexpr const size_t Ncells_side = 64UL;
     static constexpr const size_t Ncells_tot  = Ncells_side * Ncells_side * Ncells_side;
     coord_t acell;
+
+    // number of particles gathered at a time by a single thread in reorder_prt_properties
+    static constexpr const size_t reorder_block = 16384UL;
+
+    // number of particles processed by a single task in the other parallel loops
+    static constexpr const size_t parallel_grain = 65536UL;
+
+    // the counting sort keeps one histogram over all cells for each block of particles,
+    // the blocks are at least this large so the histograms are small compared to the particle data
+    static constexpr const size_t count_block_min = 1UL << 20;
     
-    // stores particle index in original particle order (first) and index in cells (second)
-    std::vector<std::pair<size_t, size_t>> prt_indices;
+    // the buffers below are taken from here
+    Arena &arena;
+
+    // particle indices and offsets are stored as 32 bit integers,
+    // unless the chunk has too many particles for that
+    const bool wide_idx;
 
-    // stores where particles belonging to a specific cell are in the array
-    // special value : Nprt (no particles in cell)
-    std::vector<size_t> offsets;
+    // cell index of each particle in original particle order
+    // (Nprt elements, only needed during construction)
+    uint32_t *cell_keys;
 
-    // this is given by constructor, no memory allocation necessary
+    // original index of each particle in sorted order
+    // (Nprt elements of type uint32_t, or uint64_t if wide_idx)
+    void *perm;
+
+    // the particles belonging to cell ii are [offsets[ii], offsets[ii+1]) in sorted order
+    // (Ncells_tot+1 elements of type uint32_t, or uint64_t if wide_idx)
+    void *offsets;
+
+    // this is given by constructor, no memory allocation necessary.
+    // If inplace, the pointers in here are replaced by the sorted buffers
+    // (which are then owned by the caller)
     void **tmp_prt_properties;
 
+    // whether the sorted fields replace the unsorted ones (see reorder_prt_properties_inplace)
+    const bool inplace;
+
+    // the cell a coordinate belongs to (in one direction)
+    template<typename T>
+    static size_t grid_idx (T x, T acell)
+    { return std::min((size_t)(x / acell), Ncells_side-1UL); }
+
     // stuff that happens during construction
-    void compute_prt_indices ();
-    void sort_prt_indices ();
+    void compute_cell_keys ();
+    template<typename idx_t>
+    void counting_sort ();
     void reorder_prt_properties ();
-    void compute_offsets ();
+    void reorder_prt_properties_inplace ();
+
+    #ifdef QUANTIZED_COORDS
+    // number of quantization steps per cell side
+    static constexpr const size_t Nqsteps = 65536UL;
+
+    // particle coordinates relative to the origin of their cell, in units of acell/Nqsteps
+    // (3*Nprt elements, in sorted order)
+    uint16_t *qcoords;
+
+    void compute_qcoords ();
+    #endif // QUANTIZED_COORDS
+
+    size_t offset (size_t cell_idx) const
+    {
+        return wide_idx ? ((const uint64_t *)offsets)[cell_idx]
+                        : ((const uint32_t *)offsets)[cell_idx];
+    }
+
+    #ifdef PRECISE_COORDS
+    // the cell the particle at prt_idx in sorted order belongs to
+    size_t cell_of (size_t prt_idx) const;
+    #endif // PRECISE_COORDS
+
+    // the sorted particles are divided into Nslabs contiguous slabs of equal size,
+    // this is where slab slab_idx begins
+    size_t slab_begin (size_t slab_idx, size_t Nslabs) const { return Nprt * slab_idx / Nslabs; }
+
+    // copies the particles [begin, end) in sorted order for a field with element size stride
+    template<typename idx_t, size_t stride>
+    void gather_field (size_t begin, size_t end, const char *src, char *dest) const;
+    template<typename idx_t>
+    void gather_field (size_t begin, size_t end, size_t stride, const char *src, char *dest) const;
+    void gather_field (size_t begin, size_t end, size_t stride, const char *src, char *dest) const;
 
     class Geometry
     {
@@ -63,10 +132,17 @@ class Workspace<AFields>::Sorting
     };
 
 public :
-    Sorting (size_t Nprt_, coord_t Bsize_, void **tmp_prt_properties_);
+    // if cell_keys_ is given, these are the cell indices of the particles (see cell_coords),
+    // the instance takes them over. Otherwise they are computed from the coordinates
+    Sorting (size_t Nprt_, coord_t Bsize_, void **tmp_prt_properties_, Arena &arena_, bool inplace_,
+             uint32_t *cell_keys_=nullptr);
     Sorting () = delete;
     ~Sorting ();
 
+    // upper bound on the memory an instance with these arguments takes from the arena
+    // at any time (not counting tmp_prt_properties)
+    static size_t footprint (size_t Nprt, bool inplace);
+
     // store the sorted properties here (instance must allocate memory for this!)
     // user can access these
     void *tmp_prt_properties_sorted[AFields::ParticleFields::Nfields];
@@ -77,43 +153,106 @@ public :
     std::vector<std::tuple<size_t, size_t, std::array<int,3>>> prt_idx_ranges
         (const coord_t grp_coord[3],
          const coord_t R, const coord_t Rsq) const;
+
+    // the slab (see reorder_prt_properties) in which the particles around
+    // a group's center are stored
+    size_t slab_of (const coord_t grp_coord[3], size_t Nslabs) const;
+
+    #ifdef PRECISE_COORDS
+    // With PRECISE_COORDS, the particle coordinates are stored relative to the origin
+    // of their cell, the cell index carries the high bits.
+    // The offsets are floats, but as they are smaller than the cell size they are about
+    // Ncells_side times more accurate than the absolute coordinates.
+
+    // converts the coordinates of Nprt particles (3 values of type T each, multiplied by rescale)
+    // in place to the offsets from their cell origin, computed in double precision,
+    // and writes the cell indices to cell_keys (Nprt elements)
+    template<typename T>
+    static void cell_coords (size_t Nprt, coord_t Bsize, coord_t rescale,
+                             void *coords, uint32_t *cell_keys);
+
+    // the inverse of cell_coords, in place (rounded to coord_t)
+    static void abs_coords (size_t Nprt, coord_t Bsize, coord_t *coords, const uint32_t *cell_keys);
+
+    // same as cell_coords (with T=coord_t) for absolute coordinates obtained from abs_coords
+    // that may have been modified since. For the unmodified ones, the offsets cell_coords_before
+    // are kept if given, so they do not lose precision
+    static void cell_coords_modified (size_t Nprt, coord_t Bsize, coord_t *coords, uint32_t *cell_keys,
+                                      const coord_t *cell_coords_before);
+    #endif // PRECISE_COORDS
+
+    #if defined(QUANTIZED_COORDS) || defined(PRECISE_COORDS)
+    // origin of the cell the particle at prt_idx in sorted order belongs to
+    template<typename T>
+    void cell_origin (size_t prt_idx, T origin[3]) const;
+
+    coord_t cell_size () const { return acell; }
+    #endif // QUANTIZED_COORDS, PRECISE_COORDS
+
+    #ifdef QUANTIZED_COORDS
+    // the quantized coordinates of the particle at prt_idx in sorted order
+    // (the true position is within one step of cell origin + (qcoord + 1/2) * step)
+    const uint16_t *qcoord (size_t prt_idx) const { return qcoords + 3UL * prt_idx; }
+
+    coord_t qstep () const { return acell / (coord_t)Nqsteps; }
+    #endif // QUANTIZED_COORDS
 };// }}}
 
 // ----- Implementation -----
 
-template<typename AFields>
-Workspace<AFields>::Sorting::Sorting (size_t Nprt_,
+template<typename AFields, typename CB>
+Workspace<AFields, CB>::Sorting::Sorting (size_t Nprt_,
                                       coord_t Bsize_,
-                                      void **tmp_prt_properties_) :
+                                      void **tmp_prt_properties_,
+                                      Arena &arena_,
+                                      bool inplace_,
+                                      uint32_t *cell_keys_) :
     Nprt { Nprt_ }, Bsize { Bsize_ }, tmp_prt_properties { tmp_prt_properties_ },
+    inplace { inplace_ },
     acell { Bsize_ / Ncells_side },
-    prt_indices { }, offsets { }
+    arena { arena_ },
+    wide_idx { Nprt_ > (size_t)UINT32_MAX },
+    cell_keys { cell_keys_ }, perm { nullptr }, offsets { nullptr }
+    #ifdef QUANTIZED_COORDS
+    , qcoords { nullptr }
+    #endif // QUANTIZED_COORDS
 {// {{{
     #ifndef NDEBUG
     TIME_PT(t1);
     #endif // NDEBUG
-    compute_prt_indices();
+    if (!cell_keys)
+        compute_cell_keys();
     #ifndef NDEBUG
-    TIME_MSG(t1,"Sorting::compute_prt_indices");
+    TIME_MSG(t1,"Sorting::compute_cell_keys");
     #endif // NDEBUG
 
     #ifndef NDEBUG
     TIME_PT(t2);
     #endif // NDEBUG
-    sort_prt_indices();
+    if (wide_idx)
+        counting_sort<uint64_t>();
+    else
+        counting_sort<uint32_t>();
     #ifndef NDEBUG
-    TIME_MSG(t2, "Sorting::sort_prt_indices");
+    TIME_MSG(t2, "Sorting::counting_sort");
     #endif // NDEBUG
 
-    #ifndef NDEBUG
-    TIME_PT(t3);
-    #endif // NDEBUG
-    // allocate memory where we can store the sorted particle properties
-    for (size_t ii=0; ii != AFields::ParticleFields::Nfields; ++ii)
-        tmp_prt_properties_sorted[ii] = std::malloc(Nprt * AFields::ParticleFields::strides_fcoord[ii]);
-    #ifndef NDEBUG
-    TIME_MSG(t3, "Sorting memory allocation");
-    #endif // NDEBUG
+    // the keys are not needed anymore, so the memory can be used for the sorted properties
+    arena.release(cell_keys);
+    cell_keys = nullptr;
+
+    if (!inplace)
+    {
+        #ifndef NDEBUG
+        TIME_PT(t3);
+        #endif // NDEBUG
+        // allocate memory where we can store the sorted particle properties
+        for (size_t ii=0; ii != AFields::ParticleFields::Nfields; ++ii)
+            tmp_prt_properties_sorted[ii] = arena.acquire(Nprt * AFields::ParticleFields::strides_fcoord[ii]);
+        #ifndef NDEBUG
+        TIME_MSG(t3, "Sorting memory allocation");
+        #endif // NDEBUG
+    }
 
     #ifndef NDEBUG
     TIME_PT(t4);
@@ -123,89 +262,477 @@ Workspace<AFields>::Sorting::Sorting (size_t Nprt_,
     TIME_MSG(t4, "Sorting::reorder_prt_properties");
     #endif // NDEBUG
 
-    #ifndef NDEBUG
+    #ifdef QUANTIZED_COORDS
+    #   ifndef NDEBUG
     TIME_PT(t5);
-    #endif // NDEBUG
-    compute_offsets();
-    #ifndef NDEBUG
-    TIME_MSG(t5, "Sorting::compute_offsets");
-    #endif // NDEBUG
+    #   endif // NDEBUG
+    compute_qcoords();
+    #   ifndef NDEBUG
+    TIME_MSG(t5, "Sorting::compute_qcoords");
+    #   endif // NDEBUG
+    #endif // QUANTIZED_COORDS
+}// }}}
+
+template<typename AFields, typename CB>
+Workspace<AFields, CB>::Sorting::~Sorting ()
+{// {{{
+    if (!inplace)
+        for (size_t ii=0; ii != AFields::ParticleFields::Nfields; ++ii)
+            arena.release(tmp_prt_properties_sorted[ii]);
+
+    arena.release(cell_keys);
+    arena.release(perm);
+    arena.release(offsets);
+
+    #ifdef QUANTIZED_COORDS
+    arena.release(qcoords);
+    #endif // QUANTIZED_COORDS
 }// }}}
 
-template<typename AFields>
-Workspace<AFields>::Sorting::~Sorting ()
+template<typename AFields, typename CB>
+size_t
+Workspace<AFields, CB>::Sorting::footprint (size_t Nprt, bool inplace)
 {// {{{
+    const size_t idx_size = (Nprt > (size_t)UINT32_MAX) ? sizeof(uint64_t) : sizeof(uint32_t);
+    const size_t Nblocks = std::max(1UL, std::min(parallel_threads(), Nprt / count_block_min));
+
+    size_t sorted = 0UL;
     for (size_t ii=0; ii != AFields::ParticleFields::Nfields; ++ii)
-        std::free(tmp_prt_properties_sorted[ii]);
+        sorted = inplace ? std::max(sorted, AFields::ParticleFields::strides_fcoord[ii])
+                         : sorted + AFields::ParticleFields::strides_fcoord[ii];
+
+    // the keys and histograms are released before the sorted fields are allocated
+    size_t out = Nprt * idx_size + (Ncells_tot+1UL) * idx_size
+                 + std::max(Nprt * sizeof(uint32_t) + Nblocks * Ncells_tot * idx_size,
+                            Nprt * sorted);
+
+    #ifdef QUANTIZED_COORDS
+    out += 3UL * Nprt * sizeof(uint16_t);
+    #endif // QUANTIZED_COORDS
+
+    return out;
 }// }}}
 
-template<typename AFields>
+template<typename AFields, typename CB>
 void
-Workspace<AFields>::Sorting::compute_prt_indices ()
+Workspace<AFields, CB>::Sorting::compute_cell_keys ()
 {// {{{
-    prt_indices.reserve(Nprt);
-    auto *prt_coord = (coord_t *)tmp_prt_properties[0];
+    static_assert(Ncells_tot <= (size_t)UINT32_MAX);
+
+    cell_keys = (uint32_t *)arena.acquire(Nprt * sizeof(uint32_t));
+    const auto *prt_coord = (const coord_t *)tmp_prt_properties[0];
 
-    #define GRID(x, dir) (std::min((size_t)(x[dir] / acell), Ncells_side-1UL))
+    #define GRID(x, dir) (grid_idx(x[dir], acell))
 
-    for (size_t prt_idx=0; prt_idx != Nprt;
-         ++prt_idx, prt_coord += 3)
-        prt_indices.emplace_back(prt_idx, Ncells_side * Ncells_side * GRID(prt_coord, 0)
-                                          +             Ncells_side * GRID(prt_coord, 1)
-                                          +                           GRID(prt_coord, 2));
+    parallel_for(0UL, Nprt, parallel_grain, [this, prt_coord](size_t begin, size_t end)
+    {
+        for (size_t prt_idx=begin; prt_idx != end; ++prt_idx)
+        {
+            const coord_t *x = prt_coord + 3UL * prt_idx;
+            cell_keys[prt_idx] = (uint32_t)(Ncells_side * Ncells_side * GRID(x, 0)
+                                            +             Ncells_side * GRID(x, 1)
+                                            +                           GRID(x, 2));
+        }
+    });
 
     #undef GRID
 }// }}}
 
-template<typename AFields>
+template<typename AFields, typename CB>
+template<typename idx_t>
 void
-Workspace<AFields>::Sorting::sort_prt_indices ()
+Workspace<AFields, CB>::Sorting::counting_sort ()
 {// {{{
-    std::sort(prt_indices.begin(), prt_indices.end(),
-              [](std::pair<size_t,size_t> a,
-                 std::pair<size_t,size_t> b)
-              { return a.second < b.second; } );
+    // since there are not many cells, we do not need a comparison sort.
+    // The counting sort is stable, i.e. within a cell the particles stay in their original order,
+    // so the result does not depend on the number of threads
+
+    perm = arena.acquire(Nprt * sizeof(idx_t));
+    offsets = arena.acquire((Ncells_tot+1UL) * sizeof(idx_t));
+
+    idx_t *this_perm = (idx_t *)perm;
+    idx_t *this_offsets = (idx_t *)offsets;
+
+    const size_t Nblocks = std::max(1UL, std::min(parallel_threads(), Nprt / count_block_min));
+    auto block_begin = [this, Nblocks](size_t block_idx) { return Nprt * block_idx / Nblocks; };
+
+    // first number of particles per block and cell,
+    // later where the next particle of the block goes in the sorted order
+    idx_t *counts = (idx_t *)arena.acquire(Nblocks * Ncells_tot * sizeof(idx_t));
+
+    parallel_for(0UL, Nblocks, 1UL, [this, counts, &block_begin](size_t begin, size_t end)
+    {
+        for (size_t block_idx=begin; block_idx != end; ++block_idx)
+        {
+            idx_t *this_counts = counts + block_idx * Ncells_tot;
+            std::fill(this_counts, this_counts+Ncells_tot, (idx_t)0);
+
+            for (size_t prt_idx=block_begin(block_idx); prt_idx != block_begin(block_idx+1UL); ++prt_idx)
+                ++this_counts[cell_keys[prt_idx]];
+        }
+    });
+
+    parallel_for(0UL, Ncells_tot, parallel_grain, [counts, this_offsets, Nblocks](size_t begin, size_t end)
+    {
+        for (size_t cell_idx=begin; cell_idx != end; ++cell_idx)
+        {
+            idx_t Nprt_cell = 0;
+            for (size_t block_idx=0; block_idx != Nblocks; ++block_idx)
+                Nprt_cell += counts[block_idx * Ncells_tot + cell_idx];
+            this_offsets[cell_idx] = Nprt_cell;
+        }
+    });
+
+    idx_t running = 0;
+    for (size_t cell_idx=0; cell_idx != Ncells_tot; ++cell_idx)
+    {
+        const idx_t Nprt_cell = this_offsets[cell_idx];
+        this_offsets[cell_idx] = running;
+        running += Nprt_cell;
+    }
+    this_offsets[Ncells_tot] = running;
+    assert(running == Nprt);
+
+    // within a cell, the blocks come in order
+    parallel_for(0UL, Ncells_tot, parallel_grain, [counts, this_offsets, Nblocks](size_t begin, size_t end)
+    {
+        for (size_t cell_idx=begin; cell_idx != end; ++cell_idx)
+        {
+            idx_t next = this_offsets[cell_idx];
+            for (size_t block_idx=0; block_idx != Nblocks; ++block_idx)
+            {
+                const idx_t Nprt_cell = counts[block_idx * Ncells_tot + cell_idx];
+                counts[block_idx * Ncells_tot + cell_idx] = next;
+                next += Nprt_cell;
+            }
+        }
+    });
+
+    parallel_for(0UL, Nblocks, 1UL, [this, counts, this_perm, &block_begin](size_t begin, size_t end)
+    {
+        for (size_t block_idx=begin; block_idx != end; ++block_idx)
+        {
+            idx_t *this_counts = counts + block_idx * Ncells_tot;
+
+            for (size_t prt_idx=block_begin(block_idx); prt_idx != block_begin(block_idx+1UL); ++prt_idx)
+                this_perm[this_counts[cell_keys[prt_idx]]++] = (idx_t)prt_idx;
+        }
+    });
+
+    arena.release(counts);
+}// }}}
+
+template<typename AFields, typename CB>
+template<typename idx_t, size_t stride>
+inline void
+Workspace<AFields, CB>::Sorting::gather_field (size_t begin, size_t end,
+                                           const char *src, char *dest) const
+{// {{{
+    const idx_t *this_perm = (const idx_t *)perm;
+
+    // stride is known at compile time here, so the memcpy turns into simple moves
+    for (size_t prt_idx=begin; prt_idx != end; ++prt_idx)
+        std::memcpy(dest + prt_idx * stride, src + (size_t)this_perm[prt_idx] * stride, stride);
 }// }}}
 
-template<typename AFields>
+template<typename AFields, typename CB>
+template<typename idx_t>
+inline void
+Workspace<AFields, CB>::Sorting::gather_field (size_t begin, size_t end, size_t stride,
+                                           const char *src, char *dest) const
+{// {{{
+    const idx_t *this_perm = (const idx_t *)perm;
+
+    switch (stride)
+    {
+        case  1UL : gather_field<idx_t,  1UL>(begin, end, src, dest); break;
+        case  2UL : gather_field<idx_t,  2UL>(begin, end, src, dest); break;
+        case  4UL : gather_field<idx_t,  4UL>(begin, end, src, dest); break;
+        case  8UL : gather_field<idx_t,  8UL>(begin, end, src, dest); break;
+        case 12UL : gather_field<idx_t, 12UL>(begin, end, src, dest); break;
+        case 16UL : gather_field<idx_t, 16UL>(begin, end, src, dest); break;
+        case 24UL : gather_field<idx_t, 24UL>(begin, end, src, dest); break;
+        default :
+            for (size_t prt_idx=begin; prt_idx != end; ++prt_idx)
+                std::memcpy(dest + prt_idx * stride, src + (size_t)this_perm[prt_idx] * stride, stride);
+    }
+}// }}}
+
+template<typename AFields, typename CB>
+inline void
+Workspace<AFields, CB>::Sorting::gather_field (size_t begin, size_t end, size_t stride,
+                                           const char *src, char *dest) const
+{// {{{
+    if (wide_idx)
+        gather_field<uint64_t>(begin, end, stride, src, dest);
+    else
+        gather_field<uint32_t>(begin, end, stride, src, dest);
+}// }}}
+
+template<typename AFields, typename CB>
 void
-Workspace<AFields>::Sorting::reorder_prt_properties ()
+Workspace<AFields, CB>::Sorting::reorder_prt_properties ()
 {// {{{
-    assert(prt_indices.size() == Nprt);
+    if (inplace)
+    {
+        reorder_prt_properties_inplace();
+        return;
+    }
+
+    #ifndef NO_WORK_STEALING
+    // blocks of particles are gathered for all fields at once, so the source data stays in cache
+    parallel_for(0UL, Nprt, reorder_block, [this](size_t begin, size_t end)
+    {
+        for (size_t ii=0; ii != AFields::ParticleFields::Nfields; ++ii)
+            gather_field(begin, end, AFields::ParticleFields::strides_fcoord[ii],
+                         (const char *)(tmp_prt_properties[ii]),
+                         (char *)(tmp_prt_properties_sorted[ii]));
+    });
+    #else // NO_WORK_STEALING
+    // each thread gathers all fields for a contiguous slab of the sorted particles.
+    // Since the sorted order is spatial, this means that the pages of the sorted arrays
+    // are first touched (and thus placed on the NUMA node of) the thread that works
+    // on the corresponding region of the box in the group loop (if GRP_AFFINITY is defined)
+    #pragma omp parallel
+    {
+        #ifdef _OPENMP
+        const size_t Nslabs = omp_get_num_threads(), slab_idx = omp_get_thread_num();
+        #else // _OPENMP
+        const size_t Nslabs = 1UL, slab_idx = 0UL;
+        #endif // _OPENMP
+
+        const size_t slab_end = slab_begin(slab_idx+1UL, Nslabs);
+
+        // work in blocks so the source data of all fields stays in cache
+        for (size_t begin=slab_begin(slab_idx, Nslabs); begin < slab_end; begin += reorder_block)
+            for (size_t ii=0; ii != AFields::ParticleFields::Nfields; ++ii)
+                gather_field(begin, std::min(begin + reorder_block, slab_end),
+                             AFields::ParticleFields::strides_fcoord[ii],
+                             (const char *)(tmp_prt_properties[ii]),
+                             (char *)(tmp_prt_properties_sorted[ii]));
+    } // parallel
+    #endif // NO_WORK_STEALING
+}// }}}
 
+template<typename AFields, typename CB>
+void
+Workspace<AFields, CB>::Sorting::reorder_prt_properties_inplace ()
+{// {{{
+    // the fields are sorted one after the other into a scratch buffer which then replaces
+    // the unsorted one. The unsorted buffer is returned to the arena, where it serves as scratch
+    // for the next field, so at most one field buffer exists in addition to the particle data.
+    // The price is that the source data of the other fields is not in cache anymore.
     for (size_t ii=0; ii != AFields::ParticleFields::Nfields; ++ii)
     {
-        char *dest = (char *)(tmp_prt_properties_sorted[ii]);
+        const size_t stride = AFields::ParticleFields::strides_fcoord[ii];
+        const char *src = (const char *)(tmp_prt_properties[ii]);
+        char *dest = (char *)arena.acquire(Nprt * stride);
+
+        #ifndef NO_WORK_STEALING
+        parallel_for(0UL, Nprt, reorder_block, [this, stride, src, dest](size_t begin, size_t end)
+        {
+            gather_field(begin, end, stride, src, dest);
+        });
+        #else // NO_WORK_STEALING
+        // see reorder_prt_properties for why each thread works on a slab
+        #pragma omp parallel
+        {
+            #ifdef _OPENMP
+            const size_t Nslabs = omp_get_num_threads(), slab_idx = omp_get_thread_num();
+            #else // _OPENMP
+            const size_t Nslabs = 1UL, slab_idx = 0UL;
+            #endif // _OPENMP
+
+            gather_field(slab_begin(slab_idx, Nslabs), slab_begin(slab_idx+1UL, Nslabs),
+                         stride, src, dest);
+        } // parallel
+        #endif // NO_WORK_STEALING
+
+        arena.release(tmp_prt_properties[ii]);
+        tmp_prt_properties[ii] = tmp_prt_properties_sorted[ii] = dest;
+    }
+}// }}}
+
+#ifdef PRECISE_COORDS
+template<typename AFields, typename CB>
+template<typename T>
+void
+Workspace<AFields, CB>::Sorting::cell_coords (size_t Nprt, coord_t Bsize, coord_t rescale,
+                                          void *coords, uint32_t *cell_keys)
+{// {{{
+    // the same cells as in compute_cell_keys, but from the coordinates before rounding
+    const double acell = (double)(Bsize / Ncells_side);
+
+    const T *x = (const T *)coords;
+    coord_t *offsets = (coord_t *)coords;
+
+    // in place, so this must run serially (each particle is read completely before it is written).
+    // If T is wider than coord_t, we can work from the front, otherwise from the back
+    for (size_t ii=0; ii != Nprt; ++ii)
+    {
+        const size_t prt_idx = (sizeof(T) >= sizeof(coord_t)) ? ii : Nprt-1UL-ii;
+
+        double this_x[3];
+        for (size_t kk=0; kk != 3; ++kk)
+            this_x[kk] = (double)x[3UL*prt_idx+kk] * (double)rescale;
+
+        size_t cell_idx = 0UL;
+        for (size_t kk=0; kk != 3; ++kk)
+        {
+            const size_t idx = grid_idx(this_x[kk], acell);
+            cell_idx = Ncells_side * cell_idx + idx;
+            offsets[3UL*prt_idx+kk] = (coord_t)(this_x[kk] - (double)idx * acell);
+        }
+        cell_keys[prt_idx] = (uint32_t)cell_idx;
+    }
+}// }}}
+
+template<typename AFields, typename CB>
+void
+Workspace<AFields, CB>::Sorting::abs_coords (size_t Nprt, coord_t Bsize,
+                                         coord_t *coords, const uint32_t *cell_keys)
+{// {{{
+    const double acell = (double)(Bsize / Ncells_side);
+
+    parallel_for(0UL, Nprt, parallel_grain, [acell, coords, cell_keys](size_t begin, size_t end)
+    {
+        for (size_t prt_idx=begin; prt_idx != end; ++prt_idx)
+        {
+            size_t cell_idx = cell_keys[prt_idx];
+            for (size_t kk=3; kk-- != 0; cell_idx /= Ncells_side)
+                coords[3UL*prt_idx+kk] = (coord_t)((double)(cell_idx % Ncells_side) * acell
+                                                   + (double)coords[3UL*prt_idx+kk]);
+        }
+    });
+}// }}}
+
+template<typename AFields, typename CB>
+void
+Workspace<AFields, CB>::Sorting::cell_coords_modified (size_t Nprt, coord_t Bsize,
+                                                   coord_t *coords, uint32_t *cell_keys,
+                                                   const coord_t *cell_coords_before)
+{// {{{
+    const double acell = (double)(Bsize / Ncells_side);
+
+    parallel_for(0UL, Nprt, parallel_grain,
+                 [acell, coords, cell_keys, cell_coords_before](size_t begin, size_t end)
+    {
+        for (size_t prt_idx=begin; prt_idx != end; ++prt_idx)
+        {
+            size_t cell_idx = cell_keys[prt_idx];
+            size_t new_cell_idx = 0UL;
+
+            for (size_t kk=0; kk != 3; ++kk)
+            {
+                const size_t stride = (kk == 0) ? Ncells_side * Ncells_side : (kk == 1) ? Ncells_side : 1UL;
+                size_t idx = (cell_idx / stride) % Ncells_side;
+                coord_t &x = coords[3UL*prt_idx+kk];
+
+                // the same value as abs_coords gave means the coordinate has not been modified
+                if (!cell_coords_before
+                    || x != (coord_t)((double)idx * acell + (double)cell_coords_before[3UL*prt_idx+kk]))
+                {
+                    idx = grid_idx((double)x, acell);
+                    x = (coord_t)((double)x - (double)idx * acell);
+                }
+                else
+                    x = cell_coords_before[3UL*prt_idx+kk];
+
+                new_cell_idx = Ncells_side * new_cell_idx + idx;
+            }
 
-        for (size_t prt_idx=0; prt_idx != Nprt; ++prt_idx, dest += AFields::ParticleFields::strides_fcoord[ii])
-            std::memcpy(dest, (char *)(tmp_prt_properties[ii])
-                              + prt_indices[prt_idx].first * AFields::ParticleFields::strides_fcoord[ii],
-                        AFields::ParticleFields::strides_fcoord[ii]);
+            cell_keys[prt_idx] = (uint32_t)new_cell_idx;
+        }
+    });
+}// }}}
+
+template<typename AFields, typename CB>
+size_t
+Workspace<AFields, CB>::Sorting::cell_of (size_t prt_idx) const
+{// {{{
+    assert(prt_idx < Nprt);
+
+    // the last cell beginning at or before prt_idx (empty cells begin where the next one does)
+    size_t lo = 0UL, hi = Ncells_tot;
+    while (hi - lo > 1UL)
+    {
+        const size_t mid = (lo + hi) / 2UL;
+        if (offset(mid) <= prt_idx)
+            lo = mid;
+        else
+            hi = mid;
     }
+
+    return lo;
 }// }}}
+#endif // PRECISE_COORDS
 
-template<typename AFields>
+#ifdef QUANTIZED_COORDS
+template<typename AFields, typename CB>
 void
-Workspace<AFields>::Sorting::compute_offsets ()
+Workspace<AFields, CB>::Sorting::compute_qcoords ()
 {// {{{
-    assert(offsets.empty());
+    qcoords = (uint16_t *)arena.acquire(3UL * Nprt * sizeof(uint16_t));
+    const auto *prt_coord = (const coord_t *)tmp_prt_properties_sorted[0];
+
+    parallel_for(0UL, Nprt, parallel_grain, [this, prt_coord](size_t begin, size_t end)
+    {
+        for (size_t ii=3UL*begin; ii != 3UL*end; ++ii)
+        {
+            #ifdef PRECISE_COORDS
+            // the coordinates are already relative to the cell origin
+            const coord_t q = prt_coord[ii] / acell * (coord_t)Nqsteps;
+            #else // PRECISE_COORDS
+            const size_t cell = grid_idx(prt_coord[ii], acell);
+            const coord_t q = (prt_coord[ii] - (coord_t)cell * acell) / acell * (coord_t)Nqsteps;
+            #endif // PRECISE_COORDS
+            qcoords[ii] = (uint16_t)std::min(std::max(q, (coord_t)0.0), (coord_t)(Nqsteps-1UL));
+        }
+    });
+}// }}}
 
-    // initialize all offsets to default value
-    offsets.reserve(Ncells_tot+1UL);
-    for (size_t ii=0; ii != Ncells_tot+1UL; ++ii)
-        offsets.push_back(Nprt);
+#endif // QUANTIZED_COORDS
+
+#if defined(QUANTIZED_COORDS) || defined(PRECISE_COORDS)
+template<typename AFields, typename CB>
+template<typename T>
+inline void
+Workspace<AFields, CB>::Sorting::cell_origin (size_t prt_idx, T origin[3]) const
+{// {{{
+    #ifdef PRECISE_COORDS
+    // the coordinates are relative to the cell, so the cell index has to be looked up
+    size_t cell_idx = cell_of(prt_idx);
+    for (size_t ii=3; ii-- != 0; cell_idx /= Ncells_side)
+        origin[ii] = (T)(cell_idx % Ncells_side) * (T)acell;
+    #else // PRECISE_COORDS
+    const auto *prt_coord = (const coord_t *)tmp_prt_properties_sorted[0] + 3UL * prt_idx;
+
+    for (size_t ii=0; ii != 3; ++ii)
+        origin[ii] = (T)grid_idx(prt_coord[ii], acell) * (T)acell;
+    #endif // PRECISE_COORDS
+}// }}}
+#endif // QUANTIZED_COORDS, PRECISE_COORDS
+
+template<typename AFields, typename CB>
+size_t
+Workspace<AFields, CB>::Sorting::slab_of (const coord_t grp_coord[3], size_t Nslabs) const
+{// {{{
+    #define GRID(x, dir) (grid_idx(x[dir], acell))
+    const size_t cell_idx = Ncells_side * Ncells_side * GRID(grp_coord, 0)
+                            +             Ncells_side * GRID(grp_coord, 1)
+                            +                           GRID(grp_coord, 2);
+    #undef GRID
 
-    offsets[prt_indices[0].second] = 0UL;
+    // the first particle in this or the next non-empty cell
+    const size_t prt_idx = std::min(offset(cell_idx), Nprt-1UL);
 
-    for (size_t jj=1UL; jj != Nprt; ++jj)
-        if (prt_indices[jj].second != prt_indices[jj-1UL].second)
-            // we have found the beginning of a new cell
-            offsets[prt_indices[jj].second] = jj;
+    // invert slab_begin
+    return std::min(((prt_idx+1UL) * Nslabs - 1UL) / Nprt, Nslabs-1UL);
 }// }}}
 
-template<typename AFields>
+template<typename AFields, typename CB>
 std::vector<std::tuple<size_t, size_t, std::array<int,3>>>
-Workspace<AFields>::Sorting::prt_idx_ranges
+Workspace<AFields, CB>::Sorting::prt_idx_ranges
     (const coord_t grp_coord[3], coord_t R, coord_t Rsq) const
 {// {{{
     std::vector<std::tuple<size_t, size_t, std::array<int,3>>> out;
@@ -241,24 +768,13 @@ Workspace<AFields>::Sorting::prt_idx_ranges
                 coord_t cub_coord[] = { (coord_t)xx, (coord_t)yy, (coord_t)zz };
 
                 if (Geometry::sph_cub_intersect(grp_coord_normalized, cub_coord, Rsq_normalized)
-                    && offsets[ii] < Nprt)
+                    && offset(ii) < offset(ii+1UL))
                 {
                     #define PER(x) ((x>=Ncells_side) ? 1 : (x<0) ? -1 : 0)
                     std::array<int,3> periodic_to_add { PER(xx), PER(yy), PER(zz) };
                     #undef PER
 
-                    std::tuple<size_t, size_t, std::array<int,3>> idx_range
-                        { offsets[ii], Nprt, periodic_to_add };
-
-                    // find the last one -- taking possibly empty cells that follow into account!
-                    for (size_t jj=(size_t)ii+1UL; jj != Ncells_tot; ++jj)
-                        if (offsets[jj] < Nprt)
-                        {
-                            std::get<1>(idx_range) = offsets[jj];
-                            break;
-                        }
-                    
-                    out.push_back(idx_range);
+                    out.emplace_back(offset(ii), offset(ii+1UL), periodic_to_add);
                 }
             }
         }
@@ -267,9 +783,9 @@ Workspace<AFields>::Sorting::prt_idx_ranges
     return out;
 }// }}}
 
-template<typename AFields>
+template<typename AFields, typename CB>
 inline bool
-Workspace<AFields>::Sorting::Geometry::sph_cub_intersect
+Workspace<AFields, CB>::Sorting::Geometry::sph_cub_intersect
     (const coord_t grp_coord[3],
      coord_t cub_coord[3],
      coord_t grp_Rsq)
@@ -284,18 +800,18 @@ Workspace<AFields>::Sorting::Geometry::sph_cub_intersect
 }// }}}
 
 // no periodic boudary conditions!!!
-template<typename AFields>
+template<typename AFields, typename CB>
 inline void
-Workspace<AFields>::Sorting::Geometry::mod_translations
+Workspace<AFields, CB>::Sorting::Geometry::mod_translations
     (const coord_t grp_coord[3], coord_t cub_coord[3])
 {// {{{
     for (size_t ii=0; ii != 3; ++ii)
         cub_coord[ii] -= grp_coord[ii];
 }// }}}
 
-template<typename AFields>
+template<typename AFields, typename CB>
 inline void
-Workspace<AFields>::Sorting::Geometry::mod_reflections
+Workspace<AFields, CB>::Sorting::Geometry::mod_reflections
     (coord_t cub_coord[3])
 {// {{{
     for (size_t ii=0; ii != 3; ++ii)
@@ -51,138 +51,54 @@ namespace CAMELS_prof
 
     using AF = AllFields<GrpF, PrtF>; /*!< @brief bundle the group and particle fields */
 
-    /*! @brief stores profiles for a single halo */
-    class Profile
-    {// {{{
-        using GrpProperties = typename Callback<AF>::GrpProperties;
-        using PrtProperties = typename Callback<AF>::PrtProperties;
-
-        // all internal calculations in this type
-        using value_type = double;
-
-        // number of sample points
-        static constexpr size_t N = 128;
-
-        std::vector<value_type> pressure;
-        std::vector<value_type> electron_density;
-        std::vector<value_type> temperature;
-        std::vector<size_t> num_part;
-        coord_t logRmin, logRmax, dlogR;
-
-        // volume of spherical shells, used for save
-        value_type shell_vol (size_t idx) const
-        {// {{{
-            // innermost shell goes right to the origin
-            if (idx == 0UL)
-                return 4.0 * M_PI / 3.0 * std::exp(3.0 * logRmin);
-            
-            // other shells are between two spheres
-            value_type logR1 = (value_type)logRmin + (value_type)dlogR * (value_type)(idx-1UL);
-            value_type logR2 = (value_type)logRmin + (value_type)dlogR * (value_type)(idx);
-            return 4.0 * M_PI / 3.0 * ( std::exp(3.0*logR2) - std::exp(3.0*logR1) );
-        }// }}}
+    // all internal calculations regarding the profiles in these types
+    using prof_value_t = double;
+    static constexpr const prof_value_t gamma = 5.0/3.0, XH = 0.76;
 
-    public :
-        // we can only construct from a Group
-        Profile () = delete;
+    /*! @brief the electron pressure of a particle times its volume, to be binned into the profiles.
+     *
+     * As explained in the documentation for #CallbackUtils::prt_action::RadialProfile,
+     * this can be any type with a call operator taking the particle properties.
+     */
+    struct ElectronPressure
+    {// {{{
+        prof_value_t operator() (const Callback<AF>::PrtProperties &prt) const
+        {
+            auto m = (prof_value_t)prt.get<SimFields::Masses>();
+            auto e = (prof_value_t)prt.get<SimFields::InternalEnergy>();
+            auto x = (prof_value_t)prt.get<SimFields::ElectronAbundance>();
+            return 4.0 * x * XH / (1.0+3.0*XH+4.0*XH*x) * (gamma-1.0) * m * e;
+        }
+    };// }}}
 
-        /*! @brief constructs from group properties (we need to read the radius)
-         *
-         * As explained in the documentation for #CallbackUtils::prt_action::StorePrtHomogeneous,
-         * if the data type stored for each group has a constructor from a
-         * `const GrpProperties &`, this constructor will be called during
-         * the calls to #Callback::grp_action.
-         * We use this fact to read the group radius.
-         */
-        Profile (const GrpProperties &grp)
-        {// {{{
-            pressure.resize(N, 0.0);
-            electron_density.resize(N, 0.0);
-            temperature.resize(N, 0.0);
-
-            num_part.resize(N, 0UL);
-            logRmin = std::log(0.03F * grp.get<SimFields::Group_R_Crit200>());
-            logRmax = std::log(2.50F * grp.get<SimFields::Group_R_Crit200>());
-            dlogR = (logRmax - logRmin) / (coord_t)(N-1);
-        }// }}}
-
-        /*! @brief adds a particle to the profiles
-         *
-         * This function computes the electron pressure, electron density, and temperature
-         * associated with a particle and adds it (weighted with its volume)
-         * to the appropriate profile bin.
-         *
-         * Note that this exact signature and function name is required,
-         * as explained in the documentation for #CallbackUtils::prt_action::StorePrtHomogeneous.
-         */
-        void prt_insert (size_t, const GrpProperties &,
-                         const PrtProperties &prt, coord_t Rsq)
-        {// {{{
-            coord_t logR = (coord_t)0.5 * std::log(Rsq);
-            if (logR > logRmax)
-                return;
-
-            // figure out the index of the spherical shell the particle falls into
-            size_t idx;
-
-            if (logR < logRmin)
-                idx = 0UL;
-            else
-                idx = 1UL + (size_t)((logR - logRmin) / dlogR);
-
-            // safety check against numerical issues
-            if (idx >= N)
-                return;
-
-            // load the required properties of this particle
-            auto m = (value_type)prt.get<SimFields::Masses>();
-            auto d = (value_type)prt.get<SimFields::Density>();
-            auto e = (value_type)prt.get<SimFields::InternalEnergy>();
-            auto x = (value_type)prt.get<SimFields::ElectronAbundance>();
-
-            static constexpr const value_type gamma = 5.0/3.0, XH = 0.76;
-
-            // this is electron pressure * particle volume
-            auto P = 4.0 * x * XH / (1.0+3.0*XH+4.0*XH*x)
-                         * (gamma-1.0) * m * e;
-
-            // this is electron density * particle volume
-            auto rho_e = x * XH * m;
-
-            // this is temperature * particle volume
-            auto T = (gamma-1.0) * e * 4.0 / (1.0+3.0*XH+4.0*XH*x) * m / d;
-
-            pressure[idx] += P;
-            electron_density[idx] += rho_e;
-            temperature[idx] += T;
-            ++num_part[idx];
-        }// }}}
-
-        /*! @brief append these profiles to files.
-         *
-         * @attention it is assumed that this instance is "dead" after this
-         *            function is called!
-         */
-        void save (std::FILE *fpressure, std::FILE *felectron_density, std::FILE *ftemperature, std::FILE *fnum_part)
-        {// {{{
-            for (size_t ii=0; ii != N; ++ii)
-            {
-                pressure[ii] /= shell_vol(ii);
-                electron_density[ii] /= shell_vol(ii);
-                temperature[ii] /= shell_vol(ii);
-            }
+    /*! @brief the electron density of a particle times its volume */
+    struct ElectronDensity
+    {// {{{
+        prof_value_t operator() (const Callback<AF>::PrtProperties &prt) const
+        {
+            auto m = (prof_value_t)prt.get<SimFields::Masses>();
+            auto x = (prof_value_t)prt.get<SimFields::ElectronAbundance>();
+            return x * XH * m;
+        }
+    };// }}}
 
-            std::fwrite(pressure.data(), sizeof(value_type), N, fpressure);
-            std::fwrite(electron_density.data(), sizeof(value_type), N, felectron_density);
-            std::fwrite(temperature.data(), sizeof(value_type), N, ftemperature);
-            std::fwrite(num_part.data(), sizeof(size_t), N, fnum_part);
-        }// }}}
+    /*! @brief the temperature of a particle times its volume */
+    struct Temperature
+    {// {{{
+        prof_value_t operator() (const Callback<AF>::PrtProperties &prt) const
+        {
+            auto m = (prof_value_t)prt.get<SimFields::Masses>();
+            auto d = (prof_value_t)prt.get<SimFields::Density>();
+            auto e = (prof_value_t)prt.get<SimFields::InternalEnergy>();
+            auto x = (prof_value_t)prt.get<SimFields::ElectronAbundance>();
+            return (gamma-1.0) * e * 4.0 / (1.0+3.0*XH+4.0*XH*x) * m / d;
+        }
     };// }}}
-    
+
     using grp_M_t = double; /*!< @brief type to which M200c will be converted */
     using grp_R_t = double; /*!< @brief type to which R200c will be converted */
     using grp_P_t = double; /*!< @brief type to which P200c will be converted */
-    using grp_prof_t = Profile; /*!< @brief type the pressure profiles will be stored in */
+    using grp_prof_t = prof_value_t; /*!< @brief type the profiles will be stored in */
 
     /*! @brief stores P200c for each group */
     class grp_store_P :
@@ -233,6 +149,9 @@ namespace CAMELS_prof
     // maximum radius (in units of R_200c) -- from Battaglia's plots
     constexpr SimFields::Group_R_Crit200::value_type Rscale = 2.5;
 
+    // number of sample points, the innermost one goes right to the origin
+    constexpr size_t N = 128;
+
     /*! @brief group and particle files are in multiple chunks */
     using chunk = CallbackUtils::chunk::Single<AF>;
 
@@ -265,8 +184,9 @@ namespace CAMELS_prof
     /*! @brief store R200c in a vector */
     using grp_store_R = CallbackUtils::grp_action::StoreGrpProperty<AF, SimFields::Group_R_Crit200, grp_R_t>;
 
-    /*! @brief store a #CAMELS_prof::Profile instance for each group */
-    using prt_compute_prof = CallbackUtils::prt_action::StorePrtHomogeneous<AF, grp_prof_t>;
+    /*! @brief accumulate the pressure, electron density, and temperature profiles, in units of R200c */
+    using prt_compute_prof = CallbackUtils::prt_action::RadialProfile<AF, SimFields::Group_R_Crit200,
+                                                                      ElectronPressure, ElectronDensity, Temperature>;
 
 
 } // namespace CAMELS_prof }}}
@@ -290,13 +210,34 @@ struct CAMELS_prof_callback :
         CAMELS_prof::grp_store_M { grp_M },
         CAMELS_prof::grp_store_R { grp_R },
         CAMELS_prof::grp_store_P { grp_P },
-        CAMELS_prof::prt_compute_prof { grp_prof }
+        CAMELS_prof::prt_compute_prof { grp_prof,
+                                        CAMELS_prof::prt_compute_prof::log_edges(0.03F, CAMELS_prof::Rscale, CAMELS_prof::N-1UL),
+                                        CAMELS_prof::ElectronPressure { }, CAMELS_prof::ElectronDensity { },
+                                        CAMELS_prof::Temperature { } }
     { }
 
     std::vector<CAMELS_prof::grp_M_t> grp_M; /*!< @brief M200c data vector */
     std::vector<CAMELS_prof::grp_R_t> grp_R; /*!< @brief R200c data vector */
     std::vector<CAMELS_prof::grp_P_t> grp_P; /*!< @brief P200c data vector */
-    std::vector<CAMELS_prof::grp_prof_t> grp_prof; /*!< @brief profiles data vector */
+    std::vector<CAMELS_prof::grp_prof_t> grp_prof; /*!< @brief profiles data vector (and particle numbers) */
+
+    /*! @brief append the profiles to files, each divided by the shell volume */
+    void save (std::FILE *fpressure, std::FILE *felectron_density, std::FILE *ftemperature, std::FILE *fnum_part) const
+    {// {{{
+        const size_t Ncols = CAMELS_prof::prt_compute_prof::Ncols;
+        for (size_t grp_idx=0; grp_idx != grp_M.size(); ++grp_idx)
+            for (size_t ii=0; ii != CAMELS_prof::N; ++ii)
+            {
+                const CAMELS_prof::grp_prof_t *p = grp_prof.data() + (grp_idx * CAMELS_prof::N + ii) * Ncols;
+                const CAMELS_prof::grp_prof_t vol = shell_volume(grp_idx, ii),
+                                              P = p[1] / vol, rho_e = p[2] / vol, T = p[3] / vol;
+                const size_t num_part = (size_t)p[0];
+                std::fwrite(&P, sizeof(CAMELS_prof::grp_prof_t), 1, fpressure);
+                std::fwrite(&rho_e, sizeof(CAMELS_prof::grp_prof_t), 1, felectron_density);
+                std::fwrite(&T, sizeof(CAMELS_prof::grp_prof_t), 1, ftemperature);
+                std::fwrite(&num_part, sizeof(size_t), 1, fnum_part);
+            }
+    }// }}}
 
 private :
     using Callback<CAMELS_prof::AF>::GrpProperties;
@@ -352,8 +293,7 @@ int main (int argc, char **argv)
         std::sprintf(fname_buffer, "%s/grp_num_part_prof.bin", dout);
         auto fnum_part = std::fopen(fname_buffer, "wb");
 
-        for (auto &prof : C.grp_prof)
-            prof.save(fpressure, felectron_density, ftemperature, fnum_part);
+        C.save(fpressure, felectron_density, ftemperature, fnum_part);
 
         std::fclose(fpressure);
         std::fclose(felectron_density);
@@ -43,85 +43,10 @@ namespace dens_prof
 
     using AF = AllFields<GrpF, PrtF>;
 
-    class dens_prof_data
-    {
-        using GrpProperties = typename Callback<AF>::GrpProperties;
-        using PrtProperties = typename Callback<AF>::PrtProperties;
-        using value_type = double;
-
-        static constexpr size_t N = 128;
-
-        std::vector<value_type> dens;
-        coord_t logRmin, logRmax, dlogR;
-
-        // volume of spherical shells, used for save
-        value_type shell_vol (size_t idx) const
-        {// {{{
-            // innermost shell goes right to the origin
-            if (idx == 0UL)
-                return 4.0 * M_PI / 3.0 * std::exp(3.0 * logRmin);
-            
-            // other shells are between two spheres
-            value_type logR1 = (value_type)logRmin + (value_type)dlogR * (value_type)(idx-1UL);
-            value_type logR2 = (value_type)logRmin + (value_type)dlogR * (value_type)(idx);
-            return 4.0 * M_PI / 3.0 * ( std::exp(3.0*logR2) - std::exp(3.0*logR1) );
-        }// }}}
-
-    public :
-        dens_prof_data () = delete;
-
-        dens_prof_data(const GrpProperties &grp)
-        {
-            dens.resize(N, 0.0);
-            logRmin = std::log(0.03F * grp.get<IllustrisFields::Group_R_Crit200>());
-            logRmax = std::log(2.50F * grp.get<IllustrisFields::Group_R_Crit200>());
-            dlogR = (logRmax - logRmin) / (coord_t)(N-1);
-        }
-
-        void prt_insert (size_t, const GrpProperties,
-                         const PrtProperties &prt, coord_t Rsq)
-        {
-            coord_t logR = (coord_t)0.5 * std::log(Rsq);
-            if (logR > logRmax)
-                return;
-
-            // figure out the index of the spherical shell the particle falls into
-            size_t idx;
-
-            if (logR < logRmin)
-                idx = 0UL;
-            else
-                idx = 1UL + (size_t)((logR - logRmin) / dlogR);
-
-            // safety check against numerical issues
-            if (idx >= N)
-                return;
-
-            #ifndef DM
-            const auto m = prt.get<IllustrisFields::Masses>();
-            #else // DM
-            const value_type m = 1.0;
-            #endif // DM
-
-            dens[idx] += m;
-        }
-
-        #ifdef DM
-        void normalize_mass (value_type unit_mass)
-        {
-            for (size_t ii=0; ii != N; ++ii)
-                dens[ii] *= unit_mass;
-        }
-        #endif
-
-        void save (std::FILE *f)
-        {
-            for (size_t ii=0; ii != N; ++ii)
-                dens[ii] /= shell_vol(ii);
+    using grp_dens_t = double;
 
-            std::fwrite(dens.data(), sizeof(value_type), N, f);
-        }
-    };
+    // number of sample points, the innermost one goes right to the origin
+    constexpr size_t N = 128;
 
     constexpr IllustrisFields::Group_R_Crit200::value_type Rscale = 2.5;
     using chunk = CallbackUtils::chunk::Multi<AF>;
@@ -132,7 +57,13 @@ namespace dens_prof
     #endif // DM
     using grp_select_M = CallbackUtils::select::LowCutoff<AF, IllustrisFields::Group_M_Crit200>;
     using grp_radius = CallbackUtils::radius::Simple<AF, IllustrisFields::Group_R_Crit200>;
-    using prt_compute_dens_prof = CallbackUtils::prt_action::StorePrtHomogeneous<AF, dens_prof_data>;
+    #ifndef DM
+    using prt_compute_dens_prof = CallbackUtils::prt_action::RadialProfile<AF, IllustrisFields::Group_R_Crit200,
+                                                                           CallbackUtils::prt_action::weight::Property<IllustrisFields::Masses>>;
+    #else // DM
+    // all DM particles have the same mass, so we only need the particle numbers
+    using prt_compute_dens_prof = CallbackUtils::prt_action::RadialProfile<AF, IllustrisFields::Group_R_Crit200>;
+    #endif // DM
 } // namespace dens_prof
 
 struct dens_prof_callback :
@@ -148,18 +79,32 @@ struct dens_prof_callback :
         dens_prof::chunk { fgrp, grp_max_idx, fprt, prt_max_idx },
         dens_prof::grp_select_M { Mmin },
         dens_prof::grp_radius { dens_prof::Rscale },
-        dens_prof::prt_compute_dens_prof { grp_dens_prof }
+        dens_prof::prt_compute_dens_prof { grp_dens_prof,
+                                           dens_prof::prt_compute_dens_prof::log_edges(0.03F, dens_prof::Rscale, dens_prof::N-1UL)
+                                           #ifndef DM
+                                           , CallbackUtils::prt_action::weight::Property<IllustrisFields::Masses> { }
+                                           #endif // DM
+                                         }
     { }
 
-    std::vector<dens_prof::dens_prof_data> grp_dens_prof;
+    std::vector<dens_prof::grp_dens_t> grp_dens_prof;
 
-    #ifdef DM
-    void normalize_mass ()
+    void save (std::FILE *f) const
     {
-        for (auto &dens_prof_item : grp_dens_prof)
-            dens_prof_item.normalize_mass(MassTable[dens_prof::PartType]);
+        const size_t Ncols = dens_prof::prt_compute_dens_prof::Ncols;
+        for (size_t grp_idx=0; grp_idx != grp_dens_prof.size() / (dens_prof::N * Ncols); ++grp_idx)
+            for (size_t ii=0; ii != dens_prof::N; ++ii)
+            {
+                const dens_prof::grp_dens_t *p = grp_dens_prof.data() + (grp_idx * dens_prof::N + ii) * Ncols;
+                #ifndef DM
+                const dens_prof::grp_dens_t m = p[1];
+                #else // DM
+                const dens_prof::grp_dens_t m = p[0] * MassTable[dens_prof::PartType];
+                #endif // DM
+                const dens_prof::grp_dens_t dens = m / shell_volume(grp_idx, ii);
+                std::fwrite(&dens, sizeof(dens_prof::grp_dens_t), 1, f);
+            }
     }
-    #endif
 
 private :
     using Callback<dens_prof::AF>::GrpProperties;
@@ -185,10 +130,6 @@ int main (int argc, char *argv[])
 
     group_particles<> ( d );
 
-    #ifdef DM
-    d.normalize_mass();
-    #endif
-
     #if defined GAS
     #   define TYPE "GAS"
     #elif defined DM
@@ -202,8 +143,7 @@ int main (int argc, char *argv[])
     #define ROOT "DEFINE YOUR OUTPUT PATH HERE"
 
     auto f = std::fopen(std::string(std::string(ROOT)+std::string("/dens_prof_")+std::string(TYPE)+std::string("_")+std::string(argv[1])+std::string(".bin")).c_str(), "wb");
-    for (auto &dens_prof_item : d.grp_dens_prof)
-        dens_prof_item.save(f);
+    d.save(f);
     std::fclose(f);
 
     #undef TYPE
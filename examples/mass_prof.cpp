@@ -69,109 +69,16 @@ namespace mass_prof
 
     using AF = AllFields<GrpF, PrtF>; /*!< @brief bundle the group and particle fields */
 
-    /*! @brief stores profiles for a single halo */
-    class Profile
-    {// {{{
-        using GrpProperties = typename Callback<AF>::GrpProperties;
-        using PrtProperties = typename Callback<AF>::PrtProperties;
-
-        // all internal calculations in this type
-        using value_type = double;
-
-        // number of sample points
-        static constexpr size_t N = 128;
-
-        std::vector<value_type> encl_mass;
-        coord_t logRmin, logRmax, dlogR;
-
-    public :
-        // we can only construct from a Group
-        Profile () = delete;
-
-        /*! @brief constructs from group properties (we need to read the radius)
-         *
-         * As explained in the documentation for #CallbackUtils::prt_action::StorePrtHomogeneous,
-         * if the data type stored for each group has a constructor from a
-         * `const GrpProperties &`, this constructor will be called during
-         * the calls to #Callback::grp_action.
-         * We use this fact to read the group radius.
-         */
-        Profile (const GrpProperties &grp)
-        {// {{{
-            encl_mass.resize(N, 0.0);
-
-            logRmin = std::log(0.03F * grp.get<SimFields::Group_R_Crit200>());
-            logRmax = std::log(2.50F * grp.get<SimFields::Group_R_Crit200>());
-
-            dlogR = (logRmax - logRmin) / (coord_t)(N-1);
-        }// }}}
-
-        /*! @brief adds a particle to the profiles
-         *
-         * This function computes the electron pressure, electron density, and temperature
-         * associated with a particle and adds it (weighted with its volume)
-         * to the appropriate profile bin.
-         *
-         * Note that this exact signature and function name is required,
-         * as explained in the documentation for #CallbackUtils::prt_action::StorePrtHomogeneous.
-         */
-        void prt_insert (size_t, const GrpProperties &,
-                         const PrtProperties &prt, coord_t Rsq)
-        {// {{{
-            coord_t logR = (coord_t)0.5 * std::log(Rsq);
-            if (logR > logRmax)
-                return;
-
-            // figure out the index of the spherical shell the particle falls into
-            size_t idx;
-
-            if (logR < logRmin)
-                idx = 0UL;
-            else
-                idx = 1UL + (size_t)((logR - logRmin) / dlogR);
-
-            // safety check against numerical issues
-            if (idx >= N)
-                return;
-
-            // load the required properties of this particle
-            #ifdef MASSES_AVAIL
-            auto m = (value_type)prt.get<SimFields::Masses>();
-            #else // MASSES_AVAIL
-            value_type m = 1.0;
-            #endif // MASSES_AVAIL
-
-            for (size_t ii=idx; ii < N; ++ii)
-                encl_mass[ii] += m;
-        }// }}}
-
-        #ifndef MASSES_AVAIL
-        void normalize_mass (value_type unit_mass)
-        {// {{{
-            for (size_t ii=0; ii != N; ++ii)
-                encl_mass[ii] *= unit_mass;
-        }// }}}
-        #endif
-
-        /*! @brief append these profiles to files.
-         *
-         * @attention it is assumed that this instance is "dead" after this
-         *            function is called!
-         */
-        void save (std::FILE *f) const
-        {// {{{
-            std::fwrite(encl_mass.data(), sizeof(value_type), N, f);
-        }// }}}
-    };// }}}
-    
     using grp_M_t = double; /*!< @brief type to which M200c will be converted */
     using grp_R_t = double; /*!< @brief type to which R200c will be converted */
-    using grp_P_t = double; /*!< @brief type to which P200c will be converted */
-    using grp_prof_t = Profile; /*!< @brief type the pressure profiles will be stored in */
+    using grp_prof_t = double; /*!< @brief type the mass profiles will be stored in */
 
     // maximum radius (in units of R_200c) -- from Battaglia's plots
     constexpr SimFields::Group_R_Crit200::value_type Rscale = 2.5;
 
+    // number of sample points, the innermost one goes right to the origin
+    constexpr size_t N = 128;
+
     /*! @brief group and particle files are in multiple chunks */
     using chunk = CallbackUtils::chunk::Single<AF>;
     
@@ -208,8 +115,16 @@ namespace mass_prof
     /*! @brief store R200c in a vector */
     using grp_store_R = CallbackUtils::grp_action::StoreGrpProperty<AF, SimFields::Group_R_Crit200, grp_R_t>;
 
-    /*! @brief store a #mass_prof::Profile instance for each group */
-    using prt_compute_prof = CallbackUtils::prt_action::StorePrtHomogeneous<AF, grp_prof_t>;
+    #ifdef MASSES_AVAIL
+    /*! @brief accumulate the mass in radial shells, in units of R200c */
+    using prt_compute_prof = CallbackUtils::prt_action::RadialProfile<AF, SimFields::Group_R_Crit200,
+                                                                      CallbackUtils::prt_action::weight::Property<SimFields::Masses>>;
+    #else // MASSES_AVAIL
+    /*! @brief count the particles in radial shells, in units of R200c
+     *         (all particles have the same mass, which is read from the header)
+     */
+    using prt_compute_prof = CallbackUtils::prt_action::RadialProfile<AF, SimFields::Group_R_Crit200>;
+    #endif // MASSES_AVAIL
 
 
 } // namespace mass_prof }}}
@@ -235,20 +150,39 @@ struct mass_prof_callback :
         mass_prof::grp_radius { mass_prof::Rscale },
         mass_prof::grp_store_M { grp_M },
         mass_prof::grp_store_R { grp_R },
-        mass_prof::prt_compute_prof { grp_prof }
+        mass_prof::prt_compute_prof { grp_prof,
+                                      mass_prof::prt_compute_prof::log_edges(0.03F, mass_prof::Rscale, mass_prof::N-1UL)
+                                      #ifdef MASSES_AVAIL
+                                      , CallbackUtils::prt_action::weight::Property<SimFields::Masses> { }
+                                      #endif // MASSES_AVAIL
+                                    }
     { }
 
     std::vector<mass_prof::grp_M_t> grp_M; /*!< @brief M200c data vector */
     std::vector<mass_prof::grp_R_t> grp_R; /*!< @brief R200c data vector */
     std::vector<mass_prof::grp_prof_t> grp_prof; /*!< @brief profiles data vector */
 
-    #ifndef MASSES_AVAIL
-    void normalize_mass ()
-    {
-        for (auto &prof_item : grp_prof)
-            prof_item.normalize_mass(MassTable[mass_prof::PartType]);
-    }
-    #endif
+    /*! @brief append the enclosed mass profiles to a file */
+    void save (std::FILE *f) const
+    {// {{{
+        const size_t Ncols = mass_prof::prt_compute_prof::Ncols;
+        std::vector<mass_prof::grp_prof_t> encl_mass (mass_prof::N);
+        for (size_t grp_idx=0; grp_idx != grp_M.size(); ++grp_idx)
+        {
+            mass_prof::grp_prof_t m = 0.0;
+            for (size_t ii=0; ii != mass_prof::N; ++ii)
+            {
+                const mass_prof::grp_prof_t *p = grp_prof.data() + (grp_idx * mass_prof::N + ii) * Ncols;
+                #ifdef MASSES_AVAIL
+                m += p[1];
+                #else // MASSES_AVAIL
+                m += p[0] * MassTable[mass_prof::PartType];
+                #endif // MASSES_AVAIL
+                encl_mass[ii] = m;
+            }
+            std::fwrite(encl_mass.data(), sizeof(mass_prof::grp_prof_t), mass_prof::N, f);
+        }
+    }// }}}
 
 private :
     using Callback<mass_prof::AF>::GrpProperties;
@@ -279,10 +213,6 @@ int main (int argc, char **argv)
     
     group_particles<> ( C );
 
-    #ifndef MASSES_AVAIL
-    C.normalize_mass();
-    #endif // MASSES_AVAIL
-
     char fname_buffer[512];
 
     // save data to files
@@ -306,8 +236,7 @@ int main (int argc, char **argv)
         std::sprintf(fname_buffer, "%s/grp_mass_encl_prof_" TYPE ".bin", dout);
         auto f = std::fopen(fname_buffer, "wb");
 
-        for (auto &prof : C.grp_prof)
-            prof.save(f);
+        C.save(f);
 
         std::fclose(f);
     }
@@ -32,83 +32,18 @@ namespace ne_prof
 
     using AF = AllFields<GrpF, PrtF>; /*!< @brief bundle the group and particle fields */
 
-    /*! @brief stores a single electron electron density profile */
-    class NeProfile
+    /*! @brief the electron number of a particle, to be binned into the profiles.
+     *
+     * As explained in the documentation for #CallbackUtils::prt_action::RadialProfile,
+     * this can be any type with a call operator taking the particle properties.
+     */
+    struct ElectronNumber
     {// {{{
-        using GrpProperties = typename Callback<AF>::GrpProperties;
-        using PrtProperties = typename Callback<AF>::PrtProperties;
-
         // all internal calculations regarding ne in this type
         using value_type = double;
 
-        // number of sample points
-        static constexpr size_t N = 128;
-
-        std::vector<value_type> e_density;
-        std::vector<size_t> num_part;
-        coord_t logRmin, logRmax, dlogR;
-
-        // volume of spherical shells, used for save
-        value_type shell_vol (size_t idx) const
+        value_type operator() (const Callback<AF>::PrtProperties &prt) const
         {// {{{
-            // innermost shell goes right to the origin
-            if (idx == 0UL)
-                return 4.0 * M_PI / 3.0 * std::exp(3.0 * logRmin);
-            
-            // other shells are between two spheres
-            value_type logR1 = (value_type)logRmin + (value_type)dlogR * (value_type)(idx-1UL);
-            value_type logR2 = (value_type)logRmin + (value_type)dlogR * (value_type)(idx);
-            return 4.0 * M_PI / 3.0 * ( std::exp(3.0*logR2) - std::exp(3.0*logR1) );
-        }// }}}
-
-    public :
-        // we can only construct from a Group
-        NeProfile () = delete;
-
-        /*! @brief constructs from group properties (we need to read the radius)
-         *
-         * As explained in the documentation for #CallbackUtils::prt_action::StorePrtHomogeneous,
-         * if the data type stored for each group has a constructor from a
-         * `const GrpProperties &`, this constructor will be called during
-         * the calls to #Callback::grp_action.
-         * We use this fact to read the group radius.
-         */
-        NeProfile (const GrpProperties &grp)
-        {// {{{
-            e_density.resize(N, 0.0);
-            num_part.resize(N, 0UL);
-            logRmin = std::log(0.03F * grp.get<IllustrisFields::Group_R_Crit200>());
-            logRmax = std::log(2.50F * grp.get<IllustrisFields::Group_R_Crit200>());
-            dlogR = (logRmax - logRmin) / (coord_t)(N-1);
-        }// }}}
-
-        /*! @brief adds a particle to the profile
-         *
-         * This function computes the electron density associated with a particle
-         * and adds it (weighted with its volume) to the appropriate profile bin.
-         *
-         * Note that this exact signature and function name is required,
-         * as explained in the documentation for #CallbackUtils::prt_action::StorePrtHomogeneous.
-         */
-        void prt_insert (size_t, const GrpProperties &,
-                         const PrtProperties &prt, coord_t Rsq)
-        {// {{{
-            coord_t logR = (coord_t)0.5 * std::log(Rsq);
-            if (logR > logRmax)
-                return;
-
-            // figure out the index of the spherical shell the particle falls into
-            size_t idx;
-
-            if (logR < logRmin)
-                idx = 0UL;
-            else
-                idx = 1UL + (size_t)((logR - logRmin) / dlogR);
-
-            // safety check against numerical issues
-            if (idx >= N)
-                return;
-
             // load the required properties of this particle
             auto m = (value_type)prt.get<IllustrisFields::Masses>();
             auto x = (value_type)prt.get<IllustrisFields::ElectronAbundance>();
@@ -118,34 +53,20 @@ namespace ne_prof
                                               mprot = 0.6774*1.6726219/1.98847 * 1e-67;
 
             // this is electron density times particle volume
-            auto ne = x * XH * m / mprot;
-
-            e_density[idx] += ne;
-            num_part[idx]++;
-        }// }}}
-
-        /*! @brief append this electron density profile to file.
-         *
-         * @attention it is assumed that this instance is "dead" after this
-         *            function is called!
-         */
-        void save (std::FILE *fne, std::FILE *fnum_part)
-        {// {{{
-            for (size_t ii=0; ii != N; ++ii)
-                e_density[ii] /= shell_vol(ii);
-
-            std::fwrite(e_density.data(), sizeof(value_type), N, fne);
-            std::fwrite(num_part.data(), sizeof(size_t), N, fnum_part);
+            return x * XH * m / mprot;
         }// }}}
     };// }}}
-    
+
     using grp_M_t = double; /*!< @brief type to which M200c will be converted */
     using grp_R_t = double; /*!< @brief type to which R200c will be converted */
-    using grp_Ne_t = NeProfile; /*!< @brief type the electron density profiles will be stored in */
+    using grp_Ne_t = double; /*!< @brief type the electron density profiles will be stored in */
 
     // maximum radius (in units of R_200c) -- from Battaglia's plots
     constexpr IllustrisFields::Group_R_Crit200::value_type Rscale = 2.5;
 
+    // number of sample points, the innermost one goes right to the origin
+    constexpr size_t N = 128;
+
     /*! @brief group and particle files are in multiple chunks */
     using chunk = CallbackUtils::chunk::Multi<AF>;
 
@@ -170,8 +91,9 @@ namespace ne_prof
     /*! @brief store R200c in a vector */
     using grp_store_R = CallbackUtils::grp_action::StoreGrpProperty<AF, IllustrisFields::Group_R_Crit200, grp_R_t>;
 
-    /*! @brief store a #ne_prof::NeProfile instance for each group */
-    using prt_compute_Ne = CallbackUtils::prt_action::StorePrtHomogeneous<AF, grp_Ne_t>;
+    /*! @brief accumulate the #ne_prof::ElectronNumber profiles, in units of R200c */
+    using prt_compute_Ne = CallbackUtils::prt_action::RadialProfile<AF, IllustrisFields::Group_R_Crit200,
+                                                                    ElectronNumber>;
 
 
 } // namespace ne_prof }}}
@@ -194,12 +116,13 @@ struct ne_prof_callback :
         ne_prof::grp_radius { ne_prof::Rscale },
         ne_prof::grp_store_M { grp_M },
         ne_prof::grp_store_R { grp_R },
-        ne_prof::prt_compute_Ne { grp_Ne }
+        ne_prof::prt_compute_Ne { grp_Ne, ne_prof::prt_compute_Ne::log_edges(0.03F, ne_prof::Rscale, ne_prof::N-1UL),
+                                  ne_prof::ElectronNumber { } }
     { }
 
     std::vector<ne_prof::grp_M_t> grp_M; /*!< @brief M200c data vector */
     std::vector<ne_prof::grp_R_t> grp_R; /*!< @brief R200c data vector */
-    std::vector<ne_prof::grp_Ne_t> grp_Ne; /*!< @brief electron density profile data vector */
+    std::vector<ne_prof::grp_Ne_t> grp_Ne; /*!< @brief electron density profile data (and particle numbers) */
 
 private :
     using Callback<ne_prof::AF>::GrpProperties;
@@ -241,8 +164,16 @@ int main ()
     {
         auto fne = std::fopen(ROOT"/grp_ne_prof.bin", "wb");
         auto fnum_part = std::fopen(ROOT"/grp_num_part_prof.bin", "wb");
-        for (auto &prof : n.grp_Ne)
-            prof.save(fne, fnum_part);
+        const size_t Ncols = ne_prof::prt_compute_Ne::Ncols;
+        for (size_t grp_idx=0; grp_idx != n.grp_M.size(); ++grp_idx)
+            for (size_t ii=0; ii != ne_prof::N; ++ii)
+            {
+                const ne_prof::grp_Ne_t *p = n.grp_Ne.data() + (grp_idx * ne_prof::N + ii) * Ncols;
+                const ne_prof::grp_Ne_t ne = p[1] / n.shell_volume(grp_idx, ii);
+                const size_t num_part = (size_t)p[0];
+                std::fwrite(&ne, sizeof(ne_prof::grp_Ne_t), 1, fne);
+                std::fwrite(&num_part, sizeof(size_t), 1, fnum_part);
+            }
         std::fclose(fne);
         std::fclose(fnum_part);
     }
@@ -0,0 +1,103 @@
+// MPI version of null_test.cpp : counts the particles within R200c of each group,
+// with the particle files distributed over the ranks.
+//
+// Compile with
+//     sh compile_mpi.sh examples/null_test_mpi
+// and run e.g. on the first 75 files of an Illustris snapshot with
+//     mpirun -np 4 ./examples/null_test_mpi groups_099/fof_subhalo_tab_099.%lu.hdf5 74
+//                                           snapdir_099/snap_099.%lu.hdf5 74 grp_N.bin
+// (all in one line)
+#include <cstdio>
+#include <cstdlib>
+
+#include "group_particles_mpi.hpp"
+#include "common_fields.hpp"
+
+namespace NullTestMPI
+{
+    constexpr const size_t PartType = 1;
+
+    typedef GrpFields<IllustrisFields::GroupPos,
+                      IllustrisFields::Group_M_Crit200,
+                      IllustrisFields::Group_R_Crit200> GrpF;
+    typedef PrtFields<IllustrisFields::Coordinates> PrtF;
+    typedef AllFields<GrpF, PrtF> AF;
+
+    // the counts of several ranks can be added up,
+    // so the code can reduce them over the ranks
+    struct grp_N_t
+    {
+        size_t N = 0UL;
+
+        void prt_insert (size_t grp_idx, const Callback<AF>::GrpProperties &grp,
+                         const Callback<AF>::PrtProperties &prt, coord_t Rsq)
+        { ++N; }
+
+        grp_N_t clone () const { return grp_N_t { }; }
+
+        void merge (const grp_N_t &other) { N += other.N; }
+    };
+
+    typedef CallbackUtils::chunk::Multi<AF>
+        chunk;
+    typedef CallbackUtils::name::Illustris<AF, PartType>
+        name;
+    typedef CallbackUtils::meta::Illustris<AF, PartType>
+        meta;
+    typedef CallbackUtils::select::LowCutoff<AF, IllustrisFields::Group_M_Crit200>
+        grp_select;
+    typedef CallbackUtils::radius::Simple<AF, IllustrisFields::Group_R_Crit200>
+        grp_radius;
+    typedef CallbackUtils::prt_action::StorePrtHomogeneous<AF, grp_N_t>
+        prt_count_prt;
+} // namespace NullTestMPI
+
+struct NullTestMPI_Callback :
+    virtual public Callback<NullTestMPI::AF>,
+    public NullTestMPI::chunk, public NullTestMPI::name, public NullTestMPI::meta,
+    public NullTestMPI::grp_select, public NullTestMPI::grp_radius,
+    public NullTestMPI::prt_count_prt
+{
+    NullTestMPI_Callback (const char *fgrp, size_t grp_max_idx, const char *fprt, size_t prt_max_idx) :
+        NullTestMPI::chunk { fgrp, grp_max_idx, fprt, prt_max_idx },
+        NullTestMPI::grp_select { Mmin },
+        NullTestMPI::prt_count_prt { grp_N }
+    { }
+
+    std::vector<NullTestMPI::grp_N_t> grp_N;
+
+private :
+    static constexpr const float Mmin = 1e3F;
+};
+
+int main (int argc, char **argv)
+{
+    MPI_Init(&argc, &argv);
+
+    if (argc != 6)
+    {
+        std::fprintf(stderr, "Usage : %s <group files> <max group file index> "
+                             "<particle files> <max particle file index> <output file>\n", argv[0]);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    NullTestMPI_Callback n (argv[1], std::atol(argv[2]), argv[3], std::atol(argv[4]));
+
+    group_particles_mpi<> ( n );
+
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    // only rank 0 holds the full result
+    if (rank == 0)
+    {
+        std::FILE *f = std::fopen(argv[5], "wb");
+        for (const auto &x : n.grp_N)
+            std::fwrite(&x.N, sizeof(size_t), 1, f);
+        std::fclose(f);
+    }
+
+    MPI_Finalize();
+
+    return 0;
+};
@@ -6,8 +6,11 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 #include <cstdio>
+#include <cstring>
 #include <cmath>
+#include <algorithm>
 
 #include "group_particles.hpp"
 #include "common_fields.hpp"
@@ -66,6 +69,30 @@ namespace y_prof
             return 4.0 * M_PI / 3.0 * ( std::exp(3.0*logR2) - std::exp(3.0*logR1) );
         }// }}}
 
+        // returns the index of the spherical shell at squared distance Rsq,
+        // or N if outside the profile
+        size_t shell_idx (coord_t Rsq) const
+        {// {{{
+            coord_t logR = (coord_t)0.5 * std::log(Rsq);
+            if (logR > logRmax)
+                return N;
+
+            if (logR < logRmin)
+                return 0UL;
+
+            // safety check against numerical issues
+            return std::min(N, 1UL + (size_t)((logR - logRmin) / dlogR));
+        }// }}}
+
+        // electron pressure * particle volume
+        static value_type Y (value_type m, value_type e, value_type x)
+        {// {{{
+            static constexpr const value_type gamma = 5.0/3.0, XH = 0.76;
+
+            return 4.0 * x * XH / (1.0+3.0*XH+4.0*XH*x)
+                       * (gamma-1.0) * m * e;
+        }// }}}
+
     public :
         // we can only construct from a Group
         YProfile () = delete;
@@ -94,39 +121,100 @@ namespace y_prof
          *
          * Note that this exact signature and function name is required,
          * as explained in the documentation for #CallbackUtils::prt_action::StorePrtHomogeneous.
+         * Since we also implement #prt_insert_batch, this function is not actually called.
          */
         void prt_insert (size_t, const GrpProperties &,
                          const PrtProperties &prt, coord_t Rsq)
         {// {{{
-            coord_t logR = (coord_t)0.5 * std::log(Rsq);
-            if (logR > logRmax)
+            const size_t idx = shell_idx(Rsq);
+            if (idx == N)
                 return;
 
-            // figure out the index of the spherical shell the particle falls into
-            size_t idx;
-
-            if (logR < logRmin)
-                idx = 0UL;
-            else
-                idx = 1UL + (size_t)((logR - logRmin) / dlogR);
+            // load the required properties of this particle
+            pressure[idx] += Y((value_type)prt.get<IllustrisFields::Masses>(),
+                               (value_type)prt.get<IllustrisFields::InternalEnergy>(),
+                               (value_type)prt.get<IllustrisFields::ElectronAbundance>());
+            ++num_part[idx];
+        }// }}}
 
-            // safety check against numerical issues
-            if (idx >= N)
-                return;
+        /*! @brief adds a batch of particles to the profile
+         *
+         * Same as #prt_insert, but the particles are passed in batches,
+         * with direct access to the field arrays.
+         * As explained in the documentation for #CallbackUtils::prt_action::StorePrtHomogeneous,
+         * if this method exists it is used instead of #prt_insert.
+         */
+        void prt_insert_batch (size_t, const GrpProperties &,
+                               size_t Nprt, const size_t *prt_idx, const coord_t *Rsq,
+                               void **prt_properties, coord_t)
+        {// {{{
+            using PF = AF::ParticleFields;
+            const auto *m = (const IllustrisFields::Masses::value_type *)
+                            prt_properties[PF::idx<IllustrisFields::Masses>];
+            const auto *e = (const IllustrisFields::InternalEnergy::value_type *)
+                            prt_properties[PF::idx<IllustrisFields::InternalEnergy>];
+            const auto *x = (const IllustrisFields::ElectronAbundance::value_type *)
+                            prt_properties[PF::idx<IllustrisFields::ElectronAbundance>];
+
+            for (size_t ii=0; ii != Nprt; ++ii)
+            {
+                const size_t idx = shell_idx(Rsq[ii]);
+                if (idx == N)
+                    continue;
+
+                const size_t jj = prt_idx[ii];
+                pressure[idx] += Y((value_type)m[jj], (value_type)e[jj], (value_type)x[jj]);
+                ++num_part[idx];
+            }
+        }// }}}
 
-            // load the required properties of this particle
-            auto m = (value_type)prt.get<IllustrisFields::Masses>();
-            auto e = (value_type)prt.get<IllustrisFields::InternalEnergy>();
-            auto x = (value_type)prt.get<IllustrisFields::ElectronAbundance>();
+        /*! @brief returns an empty profile for the same group
+         *
+         * Together with #merge, this allows the code to split groups with very many
+         * particles across threads, as explained in the documentation for
+         * #CallbackUtils::prt_action::StorePrtHomogeneous.
+         */
+        YProfile clone () const
+        {// {{{
+            YProfile out { *this };
+            std::fill(out.pressure.begin(), out.pressure.end(), 0.0);
+            std::fill(out.num_part.begin(), out.num_part.end(), 0UL);
+            return out;
+        }// }}}
 
-            static constexpr const value_type gamma = 5.0/3.0, XH = 0.76;
+        /*! @brief adds the particles inserted into another profile for the same group
+         */
+        void merge (const YProfile &other)
+        {// {{{
+            for (size_t ii=0; ii != N; ++ii)
+            {
+                pressure[ii] += other.pressure[ii];
+                num_part[ii] += other.num_part[ii];
+            }
+        }// }}}
 
-            // this is electron pressure * particle volume
-            auto Y = 4.0 * x * XH / (1.0+3.0*XH+4.0*XH*x)
-                         * (gamma-1.0) * m * e;
+        /*! @brief appends the accumulated data to a buffer
+         *
+         * Together with #unpack, this allows the code to distribute the particle chunks
+         * over several processes, as explained in the documentation for
+         * #CallbackUtils::prt_action::StorePrtHomogeneous.
+         */
+        void pack (std::vector<char> &buf) const
+        {// {{{
+            const char *p = (const char *)pressure.data();
+            buf.insert(buf.end(), p, p + N * sizeof(value_type));
+            const char *n = (const char *)num_part.data();
+            buf.insert(buf.end(), n, n + N * sizeof(size_t));
+        }// }}}
 
-            pressure[idx] += Y;
-            ++num_part[idx];
+        /*! @brief reads the data written by #pack and advances the pointer
+         */
+        void unpack (const char *&buf)
+        {// {{{
+            std::memcpy(pressure.data(), buf, N * sizeof(value_type));
+            buf += N * sizeof(value_type);
+            std::memcpy(num_part.data(), buf, N * sizeof(size_t));
+            buf += N * sizeof(size_t);
         }// }}}
 
         /*! @brief append this electron pressure profile to file.
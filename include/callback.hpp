@@ -8,8 +8,13 @@
 #ifndef CALLBACK_HPP
 #define CALLBACK_HPP
 
+#include <cassert>
 #include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <string>
+#include <vector>
 #include <memory>
 #include <type_traits>
 
@@ -95,7 +100,15 @@ struct Callback
     {
         coord_t Bsize;
 
-        PrtProperties (coord_t Bsize_, void **data_in_memory, size_t offset=0UL);
+        /*! @brief index of this particle's type, see #Callback::prt_types. */
+        size_t type_idx;
+
+        /*! @brief index of the smallest aperture containing this particle,
+         *         see #Callback::grp_apertures (always 0 if there is only one).
+         */
+        size_t aperture_idx;
+
+        PrtProperties (coord_t Bsize_, void **data_in_memory, size_t offset=0UL, size_t type_idx_=0UL);
 
         // get around the name hiding issue
         using BaseProperties<typename AFields::ParticleFields>::coord;
@@ -150,6 +163,33 @@ struct Callback
      */
     virtual std::string prt_name () const = 0;
 
+    /*! @brief How many particle types should be read from each particle chunk.
+     *
+     * @return the number of particle types. If larger than one, the particles of type
+     *         type_idx are read from #prt_type_name, their number is obtained from
+     *         #read_prt_type_meta, and their #PrtProperties carry the type_idx.
+     *         Each particle file is opened only once for all types.
+     *
+     * @remark This function is trivially implemented, so does not need to be overriden.
+     *
+     * @note If a particle type does not have one of the fields in AFields::ParticleFields,
+     *       the field is filled with zeros for this type
+     *       (the user can then set it in #prt_modify or #prt_modify_bulk).
+     *
+     * @note see #CallbackUtils::name::IllustrisTypes and #CallbackUtils::meta::IllustrisTypes
+     *       for some overrides.
+     */
+    virtual size_t prt_types () const { return 1UL; }
+
+    /*! @brief Where to find the fields of a particle type in the hdf5 file.
+     *
+     * @param[in] type_idx      index of the particle type, smaller than #prt_types.
+     *
+     * @remark This function is trivially implemented (returning #prt_name),
+     *         so does not need to be overriden if #prt_types returns 1.
+     */
+    virtual std::string prt_type_name (size_t type_idx) const { return prt_name(); }
+
     /*! @brief Allows the user to read meta-data from the 0th group chunk.
      *
      * @param[in] fptr      Points to the opened 0th group chunk.
@@ -202,6 +242,20 @@ struct Callback
     virtual void read_prt_meta (size_t chunk_idx, std::shared_ptr<H5::H5File> fptr,
                                 coord_t &Bsize, size_t &Nparts) const = 0;
 
+    /*! @brief Inform the code how many particles of a type there are in a particle chunk.
+     *
+     * @param[in] chunk_idx     index of the particle chunk, starting from 0.
+     * @param[in] fptr          pointer to the opened particle chunk file.
+     * @param[in] type_idx      index of the particle type, smaller than #prt_types.
+     * @param[out] Nparts       to be filled with the number of particles of this type in this file.
+     *
+     * @remark This function is only called if #prt_types returns more than one,
+     *         otherwise the number from #read_prt_meta is used.
+     */
+    virtual void read_prt_type_meta (size_t chunk_idx, std::shared_ptr<H5::H5File> fptr,
+                                     size_t type_idx, size_t &Nparts) const
+    { missing_override("read_prt_type_meta"); }
+
     /*! @brief Inform the code whether a group should be considered.
      *
      * @param[in] grp       properties of this group.
@@ -214,6 +268,32 @@ struct Callback
      */
     virtual bool grp_select (const GrpProperties &grp) const { return true; }
 
+    /*! @brief Inform the code which groups in a group chunk should be considered,
+     *         operating on whole arrays.
+     *
+     * @param[in] Ngroups           number of groups in this group chunk.
+     * @param[in] grp_properties    pointers to the first group in this chunk,
+     *                              one for each field in AFields::GroupFields
+     *                              (in the same order).
+     *                              Coordinate fields have already been converted to #coord_t.
+     * @param[in,out] selected      Ngroups values, initialized to 1.
+     *                              Should be set to 0 for the groups that should not be considered.
+     *
+     * @remark This function is only called if #grp_select_is_bulk returns true,
+     *         and #grp_select is then not called.
+     *
+     * @note see #CallbackUtils::select::All for an override.
+     */
+    virtual void grp_select_bulk (size_t Ngroups, void **grp_properties, uint8_t *selected)
+    { missing_override("grp_select_bulk"); }
+
+    /*! @brief Whether the groups should be selected with #grp_select_bulk instead of #grp_select.
+     *
+     * @remark This function is trivially implemented, so does not need to be overriden.
+     *         If it is overriden to return true, #grp_select_bulk must be overriden as well.
+     */
+    virtual bool grp_select_is_bulk () const { return false; }
+
     /*! @brief Action to take for each group for which #grp_select returned true.
      *
      * @param[in] grp       properties of this group.
@@ -242,11 +322,41 @@ struct Callback
      */
     virtual coord_t grp_radius (const GrpProperties &grp) const = 0;
 
+    /*! @brief Number of apertures for each group.
+     *
+     * @return the number of radii #grp_apertures writes.
+     *
+     * @remark This function is trivially implemented, so does not need to be overriden.
+     *         If it is overriden to return more than one, #grp_apertures must be overriden as well.
+     */
+    virtual size_t grp_Napertures () const { return 1UL; }
+
+    /*! @brief Several radii for this group, so that a single pass serves all of them
+     *         (e.g. R500c, R200c and 2.5*R200c).
+     *
+     * @param[in] grp       properties of this group.
+     * @param[out] R        the #grp_Napertures radii, in increasing order.
+     *
+     * The particles within the largest radius are passed to #prt_action,
+     * and #PrtProperties::aperture_idx is the index of the smallest aperture containing them.
+     *
+     * @remark This function is only called (instead of #grp_radius) if #grp_Napertures
+     *         returns more than one.
+     *         The trivial implementation writes #grp_radius.
+     * @remark #prt_action_batch receives the aperture indices in an array.
+     *
+     * @note see #CallbackUtils::radius::Apertures for an override.
+     */
+    virtual void grp_apertures (const GrpProperties &grp, coord_t *R) const
+    { R[0] = grp_radius(grp); }
+
     /*! @brief Action to take for each particle that falls within #grp_radius from
      *         a group.
      *
      *  @param[in] grp_idx      index of this group, corresponding to the order in which
      *                          #grp_action was called.
+     *                          If #grp_splittable returns true, this can also be an index
+     *                          returned by #grp_clone.
      *  @param[in] grp          properties of this group. Well-designed code should not
      *                          need to use this argument, as the required data products
      *                          can be reduced more efficiently in the #grp_action method.
@@ -255,11 +365,139 @@ struct Callback
      *                          group's coordinate. The code already computes this so the
      *                          user should be able to use it without re-computing it.
      *
+     * @note If PRECISE_COORDS is defined, Rsq is computed from the particle coordinates
+     *       relative to their cell and is more accurate than what the absolute coordinates
+     *       in prt give in a large box.
      * @note see #CallbackUtils::prt_action for some overrides.
      */
     virtual void prt_action (size_t grp_idx, const GrpProperties &grp,
                              const PrtProperties &prt, coord_t Rsq) = 0;
 
+    /*! @brief Whether the particles should be passed to #prt_action_batch instead of #prt_action.
+     *
+     *  @return if true, the code collects the particles within #grp_radius from a group
+     *          in batches and passes each batch to #prt_action_batch.
+     *          #prt_action is then never called.
+     *
+     *  @remark This function is trivially implemented, so does not need to be overriden.
+     *          If it is overriden to return true, #prt_action_batch must be overriden as well.
+     *
+     *  @note #CallbackUtils::prt_action::StorePrtHomogeneous implements this functionality
+     *        if the data type stored for each group provides a `prt_insert_batch` method.
+     */
+    virtual bool prt_batched () const { return false; }
+
+    /*! @brief Action to take for a batch of particles that fall within #grp_radius from a group.
+     *
+     *  @param[in] grp_idx          as for #prt_action.
+     *  @param[in] grp              as for #prt_action.
+     *  @param[in] Nprt             number of particles in this batch.
+     *  @param[in] prt_idx          indices of the particles in the prt_properties arrays
+     *                              (Nprt values, increasing).
+     *  @param[in] Rsq              squared distances between the particles and the
+     *                              group's coordinate (Nprt values, in the same order).
+     *  @param[in] aperture_idx     the particles' #PrtProperties::aperture_idx
+     *                              (Nprt values, in the same order) if #grp_Napertures
+     *                              returns more than one, otherwise nullptr.
+     *  @param[in] prt_properties   pointers to the arrays holding all particles of the chunk,
+     *                              one for each field in AFields::ParticleFields
+     *                              (in the same order).
+     *                              Coordinate fields have been converted to #coord_t.
+     *  @param[in] Bsize            size of the simulation box (after rescaling).
+     *  @param[in] type_idx         the particles' type (see #prt_types).
+     *
+     *  @note A batch consists of particles from a small region of the box.
+     *        The guarantees regarding concurrent calls are as for #prt_action.
+     *  @note The distances are computed in a loop the compiler can vectorize,
+     *        and the user can do the same with the loop over the batch.
+     */
+    virtual void prt_action_batch (size_t grp_idx, const GrpProperties &grp,
+                                   size_t Nprt, const size_t *prt_idx, const coord_t *Rsq,
+                                   const size_t *aperture_idx,
+                                   void **prt_properties, coord_t Bsize, size_t type_idx)
+    { missing_override("prt_action_batch"); }
+
+    /*! @brief Whether the per-group data can be split across threads.
+     *
+     *  @return if true, the code is allowed to process groups with very many particles
+     *          using multiple threads at once.
+     *          In that case, each thread inserts particles into a temporary copy of the group's
+     *          data obtained from #grp_clone, and the copies are combined with #grp_merge.
+     *
+     *  @remark This function is trivially implemented, so does not need to be overriden.
+     *          If it is overriden to return true, #grp_clone, #grp_merge, and #grp_clones_release
+     *          must be overriden as well.
+     *
+     *  @note #CallbackUtils::prt_action::StorePrtHomogeneous implements this functionality
+     *        if the data type stored for each group provides `clone` and `merge` methods.
+     */
+    virtual bool grp_splittable () const { return false; }
+
+    /*! @brief Create an empty temporary copy of a group's data.
+     *
+     *  @param[in] grp_idx      index of the group, corresponding to the order in which
+     *                          #grp_action was called.
+     *
+     *  @return an index different from all group indices, which will be passed as the
+     *          grp_idx argument to #prt_action for the particles inserted into the copy.
+     *
+     *  @note This method is called serially, before the copy is used.
+     */
+    virtual size_t grp_clone (size_t grp_idx) { missing_override("grp_clone"); }
+
+    /*! @brief Combine a temporary copy of a group's data into the group's data.
+     *
+     *  @param[in] grp_idx      index of the group.
+     *  @param[in] clone_idx    index returned by #grp_clone for this group.
+     *
+     *  @note This method is called serially, with the copies in a fixed order.
+     */
+    virtual void grp_merge (size_t grp_idx, size_t clone_idx) { missing_override("grp_merge"); }
+
+    /*! @brief All temporary copies have been merged and can be destroyed.
+     */
+    virtual void grp_clones_release () { return; }
+
+    /*! @brief Whether the per-group data of several instances can be combined.
+     *
+     *  @return if true, the particle chunks can be distributed over several processes
+     *          (see #group_particles_mpi, #group_particles_fork),
+     *          each of which holds its own instance.
+     *          The data accumulated by the instances is then combined using
+     *          #grp_state_pack and #grp_state_merge (and #grp_state_reset).
+     *
+     *  @remark This function is trivially implemented, so does not need to be overriden.
+     *          If it is overriden to return true, #grp_state_pack, #grp_state_merge,
+     *          and #grp_state_reset must be overriden as well.
+     *
+     *  @note #CallbackUtils::prt_action::StorePrtHomogeneous implements this functionality
+     *        if the data type stored for each group provides `clone` and `merge` methods
+     *        and is either trivially copyable or provides `pack` and `unpack` methods.
+     */
+    virtual bool grp_reducible () const { return false; }
+
+    /*! @brief Serialize the data accumulated in #prt_action.
+     *
+     *  @param[out] buf     the data should be appended to this buffer.
+     *
+     *  @note Only data that changes during the calls to #prt_action needs to be stored,
+     *        the instance this is merged into went through the same calls to #grp_action.
+     */
+    virtual void grp_state_pack (std::vector<char> &buf) const { missing_override("grp_state_pack"); }
+
+    /*! @brief Add the data serialized by another instance's #grp_state_pack.
+     *
+     *  @param[in] buf      the output of #grp_state_pack.
+     */
+    virtual void grp_state_merge (const char *buf) { missing_override("grp_state_merge"); }
+
+    /*! @brief Reset the data accumulated in #prt_action to its state after the calls to #grp_action.
+     *
+     *  @note Only required by #group_particles_fork, which sends the data accumulated
+     *        for each particle chunk separately.
+     */
+    virtual void grp_state_reset () { missing_override("grp_state_reset"); }
+
     /*! @brief Rescaling of particle coordinates.
      *
      *  @return the factor by which the particle coordinates will be rescaled
@@ -271,17 +509,167 @@ struct Callback
      */
     virtual coord_t prt_coord_rescale ( ) const { return 1.0; }
 
+    /*! @brief Whether the particle chunks should be processed in a pipeline.
+     *
+     *  @return if true, the next particle chunks are read from disk, prepared
+     *          (coordinate conversion and #prt_modify / #prt_modify_bulk) and sorted
+     *          while the loop over groups runs on the current chunk.
+     *          Each stage gets its own share of the threads.
+     *          This hides the I/O time if there are many particle chunks.
+     *
+     *  @remark This function is trivially implemented, so does not need to be overriden.
+     *
+     *  @note Up to three particle chunks are kept in memory at the same time.
+     *  @note #read_prt_meta and the modify methods will run concurrently with
+     *        #prt_action (but never on the same particle chunk).
+     */
+    virtual bool prt_pipeline () const { return false; }
+
+    /*! @brief Whether the loop over groups should be run several times on the same particles
+     *         (e.g. for shrinking-sphere centering or iterative shape measurements).
+     *
+     *  @return if true, all particle chunks are kept in memory after they have been
+     *          read and sorted. After each pass over them, #pass_end is called,
+     *          and if it requests another pass, #grp_update is called for all groups
+     *          and the loop over groups runs again on the resident particles.
+     *
+     *  @remark This function is trivially implemented, so does not need to be overriden.
+     *
+     *  @note All particles have to fit into memory, #prt_pipeline and the memory budget
+     *        are not used in this mode.
+     *  @note Only supported by #group_particles and #group_particles_batch
+     *        (and #group_particles_mpi, #group_particles_fork with a single rank or worker).
+     *        Also works for the members of a #FusedCallback.
+     */
+    virtual bool prt_multipass () const { return false; }
+
+    /*! @brief Called after each pass over the particles if #prt_multipass returns true.
+     *
+     *  @param[in] pass_idx     index of the pass that has just finished (starting from 0).
+     *
+     *  @return true if another pass should be run.
+     *          The per-group data is not touched by the code, so the user has to reset
+     *          whatever should not accumulate over the passes.
+     *
+     *  @remark This function is trivially implemented, so does not need to be overriden
+     *          if #prt_multipass returns false.
+     */
+    virtual bool pass_end (size_t pass_idx) { return false; }
+
+    /*! @brief Moves a group before the next pass if #prt_multipass returns true.
+     *
+     *  @param[in] grp_idx      index of this group, as for #prt_action.
+     *  @param[in] grp          properties of this group (the coordinates are the current ones).
+     *  @param[in,out] coord    the group's coordinates (3 values, in the units of
+     *                          the group catalog).
+     *  @param[in,out] R        the group's radius.
+     *                          If there are several apertures (#grp_apertures),
+     *                          they are all scaled by the same factor
+     *                          (if the radius was zero, #grp_apertures is called again
+     *                          and its result scaled to the new radius).
+     *
+     *  @remark This function is trivially implemented (keeping the group as it is).
+     *  @note If PRECISE_COORDS is defined, the residuals of the group coordinates
+     *        are set to zero for the new coordinates.
+     */
+    virtual void grp_update (size_t grp_idx, const GrpProperties &grp,
+                             coord_t *coord, coord_t &R) { }
+
     /*! @brief Modifications to particle properties.
      *
      *  @param[in,out] prt      properties of the particle, to be modified
      *
      *  @note this is called after coordinate rescaling has been applied
      *  @note original motivation is to implement RSD
+     *  @note this method is only called if #prt_modifies returns true
+     *        and #prt_modify_is_bulk returns false.
+     *        It is called serially for each particle.
      */
-    virtual void prt_modify (PrtProperties &prt) { return; }
+    virtual void prt_modify (PrtProperties &prt) { missing_override("prt_modify"); }
+
+    /*! @brief Modifications to particle properties, operating on whole arrays.
+     *
+     *  @param[in] Nprt             number of particles in this span.
+     *  @param[in] Bsize            size of the simulation box (after rescaling).
+     *  @param[in,out] prt_properties   pointers to the first particle in this span,
+     *                                  one for each field in AFields::ParticleFields
+     *                                  (in the same order).
+     *                                  Coordinate fields have already been converted to #coord_t.
+     *  @param[in] type_idx         the particles' type (see #prt_types).
+     *
+     *  @note this is called after coordinate rescaling has been applied
+     *  @note the particles of a chunk are split into spans which are passed to this method
+     *        concurrently from multiple threads, so implementations must only modify
+     *        the particles in the span they are given.
+     *  @note this method is only called if #prt_modifies and #prt_modify_is_bulk return true.
+     *
+     *  @note see #CallbackUtils::prt_modify for some overrides.
+     */
+    virtual void prt_modify_bulk (size_t Nprt, coord_t Bsize, void **prt_properties, size_t type_idx)
+    { missing_override("prt_modify_bulk"); }
+
+    /*! @brief Whether the particle properties should be modified.
+     *
+     *  @return if true, the code calls #prt_modify or #prt_modify_bulk on each particle chunk,
+     *          otherwise the modification stage is skipped entirely.
+     *
+     *  @remark This function is trivially implemented, so does not need to be overriden.
+     *          If it is overriden to return true, #prt_modify or #prt_modify_bulk
+     *          (depending on #prt_modify_is_bulk) must be overriden as well.
+     *
+     *  @note If PRECISE_COORDS is defined, the code keeps the particle coordinates relative
+     *        to the cells it sorts the particles into, and converts them back to absolute
+     *        coordinates for the modification. The coordinates changed by the modification
+     *        are taken to be exact, the others keep their precision if the file stores them
+     *        in a wider type than #coord_t.
+     */
+    virtual bool prt_modifies () const { return false; }
+
+    /*! @brief Whether the particles should be passed to #prt_modify_bulk instead of #prt_modify.
+     *
+     *  @remark This function is trivially implemented, so does not need to be overriden.
+     *          It is only relevant if #prt_modifies returns true.
+     */
+    virtual bool prt_modify_is_bulk () const { return false; }
+
+protected :
+    /*! @brief Called by the default implementations of the methods that have to be overriden
+     *         before the code may use them (e.g. #grp_clone if #grp_splittable returns true).
+     *
+     * Prints which method is missing and aborts, in all builds,
+     * since a silently ignored call would give wrong results.
+     */
+    [[noreturn]] static void missing_override (const char *method)
+    {
+        std::fprintf(stderr, "group_particles : Callback::%s is used but not overriden\n", method);
+        std::abort();
+    }
 };
 
 
+/*! @brief Variant of #Callback for which #Callback::prt_action is called without virtual dispatch.
+ *
+ * @tparam AFields      as for #Callback.
+ * @tparam Derived      the user's class, which should inherit from StaticCallback<AFields, Derived>
+ *                      instead of Callback<AFields> (the curiously recurring template pattern).
+ *
+ * The semantics are identical to those of #Callback, from which this class inherits.
+ * However, #group_particles then calls Derived::prt_action directly, so the compiler can
+ * inline the user's per-particle work into the loop over particles.
+ * If the data stored for each group implements `prt_insert`
+ * (see #CallbackUtils::prt_action::StorePrtHomogeneous), this is inlined as well.
+ *
+ * @attention Derived must be the most derived type: overrides of #Callback::prt_action in
+ *            classes deriving from Derived are not seen by the code.
+ *            It is advisable to declare Derived as `final`.
+ *
+ * @note #group_particles_mpi and #group_particles_fork accept such a class as well,
+ *       but call #Callback::prt_action through the vtable.
+ */
+template<typename AFields, typename Derived>
+struct StaticCallback : virtual public Callback<AFields>
+{ };
+
 // --- Implementation of the BaseProperties struct ---
 
 template<typename AFields>
@@ -356,9 +744,10 @@ Callback<AFields>::GrpProperties::GrpProperties (size_t chunk_idx_, void **data_
 { }
 
 template<typename AFields>
-Callback<AFields>::PrtProperties::PrtProperties (coord_t Bsize_, void **data_in_memory, size_t offset) :
+Callback<AFields>::PrtProperties::PrtProperties (coord_t Bsize_, void **data_in_memory, size_t offset,
+                                                 size_t type_idx_) :
     Callback<AFields>::template BaseProperties<typename AFields::ParticleFields> { data_in_memory, offset },
-    Bsize { Bsize_ }
+    Bsize { Bsize_ }, type_idx { type_idx_ }, aperture_idx { 0UL }
 { }
 
 template<typename AFields>
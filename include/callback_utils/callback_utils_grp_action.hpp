@@ -8,8 +8,9 @@
 #define CALLBACK_UTILS_GRP_ACTION_HPP
 
 #include <cassert>
-#include <functional>
+#include <utility>
 #include <vector>
+#include <tuple>
 #include <type_traits>
 #include <cstdio>
 
@@ -31,21 +32,18 @@ namespace grp_action {
         virtual public Callback<AFields>
     {// {{{
         using typename Callback<AFields>::GrpProperties;
-
-        static constexpr size_t buf_size = 64UL;
-        size_t N_actions = 0UL;
-        std::pair<void *, std::function<void(void *, const GrpProperties &)>> grp_actions[buf_size];
+        using action_fct = void (*)(void *, const GrpProperties &);
+        std::vector<std::pair<void *, action_fct>> grp_actions;
     protected :
-        void register_fct (void *obj, std::function<void(void *, const GrpProperties &)> fct)
+        void register_fct (void *obj, action_fct fct)
         {
-            grp_actions[N_actions++] = std::make_pair(obj, fct);
-            assert(N_actions < buf_size);
+            grp_actions.emplace_back(obj, fct);
         }
     public :
         void grp_action (const GrpProperties &grp) override final
         {
-            for (size_t ii=0; ii != N_actions; ++ii)
-                grp_actions[ii].second(grp_actions[ii].first, grp);
+            for (const auto &action : grp_actions)
+                action.second(action.first, grp);
         }
     };// }}}
 
@@ -138,6 +136,39 @@ namespace grp_action {
         { }
     };// }}}
 
+    /*! @brief performs a number of actions in #Callback::grp_action,
+     *         with the combination resolved at compile time.
+     *
+     * @tparam Actions      callable types with a method `void operator() (const GrpProperties &)`
+     *                      (generic lambdas work).
+     *
+     * In contrast to the classes based on #CallbackUtils::grp_action::MultiGrpAction,
+     * the actions are not called through function pointers, so they can be inlined.
+     *
+     * @attention This class cannot be combined with the classes based on
+     *            #CallbackUtils::grp_action::MultiGrpAction (this includes
+     *            #CallbackUtils::prt_action::StorePrtHomogeneous), all actions should be passed to it.
+     */
+    template<typename AFields, typename... Actions>
+    class All :
+        virtual public Callback<AFields>
+    {// {{{
+        using typename Callback<AFields>::GrpProperties;
+
+        std::tuple<Actions...> actions;
+    public :
+        /*! @param actions  the actions, in the order of the template parameters.
+         */
+        All (const Actions &... actions_) :
+            actions { actions_... }
+        { }
+
+        void grp_action (const GrpProperties &grp) override final
+        {
+            std::apply([&grp](auto &... action) { (action(grp), ...); }, actions);
+        }
+    };// }}}
+
 } // namespace grp_action
 
 } // namespace CallbackUtils
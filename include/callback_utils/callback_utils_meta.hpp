@@ -43,6 +43,42 @@ namespace meta
         }
     };// }}}
 
+    /*! @brief retrieves meta-data from an Illustris-type simulation, for several particle types.
+     *
+     * @tparam PartTypes    the particle types, in the same order as for #CallbackUtils::name::IllustrisTypes
+     */
+    template<typename AFields, uint8_t... PartTypes>
+    struct IllustrisTypes :
+        virtual public Callback<AFields>
+    {// {{{
+        void read_grp_meta (size_t chunk_idx, std::shared_ptr<H5::H5File> fptr,
+                            size_t &Ngroups) const override final
+        {
+            auto header = fptr->openGroup("/Header");
+            Ngroups = hdf5Utils::read_scalar_attr<int32_t,size_t>(header, "Ngroups_ThisFile");
+            header.close();
+        }
+
+        void read_prt_meta (size_t chunk_idx, std::shared_ptr<H5::H5File> fptr,
+                            coord_t &Bsize, size_t &Npart) const override final
+        {
+            read_prt_type_meta(chunk_idx, fptr, 0UL, Npart);
+            auto header = fptr->openGroup("/Header");
+            Bsize = hdf5Utils::read_scalar_attr<double,coord_t>(header, "BoxSize");
+            header.close();
+        }
+
+        void read_prt_type_meta (size_t chunk_idx, std::shared_ptr<H5::H5File> fptr,
+                                 size_t type_idx, size_t &Npart) const override final
+        {
+            static constexpr const uint8_t part_types[] = { PartTypes ... };
+            auto header = fptr->openGroup("/Header");
+            Npart = hdf5Utils::read_vector_attr<int32_t,size_t>(header, "NumPart_ThisFile",
+                                                                part_types[type_idx]);
+            header.close();
+        }
+    };// }}}
+
     /*! @brief retrieves meta-data from an Illustris-type simulation with my custom rockstar hdf5.
      *
      * @tparam PartType     the particle type
@@ -8,7 +8,8 @@
 #define CALLBACK_UTILS_META_INIT_HPP
 
 #include <cassert>
-#include <functional>
+#include <utility>
+#include <vector>
 #include <memory>
 
 #include "callback.hpp"
@@ -30,20 +31,18 @@ namespace meta_init
     class MultiPrtMetaInitBase :
         virtual public Callback<AFields>
     {// {{{
-        static constexpr size_t buf_size = 64UL;
-        size_t N_inits = 0UL;
-        std::pair<void *, std::function<void(void *, std::shared_ptr<H5::H5File>)>> inits[buf_size];
+        using init_fct = void (*)(void *, std::shared_ptr<H5::H5File>);
+        std::vector<std::pair<void *, init_fct>> inits;
     protected :
-        void register_init (void *obj, std::function<void(void *, std::shared_ptr<H5::H5File>)> fct)
+        void register_init (void *obj, init_fct fct)
         {
-            inits[N_inits++] = std::make_pair(obj, fct);
-            assert(N_inits < buf_size);
+            inits.emplace_back(obj, fct);
         }
     public :
         void read_prt_meta_init (std::shared_ptr<H5::H5File> fptr) override final
         {
-            for (size_t ii=0; ii != N_inits; ++ii)
-                inits[ii].second(inits[ii].first, fptr);
+            for (const auto &init : inits)
+                init.second(init.first, fptr);
         }
     };// }}}
 
@@ -56,20 +55,18 @@ namespace meta_init
     class MultiGrpMetaInitBase :
         virtual public Callback<AFields>
     {// {{{
-        static constexpr size_t buf_size = 64UL;
-        size_t N_inits = 0UL;
-        std::pair<void *, std::function<void(void *, std::shared_ptr<H5::H5File>)>> inits[buf_size];
+        using init_fct = void (*)(void *, std::shared_ptr<H5::H5File>);
+        std::vector<std::pair<void *, init_fct>> inits;
     protected :
-        void register_init (void *obj, std::function<void(void *, std::shared_ptr<H5::H5File>)> fct)
+        void register_init (void *obj, init_fct fct)
         {
-            inits[N_inits++] = std::make_pair(obj, fct);
-            assert(N_inits < buf_size);
+            inits.emplace_back(obj, fct);
         }
     public :
         void read_grp_meta_init (std::shared_ptr<H5::H5File> fptr) override final
         {
-            for (size_t ii=0; ii != N_inits; ++ii)
-                inits[ii].second(inits[ii].first, fptr);
+            for (const auto &init : inits)
+                init.second(init.first, fptr);
         }
     };// }}}
 
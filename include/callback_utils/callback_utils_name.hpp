@@ -35,6 +35,38 @@ namespace name
         }
     };// }}}
     
+    /*! @brief Illustris-type hdf5 format, reading several particle types in one pass.
+     *
+     * @tparam PartTypes    the particle types, type_idx in #Callback::PrtProperties
+     *                      is the index into this list.
+     *
+     * Should be combined with #CallbackUtils::meta::IllustrisTypes.
+     */
+    template<typename AFields, uint8_t... PartTypes>
+    struct IllustrisTypes :
+        virtual public Callback<AFields>
+    {// {{{
+        static_assert(sizeof...(PartTypes), "need at least one particle type");
+
+        std::string grp_name () const override final
+        {
+            return "Group/";
+        }
+        std::string prt_name () const override final
+        {
+            return prt_type_name(0UL);
+        }
+        size_t prt_types () const override final
+        {
+            return sizeof...(PartTypes);
+        }
+        std::string prt_type_name (size_t type_idx) const override final
+        {
+            static constexpr const uint8_t part_types[] = { PartTypes ... };
+            return "PartType" + std::to_string(part_types[type_idx])+"/";
+        }
+    };// }}}
+
     /*! @brief Illustris-type hdf5 format with custom rockstar.
      *
      * @tparam PartType     the particle type
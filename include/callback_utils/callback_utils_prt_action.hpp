@@ -7,6 +7,16 @@
 #ifndef CALLBACK_UTILS_PRT_ACTION_HPP
 #define CALLBACK_UTILS_PRT_ACTION_HPP
 
+#include <cassert>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <tuple>
+#include <algorithm>
+#include <type_traits>
+#include <utility>
+#include <limits>
+
 #include "callback.hpp"
 #include "callback_utils_grp_action.hpp"
 
@@ -30,6 +40,30 @@ namespace prt_action {
      *                      should be deleted (this is simply an extra code check).
      *                      If no constructor from a `const GrpProperties &` is found,
      *                      the default constructor will be called.
+     *                      If Tdata furthermore implements the methods
+     *                      `Tdata Tdata::clone () const` (returning an empty item for the same group)
+     *                      and `void Tdata::merge (const Tdata &)` (adding the particles inserted
+     *                      into another item for the same group),
+     *                      the code is allowed to split groups with very many particles
+     *                      across threads (see #Callback::grp_splittable).
+     *                      If in addition Tdata is trivially copyable, or implements the methods
+     *                      `void Tdata::pack (std::vector<char> &) const` (appending the
+     *                      accumulated data to the buffer) and
+     *                      `void Tdata::unpack (const char *&)` (reading it back into an item
+     *                      obtained from `clone` and advancing the pointer),
+     *                      the particle chunks can be distributed over several processes
+     *                      (see #Callback::grp_reducible).
+     *                      If Tdata implements the method
+     *                      `void Tdata::prt_insert_batch (size_t grp_idx, const GrpProperties &grp,
+     *                                                     size_t Nprt, const size_t *prt_idx,
+     *                                                     const coord_t *Rsq, void **prt_properties,
+     *                                                     coord_t Bsize, size_t type_idx)`
+     *                      the particles are passed to it in batches instead of one by one
+     *                      (see #Callback::prt_action_batch for the meaning of the arguments).
+     *                      The trailing type_idx can be omitted if there is only one particle type.
+     *                      The batches are not used if there are several apertures
+     *                      (#Callback::grp_apertures), since prt_insert_batch does not receive
+     *                      the aperture indices.
      */
     template<typename AFields, typename Tdata>
     class StorePrtHomogeneous :
@@ -66,8 +100,74 @@ namespace prt_action {
         };
 
 
+        // check whether Tdata has the methods
+        // Tdata clone () const
+        // void merge (const Tdata &)
+        template<typename T, typename = void>
+        struct is_splittable : std::false_type { };
+
+        template<typename T>
+        struct is_splittable<T, std::void_t<decltype(std::declval<const T &>().clone()),
+                                            decltype(std::declval<T &>().merge(std::declval<const T &>()))>>
+            : std::is_same<decltype(std::declval<const T &>().clone()), T> { };
+
+        // check whether Tdata has the methods
+        // void pack (std::vector<char> &) const
+        // void unpack (const char *&)
+        template<typename T, typename = void>
+        struct is_packable : std::false_type { };
+
+        template<typename T>
+        struct is_packable<T, std::void_t<decltype(std::declval<const T &>().pack(std::declval<std::vector<char> &>())),
+                                          decltype(std::declval<T &>().unpack(std::declval<const char *&>()))>>
+            : std::true_type { };
+
+        // check whether Tdata has the method
+        // void prt_insert_batch (size_t grp_idx, const GrpProperties &grp,
+        //                        size_t Nprt, const size_t *prt_idx, const coord_t *Rsq,
+        //                        void **prt_properties, coord_t Bsize, size_t type_idx)
+        template<typename T, typename = void>
+        struct has_prt_insert_batch_typed : std::false_type { };
+
+        template<typename T>
+        struct has_prt_insert_batch_typed<T, std::void_t<decltype(std::declval<T &>().prt_insert_batch(
+                                                 std::declval<size_t>(), std::declval<const GrpProperties &>(),
+                                                 std::declval<size_t>(), std::declval<const size_t *>(),
+                                                 std::declval<const coord_t *>(), std::declval<void **>(),
+                                                 std::declval<coord_t>(), std::declval<size_t>()))>>
+            : std::true_type { };
+
+        // the same without type_idx
+        template<typename T, typename = void>
+        struct has_prt_insert_batch_untyped : std::false_type { };
+
+        template<typename T>
+        struct has_prt_insert_batch_untyped<T, std::void_t<decltype(std::declval<T &>().prt_insert_batch(
+                                                   std::declval<size_t>(), std::declval<const GrpProperties &>(),
+                                                   std::declval<size_t>(), std::declval<const size_t *>(),
+                                                   std::declval<const coord_t *>(), std::declval<void **>(),
+                                                   std::declval<coord_t>()))>>
+            : std::true_type { };
+
+        template<typename T>
+        struct has_prt_insert_batch
+            : std::bool_constant<has_prt_insert_batch_typed<T>::value
+                                 || has_prt_insert_batch_untyped<T>::value> { };
+
+        static constexpr bool is_reducible
+            = is_splittable<Tdata>::value
+              && (is_packable<Tdata>::value || std::is_trivially_copyable_v<Tdata>);
+
         std::vector<Tdata> &data;
 
+        // temporary copies used when groups are split across threads
+        std::vector<Tdata> clones;
+
+        Tdata &data_item (size_t grp_idx)
+        {
+            return (grp_idx < data.size()) ? data[grp_idx] : clones[grp_idx - data.size()];
+        }
+
         void this_grp_action (const GrpProperties &grp) override final
         {
             if constexpr (std::is_constructible_v<Tdata, const GrpProperties &>)
@@ -127,9 +227,462 @@ namespace prt_action {
         {
             if constexpr (has_prt_insert<Tdata, void(size_t, const GrpProperties &,
                                                      const PrtProperties &, coord_t)>::value)
-                data[grp_idx].prt_insert(grp_idx, grp, prt, Rsq);
+                data_item(grp_idx).prt_insert(grp_idx, grp, prt, Rsq);
+            else
+                prt_insert(grp_idx, grp, prt, Rsq, data_item(grp_idx));
+        }
+
+        bool prt_batched () const override final
+        {
+            return has_prt_insert_batch<Tdata>::value && this->grp_Napertures() == 1UL;
+        }
+
+        void prt_action_batch (size_t grp_idx, const GrpProperties &grp,
+                               size_t Nprt, const size_t *prt_idx, const coord_t *Rsq,
+                               const size_t *aperture_idx,
+                               void **prt_properties, coord_t Bsize, size_t type_idx) override final
+        {
+            assert(!aperture_idx);
+
+            if constexpr (has_prt_insert_batch_typed<Tdata>::value)
+                data_item(grp_idx).prt_insert_batch(grp_idx, grp, Nprt, prt_idx, Rsq,
+                                                    prt_properties, Bsize, type_idx);
+            else if constexpr (has_prt_insert_batch_untyped<Tdata>::value)
+                data_item(grp_idx).prt_insert_batch(grp_idx, grp, Nprt, prt_idx, Rsq,
+                                                    prt_properties, Bsize);
+            else
+                assert(false);
+        }
+
+        bool grp_splittable () const override final
+        {
+            return is_splittable<Tdata>::value;
+        }
+
+        size_t grp_clone (size_t grp_idx) override final
+        {
+            if constexpr (is_splittable<Tdata>::value)
+            {
+                clones.push_back(data[grp_idx].clone());
+                return data.size() + clones.size() - 1UL;
+            }
+            else
+            {
+                assert(false);
+                return grp_idx;
+            }
+        }
+
+        void grp_merge (size_t grp_idx, size_t clone_idx) override final
+        {
+            if constexpr (is_splittable<Tdata>::value)
+                data[grp_idx].merge(clones[clone_idx - data.size()]);
             else
-                prt_insert(grp_idx, grp, prt, Rsq, data[grp_idx]);
+                assert(false);
+        }
+
+        void grp_clones_release () override final
+        {
+            clones.clear();
+        }
+
+        bool grp_reducible () const override final
+        {
+            return is_reducible;
+        }
+
+        void grp_state_pack (std::vector<char> &buf) const override final
+        {
+            if constexpr (is_packable<Tdata>::value)
+                for (const auto &item : data)
+                    item.pack(buf);
+            else if constexpr (is_reducible)
+            {
+                const size_t offset = buf.size();
+                buf.resize(offset + data.size() * sizeof(Tdata));
+                std::memcpy(buf.data()+offset, data.data(), data.size() * sizeof(Tdata));
+            }
+            else
+                assert(false);
+        }
+
+        void grp_state_merge (const char *buf) override final
+        {
+            if constexpr (is_reducible)
+                for (auto &item : data)
+                {
+                    Tdata other = item.clone();
+                    if constexpr (is_packable<Tdata>::value)
+                        other.unpack(buf);
+                    else
+                    {
+                        std::memcpy(&other, buf, sizeof(Tdata));
+                        buf += sizeof(Tdata);
+                    }
+                    item.merge(other);
+                }
+            else
+                assert(false);
+        }
+
+        void grp_state_reset () override final
+        {
+            if constexpr (is_reducible)
+                for (auto &item : data)
+                    item = item.clone();
+            else
+                assert(false);
+        }
+    };// }}}
+
+    /*! @brief some particle quantities to be used with #CallbackUtils::prt_action::RadialProfile.
+     */
+    namespace weight
+    {
+        /*! @brief a single particle property.
+         *
+         * @tparam Field    the particle property, must be 1-dimensional.
+         */
+        template<typename Field>
+        struct Property
+        {// {{{
+            static_assert(Field::dim == 1);
+            static_assert(Field::type == FieldTypes::PrtFld);
+
+            template<typename PrtProperties>
+            auto operator() (const PrtProperties &prt) const { return prt.template get<Field>(); }
+        };// }}}
+    } // namespace weight
+
+    /*! @brief accumulates radial profiles of a number of particle quantities around each group,
+     *         with the profiles of all groups in a single flat array.
+     *
+     * @tparam RField       the group property the bin edges are given in units of
+     *                      (e.g. a virial radius), must be 1-dimensional.
+     * @tparam Weights      callable types with a method `operator() (const PrtProperties &) const`
+     *                      returning the quantity a particle contributes (generic lambdas work).
+     *                      See #CallbackUtils::prt_action::weight for some examples.
+     *
+     * For each group and radial bin, the number of particles and the sums of the Weights
+     * over the particles are accumulated.
+     * The bin a particle falls into is found by comparing its squared distance with the
+     * squared bin edges, so no transcendental function is evaluated per particle.
+     *
+     * The data vector is laid out as [group][bin][column], where column 0 holds the number
+     * of particles and column 1+k the sum of the k-th weight.
+     *
+     * This class implements #Callback::prt_action_batch, and allows the code to split groups
+     * across threads and to distribute particle chunks over processes.
+     *
+     * @attention This class cannot be combined with other classes implementing #Callback::prt_action.
+     */
+    template<typename AFields, typename RField, typename... Weights>
+    class RadialProfile :
+        virtual public Callback<AFields>,
+        private grp_action::MultiGrpAction<AFields, RadialProfile<AFields, RField, Weights...>>
+    {// {{{
+        friend grp_action::MultiGrpAction<AFields, RadialProfile<AFields, RField, Weights...>>;
+        using typename Callback<AFields>::GrpProperties;
+        using typename Callback<AFields>::PrtProperties;
+        static_assert(RField::dim == 1);
+        static_assert(RField::type == FieldTypes::GrpFld);
+
+    public :
+        using value_type = double;
+
+        /*! @brief number of values stored per group and bin */
+        static constexpr size_t Ncols = 1UL + sizeof...(Weights);
+
+    private :
+        std::tuple<Weights...> weights;
+
+        // in units of RField
+        // (edges_sq is followed by Nrefine copies of the largest coord_t)
+        std::vector<coord_t> edges, edges_sq;
+        size_t Nbins;
+
+        // the bin is looked up from the leading bits of the squared distance x, which for
+        // positive floats increase with x (they are roughly a piecewise linear log2(x)).
+        // bin_table[key] is the bin of the smallest x with this key, and at most Nrefine
+        // edges fall into the range of x with the same key
+        static constexpr unsigned table_shift = 18U;
+        std::vector<uint32_t> bin_table;
+        size_t Nrefine;
+
+        static uint32_t table_key (coord_t x)
+        {
+            static_assert(sizeof(coord_t) == sizeof(uint32_t));
+            uint32_t bits;
+            std::memcpy(&bits, &x, sizeof(bits));
+            return bits >> table_shift;
+        }
+
+        static coord_t key_to_coord (uint32_t bits)
+        {
+            coord_t x;
+            std::memcpy(&x, &bits, sizeof(x));
+            return x;
+        }
+
+        std::vector<value_type> &data;
+
+        // 1/RField^2 for each group
+        std::vector<coord_t> grp_inv_Rsq;
+
+        // temporary profiles used when groups are split across threads,
+        // and the groups they belong to
+        std::vector<value_type> clones;
+        std::vector<size_t> clone_grp;
+
+        size_t stride () const { return Nbins * Ncols; }
+
+        size_t Ngroups () const { return grp_inv_Rsq.size(); }
+
+        value_type *profile (size_t grp_idx)
+        {
+            return (grp_idx < Ngroups()) ? data.data() + grp_idx * stride()
+                                         : clones.data() + (grp_idx - Ngroups()) * stride();
+        }
+
+        coord_t inv_Rsq (size_t grp_idx) const
+        {
+            return grp_inv_Rsq[(grp_idx < Ngroups()) ? grp_idx : clone_grp[grp_idx - Ngroups()]];
+        }
+
+        // returns the bin x (squared distance in units of RField^2) falls into, or Nbins if outside.
+        // A table lookup followed by Nrefine steps to the next edge, without branches so a loop
+        // over many particles can be vectorized
+        size_t bin (coord_t x) const
+        {
+            const coord_t *e = edges_sq.data();
+            const auto key = std::min(table_key(x), (uint32_t)(bin_table.size()-1UL));
+
+            size_t b = bin_table[key];
+            for (size_t kk=0UL; kk != Nrefine; ++kk)
+                b += (e[b + 1UL] <= x);
+
+            return ((x >= e[0]) & (x < e[Nbins])) ? b : Nbins;
+        }
+
+        void insert (value_type *prof, const PrtProperties &prt, coord_t x)
+        {
+            const size_t b = bin(x);
+            if (b == Nbins)
+                return;
+
+            value_type *p = prof + b * Ncols;
+            p[0] += 1.0;
+
+            size_t col = 1UL;
+            std::apply([&](const auto &... weight) { ((p[col++] += (value_type)weight(prt)), ...); },
+                       weights);
+        }
+
+        // writes the weight of each particle in a batch to w
+        template<typename Weight>
+        static void gather_weight (const Weight &weight, size_t Nprt, const size_t *prt_idx,
+                                   void **prt_properties, coord_t Bsize, size_t type_idx, value_type *w)
+        {
+            for (size_t ii=0; ii != Nprt; ++ii)
+                w[ii] = (value_type)weight(PrtProperties { Bsize, prt_properties, prt_idx[ii], type_idx });
+        }
+
+        void this_grp_action (const GrpProperties &grp) override final
+        {
+            const auto R = (coord_t)grp.template get<RField>();
+            grp_inv_Rsq.push_back((coord_t)1.0 / (R * R));
+            data.resize(data.size() + stride(), 0.0);
+        }
+
+    public :
+        /*! @param data     a zero-length vector that will be filled with the profiles
+         *                  (see class docs for the layout).
+         *  @param edges    the bin edges in units of RField (ascending, at least two values).
+         *                  Particles outside [edges.front(), edges.back()) are ignored.
+         *  @param weights  the particle quantities, in the order of the template parameters.
+         */
+        RadialProfile (std::vector<value_type> &data_, const std::vector<coord_t> &edges_,
+                       const Weights &... weights_) :
+            weights { weights_... },
+            edges { edges_ },
+            Nbins { edges_.size() - 1UL },
+            data(data_)
+        {
+            assert(edges.size() > 1UL);
+            assert(std::is_sorted(edges.begin(), edges.end()));
+
+            for (auto e : edges)
+                edges_sq.push_back(e * e);
+
+            // the bins of the smallest and largest x with each key
+            auto last_edge = [this](coord_t x) -> size_t
+            {
+                const auto it = std::upper_bound(edges_sq.begin(), edges_sq.end(), x);
+                return std::min((size_t)std::max(it - edges_sq.begin() - 1L, 0L), Nbins-1UL);
+            };
+
+            Nrefine = 0UL;
+            for (uint32_t key=0U; key <= table_key(edges_sq.back()); ++key)
+            {
+                const size_t lo = last_edge(key_to_coord(key << table_shift)),
+                             hi = last_edge(key_to_coord(((key+1U) << table_shift) - 1U));
+                bin_table.push_back((uint32_t)lo);
+                Nrefine = std::max(Nrefine, hi - lo);
+            }
+
+            edges_sq.resize(edges_sq.size() + Nrefine, std::numeric_limits<coord_t>::max());
+        }
+
+        /*! @brief returns edges for a profile whose first bin extends from the origin to rmin,
+         *         followed by Nlog logarithmically spaced bins between rmin and rmax.
+         */
+        static std::vector<coord_t> log_edges (coord_t rmin, coord_t rmax, size_t Nlog)
+        {
+            std::vector<coord_t> out { 0.0 };
+            const double dlogr = std::log((double)rmax / (double)rmin) / (double)Nlog;
+            for (size_t ii=0; ii != Nlog; ++ii)
+                out.push_back((coord_t)((double)rmin * std::exp(dlogr * (double)ii)));
+            out.push_back(rmax);
+            return out;
+        }
+
+        /*! @brief number of radial bins */
+        size_t bins () const { return Nbins; }
+
+        /*! @brief volume of a spherical shell corresponding to a bin, for a group.
+         */
+        value_type shell_volume (size_t grp_idx, size_t bin_idx) const
+        {
+            const value_type R3 = std::pow((value_type)grp_inv_Rsq[grp_idx], -1.5),
+                             e1 = edges[bin_idx], e2 = edges[bin_idx+1UL];
+            return 4.0 * M_PI / 3.0 * R3 * (e2*e2*e2 - e1*e1*e1);
+        }
+
+        void prt_action (size_t grp_idx, const GrpProperties &grp,
+                         const PrtProperties &prt, coord_t Rsq) override final
+        {
+            insert(profile(grp_idx), prt, Rsq * inv_Rsq(grp_idx));
+        }
+
+        bool prt_batched () const override final
+        {
+            return true;
+        }
+
+        void prt_action_batch (size_t grp_idx, const GrpProperties &grp,
+                               size_t Nprt, const size_t *prt_idx, const coord_t *Rsq,
+                               const size_t *aperture_idx,
+                               void **prt_properties, coord_t Bsize, size_t type_idx) override final
+        {
+            // the scaled squared distances, bins, and weights (one column after the other)
+            // of the particles, grow-only
+            static thread_local std::vector<coord_t> x_batch;
+            static thread_local std::vector<uint32_t> bins_batch;
+            static thread_local std::vector<value_type> weights_batch;
+            if (bins_batch.size() < Nprt)
+            {
+                x_batch.resize(Nprt);
+                bins_batch.resize(Nprt);
+                weights_batch.resize(Nprt * (Ncols-1UL));
+            }
+
+            value_type *prof = profile(grp_idx);
+            const coord_t s = inv_Rsq(grp_idx);
+            const coord_t *e = edges_sq.data();
+            const uint32_t *table = bin_table.data();
+            const auto max_key = (uint32_t)(bin_table.size()-1UL);
+            coord_t *x = x_batch.data();
+            uint32_t *b = bins_batch.data();
+            value_type *w = weights_batch.data();
+
+            // the same as #bin, with the loops interchanged so each one can be vectorized
+            #pragma omp simd
+            for (size_t ii=0; ii < Nprt; ++ii)
+            {
+                x[ii] = Rsq[ii] * s;
+                b[ii] = table[std::min(table_key(x[ii]), max_key)];
+            }
+
+            for (size_t kk=0UL; kk != Nrefine; ++kk)
+            {
+                #pragma omp simd
+                for (size_t ii=0; ii < Nprt; ++ii)
+                    b[ii] += (e[b[ii] + 1UL] <= x[ii]);
+            }
+
+            #pragma omp simd
+            for (size_t ii=0; ii < Nprt; ++ii)
+                b[ii] = ((x[ii] >= e[0]) & (x[ii] < e[Nbins])) ? b[ii] : (uint32_t)Nbins;
+
+            size_t col = 0UL;
+            std::apply([&](const auto &... weight)
+                       { (gather_weight(weight, Nprt, prt_idx, prt_properties, Bsize, type_idx,
+                                        w + Nprt * col++), ...); },
+                       weights);
+
+            for (size_t ii=0; ii != Nprt; ++ii)
+            {
+                if (b[ii] == Nbins)
+                    continue;
+
+                value_type *p = prof + b[ii] * Ncols;
+                p[0] += 1.0;
+                for (size_t kk=1UL; kk != Ncols; ++kk)
+                    p[kk] += w[Nprt * (kk-1UL) + ii];
+            }
+        }
+
+        bool grp_splittable () const override final
+        {
+            return true;
+        }
+
+        size_t grp_clone (size_t grp_idx) override final
+        {
+            clone_grp.push_back(grp_idx);
+            clones.resize(clones.size() + stride(), 0.0);
+            return Ngroups() + clone_grp.size() - 1UL;
+        }
+
+        void grp_merge (size_t grp_idx, size_t clone_idx) override final
+        {
+            const value_type *src = profile(clone_idx);
+            value_type *dst = profile(grp_idx);
+            for (size_t ii=0; ii != stride(); ++ii)
+                dst[ii] += src[ii];
+        }
+
+        void grp_clones_release () override final
+        {
+            clones.clear();
+            clone_grp.clear();
+        }
+
+        bool grp_reducible () const override final
+        {
+            return true;
+        }
+
+        void grp_state_pack (std::vector<char> &buf) const override final
+        {
+            const char *p = (const char *)data.data();
+            buf.insert(buf.end(), p, p + data.size() * sizeof(value_type));
+        }
+
+        void grp_state_merge (const char *buf) override final
+        {
+            // buf is not necessarily aligned
+            for (size_t ii=0; ii != data.size(); ++ii, buf += sizeof(value_type))
+            {
+                value_type other;
+                std::memcpy(&other, buf, sizeof(value_type));
+                data[ii] += other;
+            }
+        }
+
+        void grp_state_reset () override final
+        {
+            std::fill(data.begin(), data.end(), 0.0);
         }
     };// }}}
 
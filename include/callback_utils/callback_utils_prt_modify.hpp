@@ -1,16 +1,19 @@
 /*! @file callback_utils_prt_modify.hpp
  *
- *  @brief Some common ways to override #Callback::prt_modify
+ *  @brief Some common ways to override #Callback::prt_modify and #Callback::prt_modify_bulk
  */
 
 #ifndef CALLBACK_UTILS_PRT_MODIFY_HPP
 #define CALLBACK_UTILS_PRT_MODIFY_HPP
 
+#include <cmath>
+#include <type_traits>
+
 #include "callback.hpp"
 
 namespace CallbackUtils {
 
-/*! @brief Some common ways to override #Callback::prt_modify
+/*! @brief Some common ways to override #Callback::prt_modify and #Callback::prt_modify_bulk
  */
 namespace prt_modify {
 
@@ -24,8 +27,13 @@ namespace prt_modify {
     template<typename AFields, typename VField, bool sqrta>
     class PrtRSD :
         virtual public Callback<AFields>
-    {
-        using typename Callback<AFields>::PrtProperties;
+    {// {{{
+        static_assert(VField::dim == 3);
+        static_assert(VField::type == FieldTypes::PrtFld);
+
+        // velocity fields flagged as coordinates have been converted to the global type
+        using vel_t = std::conditional_t<VField::coord, coord_t, typename VField::value_type>;
+
         bool do_it;
         coord_t rsd_factor;
         size_t rsd_direction;
@@ -53,17 +61,27 @@ namespace prt_modify {
             if constexpr (sqrta) rsd_factor /= std::sqrt(1.0+z);
         }
 
-        void prt_modify (PrtProperties &prt) override final {
+        bool prt_modifies () const override final { return do_it; }
+
+        bool prt_modify_is_bulk () const override final { return true; }
+
+        void prt_modify_bulk (size_t Nprt, coord_t Bsize, void **prt_properties, size_t type_idx) override final {
             if (!do_it) return;
-            const auto v = prt.template get<VField>()[rsd_direction];
-            auto x = prt.coord()[rsd_direction];
-            x += rsd_factor * v;
-            // make sure periodicity still respected
-            if (x > prt.Bsize) x -= prt.Bsize;
-            else if (x < 0) x += prt.Bsize;
-            prt.coord()[rsd_direction] = x;
+
+            coord_t *x = (coord_t *)prt_properties[0] + rsd_direction;
+            const vel_t *v = (const vel_t *)prt_properties[AFields::ParticleFields::template idx<VField>]
+                             + rsd_direction;
+
+            #pragma omp simd
+            for (size_t ii=0; ii < Nprt; ++ii) {
+                coord_t xx = x[3UL*ii] + rsd_factor * (coord_t)v[3UL*ii];
+                // make sure periodicity still respected
+                // (branch-free so the loop vectorizes)
+                xx -= Bsize * std::floor(xx / Bsize);
+                x[3UL*ii] = xx;
+            }
         }
-    };
+    };// }}}
 }
 
 }
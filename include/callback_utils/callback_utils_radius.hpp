@@ -7,6 +7,10 @@
 #ifndef CALLBACK_UTILS_RADIUS_HPP
 #define CALLBACK_UTILS_RADIUS_HPP
 
+#include <cassert>
+#include <array>
+#include <algorithm>
+
 #include "callback.hpp"
 
 namespace CallbackUtils {
@@ -47,6 +51,62 @@ namespace radius
         }
     };// }}}
 
+    /*! @brief several apertures, each proportional to one of the group properties.
+     *
+     * @tparam RFields      the group properties the apertures are proportional to,
+     *                      from the smallest to the largest aperture
+     *                      (the same field can appear several times).
+     *
+     * Implements #Callback::grp_Napertures and #Callback::grp_apertures,
+     * the group radius is the largest aperture.
+     */
+    template<typename AFields, typename... RFields>
+    class Apertures :
+        virtual public Callback<AFields>
+    {// {{{
+        static_assert(sizeof...(RFields), "need at least one aperture");
+        static_assert(((RFields::dim == 1) && ...));
+        static_assert(((RFields::type == FieldTypes::GrpFld) && ...));
+        static_assert((std::is_floating_point_v<typename RFields::value_type> && ...));
+
+        static constexpr const size_t N = sizeof...(RFields);
+        std::array<coord_t, N> scalings;
+    public :
+        /*! @param scalings     the proportionality factors, aperture k is computed as
+         *                      scalings[k] * RFields[k].
+         *                      The apertures must be in increasing order for every group.
+         */
+        Apertures (const std::array<coord_t, N> &scalings_) :
+            scalings { scalings_ }
+        { }
+
+        /*! default constructor sets all proportionality factors to 1.
+         */
+        Apertures ()
+        {
+            scalings.fill((coord_t)1.0);
+        }
+
+        coord_t grp_radius (const typename Callback<AFields>::GrpProperties &grp) const override final
+        {
+            coord_t R[N];
+            grp_apertures(grp, R);
+            return R[N-1UL];
+        }
+
+        size_t grp_Napertures () const override final
+        {
+            return N;
+        }
+
+        void grp_apertures (const typename Callback<AFields>::GrpProperties &grp, coord_t *R) const override final
+        {
+            size_t ii = 0UL;
+            ((R[ii] = scalings[ii] * grp.template get<RFields>(), ++ii), ...);
+            assert(std::is_sorted(R, R+N));
+        }
+    };// }}}
+
 } // namespace radius
 
 } // namespace CallbackUtils
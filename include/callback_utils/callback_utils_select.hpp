@@ -7,8 +7,12 @@
 #define CALLBACK_UTILS_SELECT_HPP
 
 #include <cassert>
+#include <cstdint>
 #include <utility>
-#include <functional>
+#include <vector>
+#include <tuple>
+#include <limits>
+#include <type_traits>
 
 #include "callback.hpp"
 
@@ -32,20 +36,18 @@ namespace select
         virtual public Callback<AFields>
     {// {{{
         using typename Callback<AFields>::GrpProperties;
-        static constexpr size_t buf_size = 64UL;
-        size_t N_selects = 0UL;
-        std::pair<void *, std::function<bool(void *, const GrpProperties &)>> selectors[buf_size];
+        using select_fct = bool (*)(void *, const GrpProperties &);
+        std::vector<std::pair<void *, select_fct>> selectors;
     protected :
-        void register_select (void *obj, std::function<bool(void *, const GrpProperties &)> fct)
+        void register_select (void *obj, select_fct fct)
         {
-            selectors[N_selects++] = std::make_pair(obj, fct);
-            assert(N_selects < buf_size);
+            selectors.emplace_back(obj, fct);
         }
     public :
         bool grp_select (const GrpProperties &grp) const override final
         {
-            for (size_t ii=0; ii != N_selects; ++ii)
-                if (!selectors[ii].second(selectors[ii].first, grp))
+            for (const auto &selector : selectors)
+                if (!selector.second(selector.first, grp))
                     return false;
             return true;
         }
@@ -57,7 +59,7 @@ namespace select
      *
      * @note Child has to make this class friend.
      *
-     * See #CallbackUtils::select::Window for an example.
+     * See #CallbackUtils::select::Condition for an example.
      */
     template<typename AFields, typename Child>
     class MultiSelect :
@@ -82,93 +84,201 @@ namespace select
         }
     };// }}}
 
-    /*! @brief select only groups that have some discrete property equal a certain value
+    /*! @brief conditions on a single group property, to be combined with #CallbackUtils::select::All.
      *
-     * @tparam Field    the group property that should be checked
+     * A condition is a type with a member type `field` (the group property it checks)
+     * and a method `bool operator() (typename field::value_type) const`.
+     * They can also be used on their own through #CallbackUtils::select::Condition.
      */
-    template<typename AFields, typename Field>
-    class Equals :
-        virtual public Callback<AFields>,
-        private MultiSelect<AFields, Equals<AFields, Field>>
+    namespace cond
     {
-        friend MultiSelect<AFields, Equals<AFields, Field>>;
-        using typename Callback<AFields>::GrpProperties;
-        static_assert(Field::dim == 1);
-        static_assert(Field::type == FieldTypes::GrpFld);
-        static_assert(std::is_integral_v<typename Field::value_type>);
+        /*! @brief the property equals a certain value.
+         */
+        template<typename Field>
+        struct Equals
+        {// {{{
+            static_assert(Field::dim == 1);
+            static_assert(Field::type == FieldTypes::GrpFld);
+            static_assert(std::is_integral_v<typename Field::value_type>);
 
-        typename Field::value_type check_val;
+            using field = Field;
+            typename Field::value_type check_val;
 
-        bool this_grp_select (const GrpProperties &grp) const override final
-        {
-            auto x = grp.template get<Field>();
-            return x == check_val;
-        }
-    public :
-        Equals (typename Field::value_type check_val_) :
-            check_val { check_val_ }
-        { }
-    };
+            Equals (typename Field::value_type check_val_) :
+                check_val { check_val_ }
+            { }
 
-    /*! @brief select only groups that have some 1-dimensional property fall into an interval.
+            bool operator() (typename Field::value_type x) const { return x == check_val; }
+        };// }}}
+
+        /*! @brief the property falls into an interval (excluding the edges).
+         */
+        template<typename Field>
+        struct Window
+        {// {{{
+            static_assert(Field::dim == 1);
+            static_assert(Field::type == FieldTypes::GrpFld);
+            static_assert(std::is_floating_point_v<typename Field::value_type>);
+
+            using field = Field;
+            typename Field::value_type min_val, max_val;
+
+            Window (typename Field::value_type min_val_, typename Field::value_type max_val_) :
+                min_val { min_val_ }, max_val { max_val_ }
+            { }
+
+            // no short-circuit, so loops over this can be vectorized
+            bool operator() (typename Field::value_type x) const { return (x > min_val) & (x < max_val); }
+        };// }}}
+
+        /*! @brief the property is above a certain value.
+         */
+        template<typename Field>
+        struct LowCutoff : public Window<Field>
+        {// {{{
+            LowCutoff (typename Field::value_type min_val) :
+                Window<Field> { min_val, std::numeric_limits<typename Field::value_type>::max() }
+            { }
+        };// }}}
+
+        /*! @brief the property is below a certain value.
+         */
+        template<typename Field>
+        struct HighCutoff : public Window<Field>
+        {// {{{
+            HighCutoff (typename Field::value_type max_val) :
+                Window<Field> { std::numeric_limits<typename Field::value_type>::lowest(), max_val }
+            { }
+        };// }}}
+    } // namespace cond
+
+    /*! @brief select only groups that fulfill one of the conditions in #CallbackUtils::select::cond,
+     *         to be combined with other classes based on #CallbackUtils::select::MultiSelect.
      *
-     * @tparam Field    the group property that should be checked.
+     * @tparam Cond     the condition.
+     *
+     * The constructor arguments are passed on to the condition's constructor.
      */
-    template<typename AFields, typename Field>
-    class Window :
+    template<typename AFields, typename Cond>
+    class Condition :
         virtual public Callback<AFields>,
-        private MultiSelect<AFields, Window<AFields, Field>>
+        private MultiSelect<AFields, Condition<AFields, Cond>>
     {// {{{
-        friend MultiSelect<AFields, Window<AFields, Field>>;
+        friend MultiSelect<AFields, Condition<AFields, Cond>>;
         using typename Callback<AFields>::GrpProperties;
-        static_assert(Field::dim == 1);
-        static_assert(Field::type == FieldTypes::GrpFld);
-        static_assert(std::is_floating_point_v<typename Field::value_type>);
 
-        typename Field::value_type min_val, max_val;
+        Cond cond;
 
         bool this_grp_select (const GrpProperties &grp) const override final
         {
-            auto x = grp.template get<Field>();
-            return x > min_val && x < max_val;
+            return cond(grp.template get<typename Cond::field>());
         }
     public :
-        /*! @param min_val      lower edge of the interval
-         *  @param max_val      upper edge of the interval
-         */
-        Window (typename Field::value_type min_val_, typename Field::value_type max_val_) :
-            min_val { min_val_ }, max_val  { max_val_ }
+        template<typename... Args>
+        Condition (Args &&... args) :
+            cond (std::forward<Args>(args)...)
         { }
     };// }}}
-    
+
+    /*! @brief select only groups that have some discrete property equal a certain value
+     *
+     * @tparam Field    the group property that should be checked
+     *
+     * Constructed from the value, see #CallbackUtils::select::cond::Equals.
+     */
+    template<typename AFields, typename Field>
+    using Equals = Condition<AFields, cond::Equals<Field>>;
+
+    /*! @brief select only groups that have some 1-dimensional property fall into an interval.
+     *
+     * @tparam Field    the group property that should be checked.
+     *
+     * Constructed from the lower and upper edge, see #CallbackUtils::select::cond::Window.
+     */
+    template<typename AFields, typename Field>
+    using Window = Condition<AFields, cond::Window<Field>>;
+
     /*! @brief select only groups that have some 1-dimensional property above a certain value.
      *
      * @tparam Field    the group property that should be checked.
+     *
+     * Constructed from the lower limit, see #CallbackUtils::select::cond::LowCutoff.
      */
     template<typename AFields, typename Field>
-    struct LowCutoff :
-        virtual public Callback<AFields>,
-        private Window<AFields, Field>
-    {// {{{
-        /*! @param min_val      lower limit on Field.
-         */
-        LowCutoff (typename Field::value_type min_val) :
-            Window<AFields, Field> { min_val, std::numeric_limits<typename Field::value_type>::max() } { }
-    };// }}}
-    
+    using LowCutoff = Condition<AFields, cond::LowCutoff<Field>>;
+
     /*! @brief select only groups that have some 1-dimensional property below a certain value.
      *
      * @tparam Field    the group property that should be checked.
+     *
+     * Constructed from the upper limit, see #CallbackUtils::select::cond::HighCutoff.
      */
     template<typename AFields, typename Field>
-    struct HighCutoff :
-        virtual public Callback<AFields>,
-        private Window<AFields, Field>
+    using HighCutoff = Condition<AFields, cond::HighCutoff<Field>>;
+
+    /*! @brief select only groups that fulfill all of a number of conditions,
+     *         with the combination resolved at compile time.
+     *
+     * @tparam Conds    the conditions, see #CallbackUtils::select::cond.
+     *
+     * In contrast to the classes based on #CallbackUtils::select::MultiSelect,
+     * the conditions are not called through function pointers, so they can be inlined
+     * and are evaluated with short-circuit in #Callback::grp_select.
+     * This class also implements #Callback::grp_select_bulk, which checks each condition
+     * in a vectorizable loop over the respective column of the group chunk.
+     *
+     * @attention This class cannot be combined with the classes based on
+     *            #CallbackUtils::select::MultiSelect, all conditions should be passed to it.
+     *
+     * Example :
+     * @code
+     * select::All<AF, select::cond::LowCutoff<IllustrisFields::Group_M_Crit200>,
+     *                 select::cond::Window<IllustrisFields::Group_R_Crit200>>
+     *     { 1e4, { 100.0, 1000.0 } }
+     * @endcode
+     */
+    template<typename AFields, typename... Conds>
+    class All :
+        virtual public Callback<AFields>
     {// {{{
-        /*! @param max_val      upper limit on Field.
+        using typename Callback<AFields>::GrpProperties;
+
+        std::tuple<Conds...> conds;
+
+        template<typename Cond>
+        static void select_column (const Cond &cond, size_t Ngroups, void **grp_properties, uint8_t *selected)
+        {
+            using Field = typename Cond::field;
+            const auto *x = (const typename Field::value_type *)
+                            grp_properties[AFields::GroupFields::template idx<Field>];
+
+            #pragma omp simd
+            for (size_t ii=0; ii < Ngroups; ++ii)
+                selected[ii] &= (uint8_t)cond(x[ii]);
+        }
+    public :
+        /*! @param conds    the conditions, in the order of the template parameters.
          */
-        HighCutoff (typename Field::value_type max_val) :
-            Window<AFields, Field> { std::numeric_limits<typename Field::value_type>::min(), max_val } { }
+        All (const Conds &... conds_) :
+            conds { conds_... }
+        { }
+
+        bool grp_select (const GrpProperties &grp) const override final
+        {
+            return std::apply([&grp](const auto &... cond)
+                              { return (cond(grp.template get<typename std::decay_t<decltype(cond)>::field>())
+                                        && ...); },
+                              conds);
+        }
+
+        bool grp_select_is_bulk () const override final { return true; }
+
+        void grp_select_bulk (size_t Ngroups, void **grp_properties, uint8_t *selected) override final
+        {
+            std::apply([Ngroups, grp_properties, selected](const auto &... cond)
+                       { (select_column(cond, Ngroups, grp_properties, selected), ...); },
+                       conds);
+        }
     };// }}}
 
 } // namespace select
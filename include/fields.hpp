@@ -178,14 +178,32 @@ public :
                    "Duplicate field, this is likely not what you intended to do.");
 
     // converts coords to global coordinate type if necessary
-    // this function takes care of the necessary buffer reallocs
+    // the buffer must be large enough to hold the coordinates in both types.
+    // If residuals is given, the differences between the original coordinates (in double precision)
+    // and the converted ones are written there (Nitems * dims[0] elements)
     static void
-    convert_coords (size_t Nitems, void * &coords, coord_t rescale=1)
+    convert_coords (size_t Nitems, void *coords, coord_t rescale=1, coord_t *residuals=nullptr)
     {
+        const bool do_rescale = std::fabs(std::log(rescale)) > 1e-8;
+
+        if (residuals)
+        {
+            const sim_coord_t *coords_sim_type = (const sim_coord_t *)coords;
+
+            // same arithmetic as below
+            for (size_t ii=0; ii != Nitems * dims[0]; ++ii)
+            {
+                coord_t x = (coord_t)(coords_sim_type[ii]);
+                if (do_rescale)
+                    x *= rescale;
+                residuals[ii] = (coord_t)((double)(coords_sim_type[ii]) * (double)rescale - (double)x);
+            }
+        }
+
         if constexpr (!std::is_same_v<sim_coord_t, coord_t>)
         {
             if constexpr (sizeof(coord_t) <= sizeof(sim_coord_t))
-            // we can work in the original buffer
+            // we can work from the front
             {
                 // get some accessor-type pointers
                 coord_t *coords_global_type = (coord_t *)coords;
@@ -194,16 +212,10 @@ public :
                 // do the conversion
                 for (size_t ii=0; ii != Nitems * dims[0]; ++ii)
                     coords_global_type[ii] = (coord_t)(coords_sim_type[ii]);
-
-                // resize to save memory
-                coords = std::realloc(coords, Nitems * dims[0] * sizeof(coord_t));
             }
             else
-            // we need to enlarge the new buffer
+            // we need to work from the back of the buffer
             {
-                // make more space, preserving the data
-                coords = std::realloc(coords, Nitems * dims[0] * sizeof(coord_t));
-
                 // get some accessor-type pointers
                 coord_t *coords_global_type = (coord_t *)coords;
                 sim_coord_t *coords_sim_type
@@ -220,7 +232,7 @@ public :
         }
 
         // do the rescaling if necessary
-        if (std::fabs(std::log(rescale)) > 1e-8) {
+        if (do_rescale) {
             auto *x = (coord_t *)coords;
             for (size_t ii=0; ii != Nitems * dims[0]; ++ii)
                 x[ii] *= rescale;
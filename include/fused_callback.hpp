@@ -0,0 +1,525 @@
+/*! @file fused_callback.hpp
+ *
+ * @brief Lets several #Callback instances share a single pass over the data files.
+ */
+
+#ifndef FUSED_CALLBACK_HPP
+#define FUSED_CALLBACK_HPP
+
+#include <cassert>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "H5Cpp.h"
+
+#include "callback.hpp"
+
+/*! @brief Combines several #Callback instances into one, so that the particle data
+ *         is read and sorted only once for all of them.
+ *
+ * @tparam AFields      as for #Callback.
+ *                      All members must use the same AFields, which should then contain
+ *                      the union of the fields the individual analyses require.
+ *
+ * Each member keeps its own selection (#Callback::grp_select), group actions
+ * (#Callback::grp_action) and radius (#Callback::grp_radius, or #Callback::grp_apertures
+ * in which case the member receives its own #Callback::PrtProperties::aperture_idx).
+ * The code works with all groups selected by at least one member and the largest
+ * of their radii, and each member's #Callback::prt_action (or #Callback::prt_action_batch)
+ * is called only for its own groups and the particles within its own radius.
+ * The grp_idx arguments passed to a member count only the groups that member selected,
+ * so the member sees the same calls as if it had been run on its own.
+ *
+ * The methods describing the data files (#Callback::grp_chunk, #Callback::prt_chunk,
+ * #Callback::grp_name, #Callback::prt_name, #Callback::read_grp_meta, #Callback::read_prt_meta,
+ * and the particle types #Callback::prt_types, #Callback::prt_type_name, #Callback::read_prt_type_meta),
+ * #Callback::prt_coord_rescale and the modifications to the shared particle data
+ * (#Callback::prt_modifies, #Callback::prt_modify_is_bulk, #Callback::prt_modify,
+ * #Callback::prt_modify_bulk) are taken from the first member.
+ * The members' #Callback::grp_select_bulk is not used.
+ * The meta-data initialization (#Callback::read_grp_meta_init, #Callback::read_prt_meta_init)
+ * is done for all members.
+ *
+ * Groups are split across threads only if all members support it (#Callback::grp_splittable),
+ * and the same holds for the distribution over processes (#Callback::grp_reducible).
+ * The particles are passed in batches only if all members want them (#Callback::prt_batched).
+ *
+ * The particles are kept for several passes if any member wants them (#Callback::prt_multipass).
+ * After each pass, #Callback::pass_end is called for the members that are still running,
+ * and only these receive #Callback::grp_update and the particles of the next pass.
+ * Each member moves and resizes its own copy of the group. The code uses the largest
+ * of the running members' radii, and the coordinates are those of the last running member
+ * that moved the group, so several multipass members should not select the same groups.
+ *
+ * The instance can be passed to #group_particles, #group_particles_mpi and #group_particles_fork.
+ * For convenience, #group_particles also accepts several callbacks directly.
+ *
+ * @attention The members must stay alive as long as this instance is used.
+ */
+template<typename AFields>
+class FusedCallback : public Callback<AFields>
+{// {{{
+    using typename Callback<AFields>::GrpProperties;
+    using typename Callback<AFields>::PrtProperties;
+
+    std::vector<Callback<AFields> *> members;
+
+    // whether the members want their particles in batches
+    std::vector<bool> members_batched;
+
+    // number of groups each member has selected so far
+    std::vector<size_t> members_Ngroups;
+
+    // number of apertures of each member
+    std::vector<size_t> members_Napertures;
+
+    // whether the members still want particles (for Callback::prt_multipass)
+    std::vector<bool> members_running;
+
+    // a group as seen by one of the members
+    struct Entry
+    {
+        size_t member;
+        size_t grp_idx;
+        coord_t R, Rsq;
+        // if the member has several apertures, their squares are
+        // aperture_Rsq[apertures_begin ... apertures_begin+members_Napertures[member]]
+        size_t apertures_begin;
+    };
+
+    std::vector<coord_t> aperture_Rsq;
+
+    // the entries of group grp_idx are entries[entries_begin[grp_idx] ... entries_begin[grp_idx+1]]
+    std::vector<Entry> entries;
+    std::vector<size_t> entries_begin { 0UL };
+
+    // same layout for the temporary copies from grp_clone,
+    // whose indices start after the last group
+    std::vector<Entry> clone_entries;
+    std::vector<size_t> clone_entries_begin { 0UL };
+
+    size_t Ngroups () const { return entries_begin.size() - 1UL; }
+
+    const Entry *entries_of (size_t grp_idx, size_t &Nentries) const
+    {
+        if (grp_idx < Ngroups())
+        {
+            Nentries = entries_begin[grp_idx+1UL] - entries_begin[grp_idx];
+            return entries.data() + entries_begin[grp_idx];
+        }
+
+        const size_t clone_idx = grp_idx - Ngroups();
+        Nentries = clone_entries_begin[clone_idx+1UL] - clone_entries_begin[clone_idx];
+        return clone_entries.data() + clone_entries_begin[clone_idx];
+    }
+
+    Callback<AFields> &first () const { return *members.front(); }
+
+    // the radius of the group for one member, and its apertures (if it has several)
+    coord_t member_radius (size_t member, const GrpProperties &grp, coord_t *R) const
+    {
+        const size_t Napertures = members_Napertures[member];
+        if (Napertures == 1UL)
+            return members[member]->grp_radius(grp);
+
+        members[member]->grp_apertures(grp, R);
+        return R[Napertures-1UL];
+    }
+
+    // the member's apertures after its radius has changed from R_old to e.R,
+    // as Callback::grp_update scales them all by the same factor
+    void scale_apertures (const Entry &e, const GrpProperties &grp, coord_t R_old)
+    {
+        const size_t Napertures = members_Napertures[e.member];
+        coord_t *Rsq = aperture_Rsq.data() + e.apertures_begin;
+
+        if (R_old > (coord_t)0.0)
+        {
+            const coord_t scale_sq = e.Rsq / (R_old * R_old);
+            for (size_t ii=0; ii != Napertures-1UL; ++ii)
+                Rsq[ii] *= scale_sq;
+        }
+        else
+        {
+            // nothing to scale, start again from the ratios of the catalog apertures
+            members[e.member]->grp_apertures(grp, Rsq);
+            const coord_t R_cat = Rsq[Napertures-1UL];
+            for (size_t ii=0; ii != Napertures-1UL; ++ii)
+            {
+                Rsq[ii] = (R_cat > (coord_t)0.0) ? Rsq[ii] * e.R / R_cat : e.R;
+                Rsq[ii] *= Rsq[ii];
+            }
+        }
+
+        Rsq[Napertures-1UL] = e.Rsq;
+    }
+
+    void member_prt_action (const Entry &e, const GrpProperties &grp,
+                            const PrtProperties &prt, coord_t Rsq)
+    {
+        const size_t Napertures = members_Napertures[e.member];
+        if (Napertures == 1UL)
+        {
+            members[e.member]->prt_action(e.grp_idx, grp, prt, Rsq);
+            return;
+        }
+
+        PrtProperties prt_aperture (prt);
+        prt_aperture.aperture_idx = 0UL;
+        for (size_t ii=0; ii != Napertures; ++ii)
+            prt_aperture.aperture_idx += (Rsq > aperture_Rsq[e.apertures_begin + ii]);
+        members[e.member]->prt_action(e.grp_idx, grp, prt_aperture, Rsq);
+    }
+
+public :
+    /*! @param members_     the callbacks to combine, at least one.
+     */
+    FusedCallback (const std::vector<Callback<AFields> *> &members_) :
+        members { members_ },
+        members_Ngroups(members_.size(), 0UL),
+        members_running(members_.size(), true)
+    {
+        assert(!members.empty());
+
+        for (auto m : members)
+        {
+            members_batched.push_back(m->prt_batched());
+            members_Napertures.push_back(m->grp_Napertures());
+        }
+    }
+
+    bool grp_chunk (size_t chunk_idx, std::string &fname) const override
+    {
+        return first().grp_chunk(chunk_idx, fname);
+    }
+
+    bool prt_chunk (size_t chunk_idx, std::string &fname) const override
+    {
+        return first().prt_chunk(chunk_idx, fname);
+    }
+
+    std::string grp_name () const override
+    {
+        return first().grp_name();
+    }
+
+    std::string prt_name () const override
+    {
+        return first().prt_name();
+    }
+
+    size_t prt_types () const override
+    {
+        return first().prt_types();
+    }
+
+    std::string prt_type_name (size_t type_idx) const override
+    {
+        return first().prt_type_name(type_idx);
+    }
+
+    void read_grp_meta_init (std::shared_ptr<H5::H5File> fptr) override
+    {
+        for (auto m : members)
+            m->read_grp_meta_init(fptr);
+    }
+
+    void read_prt_meta_init (std::shared_ptr<H5::H5File> fptr) override
+    {
+        for (auto m : members)
+            m->read_prt_meta_init(fptr);
+    }
+
+    void read_grp_meta (size_t chunk_idx, std::shared_ptr<H5::H5File> fptr,
+                        size_t &Ngroups) const override
+    {
+        first().read_grp_meta(chunk_idx, fptr, Ngroups);
+    }
+
+    void read_prt_meta (size_t chunk_idx, std::shared_ptr<H5::H5File> fptr,
+                        coord_t &Bsize, size_t &Nparts) const override
+    {
+        first().read_prt_meta(chunk_idx, fptr, Bsize, Nparts);
+    }
+
+    void read_prt_type_meta (size_t chunk_idx, std::shared_ptr<H5::H5File> fptr,
+                             size_t type_idx, size_t &Nparts) const override
+    {
+        first().read_prt_type_meta(chunk_idx, fptr, type_idx, Nparts);
+    }
+
+    bool grp_select (const GrpProperties &grp) const override
+    {
+        for (auto m : members)
+            if (m->grp_select(grp))
+                return true;
+        return false;
+    }
+
+    void grp_action (const GrpProperties &grp) override
+    {
+        for (size_t ii=0; ii != members.size(); ++ii)
+            if (members[ii]->grp_select(grp))
+            {
+                members[ii]->grp_action(grp);
+
+                const size_t apertures_begin = aperture_Rsq.size();
+                if (members_Napertures[ii] > 1UL)
+                    aperture_Rsq.resize(apertures_begin + members_Napertures[ii]);
+
+                const coord_t R = member_radius(ii, grp, aperture_Rsq.data() + apertures_begin);
+                for (size_t jj=apertures_begin; jj != aperture_Rsq.size(); ++jj)
+                    aperture_Rsq[jj] *= aperture_Rsq[jj];
+
+                entries.push_back(Entry { ii, members_Ngroups[ii]++, R, R * R, apertures_begin });
+            }
+
+        entries_begin.push_back(entries.size());
+    }
+
+    coord_t grp_radius (const GrpProperties &grp) const override
+    {
+        static thread_local std::vector<coord_t> apertures;
+
+        coord_t R = 0.0;
+        for (size_t ii=0; ii != members.size(); ++ii)
+            if (members[ii]->grp_select(grp))
+            {
+                apertures.resize(members_Napertures[ii]);
+                R = std::max(R, member_radius(ii, grp, apertures.data()));
+            }
+        return R;
+    }
+
+    void prt_action (size_t grp_idx, const GrpProperties &grp,
+                     const PrtProperties &prt, coord_t Rsq) override
+    {
+        size_t Nentries;
+        const Entry *e = entries_of(grp_idx, Nentries);
+
+        for (size_t ii=0; ii != Nentries; ++ii)
+            if (Rsq <= e[ii].Rsq && members_running[e[ii].member])
+                member_prt_action(e[ii], grp, prt, Rsq);
+    }
+
+    bool prt_batched () const override
+    {
+        return std::all_of(members_batched.begin(), members_batched.end(), [](bool b) { return b; });
+    }
+
+    void prt_action_batch (size_t grp_idx, const GrpProperties &grp,
+                           size_t Nprt, const size_t *prt_idx, const coord_t *Rsq,
+                           const size_t *aperture_idx,
+                           void **prt_properties, coord_t Bsize, size_t type_idx) override
+    {
+        // the particles within each member's radius, grow-only
+        static thread_local std::vector<size_t> sub_prt_idx, sub_aperture_idx;
+        static thread_local std::vector<coord_t> sub_Rsq;
+        if (sub_prt_idx.size() < Nprt)
+        {
+            sub_prt_idx.resize(Nprt);
+            sub_aperture_idx.resize(Nprt);
+            sub_Rsq.resize(Nprt);
+        }
+
+        size_t Nentries;
+        const Entry *e = entries_of(grp_idx, Nentries);
+
+        for (size_t ii=0; ii != Nentries; ++ii)
+        {
+            if (!members_running[e[ii].member])
+                continue;
+
+            Callback<AFields> *m = members[e[ii].member];
+
+            size_t Nsub = 0UL;
+            for (size_t jj=0; jj != Nprt; ++jj)
+            {
+                sub_prt_idx[Nsub] = prt_idx[jj];
+                sub_Rsq[Nsub] = Rsq[jj];
+                Nsub += (Rsq[jj] <= e[ii].Rsq);
+            }
+
+            if (!Nsub)
+                continue;
+
+            // the member's own apertures
+            const size_t Napertures = members_Napertures[e[ii].member];
+            if (Napertures > 1UL)
+                for (size_t jj=0; jj != Nsub; ++jj)
+                {
+                    sub_aperture_idx[jj] = 0UL;
+                    for (size_t kk=0; kk != Napertures; ++kk)
+                        sub_aperture_idx[jj] += (sub_Rsq[jj] > aperture_Rsq[e[ii].apertures_begin + kk]);
+                }
+
+            m->prt_action_batch(e[ii].grp_idx, grp, Nsub, sub_prt_idx.data(), sub_Rsq.data(),
+                                (Napertures > 1UL) ? sub_aperture_idx.data() : nullptr,
+                                prt_properties, Bsize, type_idx);
+        }
+    }
+
+    bool prt_multipass () const override
+    {
+        for (auto m : members)
+            if (m->prt_multipass())
+                return true;
+        return false;
+    }
+
+    bool pass_end (size_t pass_idx) override
+    {
+        bool another_pass = false;
+        for (size_t ii=0; ii != members.size(); ++ii)
+        {
+            members_running[ii] = members_running[ii] && members[ii]->prt_multipass()
+                                  && members[ii]->pass_end(pass_idx);
+            another_pass = another_pass || members_running[ii];
+        }
+        return another_pass;
+    }
+
+    void grp_update (size_t grp_idx, const GrpProperties &grp,
+                     coord_t *coord, coord_t &R) override
+    {
+        Entry *e = entries.data() + entries_begin[grp_idx];
+        const size_t Nentries = entries_begin[grp_idx+1UL] - entries_begin[grp_idx];
+
+        // only the running members need the particles of this group
+        R = 0.0;
+        for (size_t ii=0; ii != Nentries; ++ii)
+        {
+            if (!members_running[e[ii].member])
+                continue;
+
+            const coord_t R_old = e[ii].R;
+            members[e[ii].member]->grp_update(e[ii].grp_idx, grp, coord, e[ii].R);
+            e[ii].Rsq = e[ii].R * e[ii].R;
+
+            if (members_Napertures[e[ii].member] > 1UL)
+                scale_apertures(e[ii], grp, R_old);
+
+            R = std::max(R, e[ii].R);
+        }
+    }
+
+    bool grp_splittable () const override
+    {
+        for (auto m : members)
+            if (!m->grp_splittable())
+                return false;
+        return true;
+    }
+
+    size_t grp_clone (size_t grp_idx) override
+    {
+        size_t Nentries;
+        const Entry *e = entries_of(grp_idx, Nentries);
+
+        for (size_t ii=0; ii != Nentries; ++ii)
+            clone_entries.push_back(Entry { e[ii].member,
+                                            members[e[ii].member]->grp_clone(e[ii].grp_idx),
+                                            e[ii].R, e[ii].Rsq, e[ii].apertures_begin });
+
+        clone_entries_begin.push_back(clone_entries.size());
+        return Ngroups() + clone_entries_begin.size() - 2UL;
+    }
+
+    void grp_merge (size_t grp_idx, size_t clone_idx) override
+    {
+        size_t Nentries, Nclone_entries;
+        const Entry *e = entries_of(grp_idx, Nentries);
+        const Entry *c = entries_of(clone_idx, Nclone_entries);
+        assert(Nentries == Nclone_entries);
+
+        for (size_t ii=0; ii != Nentries; ++ii)
+            members[e[ii].member]->grp_merge(e[ii].grp_idx, c[ii].grp_idx);
+    }
+
+    void grp_clones_release () override
+    {
+        for (auto m : members)
+            m->grp_clones_release();
+
+        clone_entries.clear();
+        clone_entries_begin.resize(1UL);
+    }
+
+    bool grp_reducible () const override
+    {
+        for (auto m : members)
+            if (!m->grp_reducible())
+                return false;
+        return true;
+    }
+
+    void grp_state_pack (std::vector<char> &buf) const override
+    {
+        // each member's data is preceded by its size, so grp_state_merge can find the boundaries
+        std::vector<char> member_buf;
+        for (auto m : members)
+        {
+            member_buf.clear();
+            m->grp_state_pack(member_buf);
+
+            const size_t Nbytes = member_buf.size();
+            const char *p = (const char *)&Nbytes;
+            buf.insert(buf.end(), p, p + sizeof(size_t));
+            buf.insert(buf.end(), member_buf.begin(), member_buf.end());
+        }
+    }
+
+    void grp_state_merge (const char *buf) override
+    {
+        for (auto m : members)
+        {
+            size_t Nbytes;
+            std::memcpy(&Nbytes, buf, sizeof(size_t));
+            buf += sizeof(size_t);
+
+            m->grp_state_merge(buf);
+            buf += Nbytes;
+        }
+    }
+
+    void grp_state_reset () override
+    {
+        for (auto m : members)
+            m->grp_state_reset();
+    }
+
+    coord_t prt_coord_rescale () const override
+    {
+        return first().prt_coord_rescale();
+    }
+
+    bool prt_pipeline () const override
+    {
+        return first().prt_pipeline();
+    }
+
+    bool prt_modifies () const override
+    {
+        return first().prt_modifies();
+    }
+
+    bool prt_modify_is_bulk () const override
+    {
+        return first().prt_modify_is_bulk();
+    }
+
+    void prt_modify (PrtProperties &prt) override
+    {
+        first().prt_modify(prt);
+    }
+
+    void prt_modify_bulk (size_t Nprt, coord_t Bsize, void **prt_properties, size_t type_idx) override
+    {
+        first().prt_modify_bulk(Nprt, Bsize, prt_properties, type_idx);
+    }
+};// }}}
+
+#endif // FUSED_CALLBACK_HPP
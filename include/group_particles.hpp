@@ -11,7 +11,9 @@
 #include "common_fields.hpp"
 #include "callback.hpp"
 #include "callback_utils.hpp"
+#include "fused_callback.hpp"
 #include "hdf5_utils.hpp"
+#include "bounded_queue.hpp"
 #include "workspace.hpp"
 #include "workspace_memory.hpp"
 #include "workspace_sorting.hpp"
@@ -27,10 +29,14 @@
  * The single exposed routine is #group_particles, with the signature
  * @code
  * template<typename AFields>
- * void group_particles (Callback<AFields> &callback);
+ * void group_particles (Callback<AFields> &callback, size_t memory_budget=0);
  * @endcode
  * This routine will load the group and particle catalog(s) from disk and perform the user defined
  * actions on them.
+ * If the user's class inherits from #StaticCallback instead of #Callback, the per-particle
+ * #Callback::prt_action is called without virtual dispatch, so it can be inlined into the loop.
+ * Several analyses of the same data files can be run in a single pass by passing several
+ * callbacks (see #FusedCallback).
  *
  * The template parameter `AFields` defines which data fields from the group and particle catalogs
  * should be loaded into memory and made accessible.
@@ -74,7 +80,8 @@
  *      - #Callback::grp_select defines which groups should be considered,
  *      - #Callback::grp_action lets the user do something with a group's data
  *                              (typically store some group properties for later use),
- *      - #Callback::grp_radius defines how to compute a group's radius,
+ *      - #Callback::grp_radius defines how to compute a group's radius
+ *                              (or #Callback::grp_apertures several nested ones),
  *      - #Callback::prt_action defines what to do with the particles that fall into a group's radius.
  *
  * All these methods take at least one of the two auxiliary types
@@ -87,6 +94,13 @@
  * Because many applications will require very similar implementations of many of the #Callback methods,
  * we provide a number of them in the #CallbackUtils namespace.
  *
+ * For snapshots that do not fit into the memory of a single node, group_particles_mpi.hpp
+ * provides #group_particles_mpi, which distributes the particle chunks over MPI ranks.
+ * If HDF5 is not thread safe, group_particles_fork.hpp provides #group_particles_fork,
+ * which distributes the particle chunks over local worker processes.
+ * To analyse many simulations or snapshots in one process, group_particles_batch.hpp
+ * provides #group_particles_batch.
+ *
  * See the file y_prof.cpp in the examples/ directory for a complete, documented
  * real-world example that illustrates most aspects of the code.
  *
@@ -101,6 +115,13 @@
  *                              code to fulfill.
  *                              Furthermore, the passed instance can be used to store
  *                              data.
+ * @param[in] memory_budget     if nonzero, the code tries to use at most this many bytes
+ *                              (the memory in use when called, the memory of the group data,
+ *                               and the predicted memory of the particle chunks being processed).
+ *                              To achieve this, the particles are permuted in place instead
+ *                              of keeping a sorted copy, and if this is not sufficient,
+ *                              the particle files are processed in several parts.
+ *                              The resident set size is then reported after each phase.
  *
  * See the documentation of the #Callback class for all methods that need to be overriden.
  * Here, we give the order in which the non-const member functions are called
@@ -126,16 +147,33 @@
  *    (in the sense that it only acts on data associated with a single group;
  *     this will be the case in almost all applications)
  *    the user is not required to take any precautations with regard to thread safety.
+ *
+ *    If #Callback::prt_batched returns true, #Callback::prt_action_batch is called instead,
+ *    with the same guarantees.
+ *
+ *    If #Callback::grp_splittable returns true, groups with very many particles may be
+ *    processed by several threads at once.
+ *    The concurrent calls then pass different indices obtained from #Callback::grp_clone,
+ *    so the above guarantee still holds for the grp_idx argument.
+ *
+ * 4. if #Callback::prt_multipass returns true, repeat while requested:
+ *    - #Callback::pass_end (returning true for another pass)
+ *    - #Callback::grp_update, consecutively for each group
+ *    - step 3 on the particles kept in memory
  */
-template<typename AFields>
+namespace grp_prt_detail {
+
+template<typename AFields, typename CB>
 void
-group_particles (Callback<AFields> &callback)
+group_particles_impl (CB &callback, size_t memory_budget)
 {
     #ifndef NDEBUG
     AFields::print_field_info();
     #endif // NDEBUG
 
-    grp_prt_detail::Workspace<AFields> ws { callback };
+    Workspace<AFields, CB> ws { callback };
+
+    ws.memory_budget(memory_budget);
 
     ws.meta_init();
 
@@ -144,4 +182,49 @@ group_particles (Callback<AFields> &callback)
     ws.prt_loop();
 }
 
+} // namespace grp_prt_detail
+
+template<typename AFields>
+void
+group_particles (Callback<AFields> &callback, size_t memory_budget=0UL)
+{
+    grp_prt_detail::group_particles_impl<AFields>(callback, memory_budget);
+}
+
+/*! @brief Runs the code, with #Callback::prt_action statically dispatched.
+ *
+ * @tparam AFields      as for the other overload.
+ * @tparam Derived      the user's class.
+ * @param[in,out] callback      as for the other overload, but inheriting from #StaticCallback.
+ * @param[in] memory_budget     as for the other overload.
+ *
+ * This overload is chosen automatically if the user's class inherits from #StaticCallback.
+ * The order of calls and their semantics are as for the other overload.
+ */
+template<typename AFields, typename Derived>
+void
+group_particles (StaticCallback<AFields, Derived> &callback, size_t memory_budget=0UL)
+{
+    grp_prt_detail::group_particles_impl<AFields>(static_cast<Derived &>(callback), memory_budget);
+}
+
+/*! @brief Runs the code for several callbacks at once, reading and sorting the data only once.
+ *
+ * @tparam AFields      as for the other overloads, shared by all callbacks.
+ * @param[in,out] first, second, others     the callbacks, combined as described
+ *                                          for #FusedCallback.
+ *
+ * For each callback, the order of calls and their semantics are as if it had been passed
+ * to #group_particles on its own.
+ * To pass a memory budget, or to use #group_particles_mpi or #group_particles_fork,
+ * construct a #FusedCallback explicitly.
+ */
+template<typename AFields, typename... Others>
+void
+group_particles (Callback<AFields> &first, Callback<AFields> &second, Others &... others)
+{
+    FusedCallback<AFields> fused { { &first, &second, &others... } };
+    group_particles(fused);
+}
+
 #endif // HALO_PARTICLES_HPP
@@ -0,0 +1,93 @@
+/*! @file group_particles_batch.hpp
+ *
+ * @brief Runs #group_particles for many data sets (e.g. simulations or snapshots)
+ *        within the same process.
+ *        Requires POSIX (posix_fadvise), so is not included in group_particles.hpp.
+ */
+
+#ifndef GROUP_PARTICLES_BATCH_HPP
+#define GROUP_PARTICLES_BATCH_HPP
+
+#include <cstddef>
+#include <cstdio>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "group_particles.hpp"
+#include "prefetch.hpp"
+
+/*! @brief Runs the code for several independent jobs, one after the other.
+ *
+ * @tparam AFields      a type constructed from the #AllFields template,
+ *                      shared by all jobs.
+ * @param[in,out] jobs          the callbacks, one per job.
+ *                              Each describes its own data files and collects its own results,
+ *                              the calls and their semantics are as for #group_particles.
+ * @param[in] memory_budget     as for #group_particles, applies to each job.
+ * @param[in] job_done          if given, called with the index of a job as soon as it is
+ *                              finished (e.g. to write its output and free its data).
+ *
+ * Compared to running each job in its own process, this saves the process startup,
+ * the initialization of the HDF5 library and of the threads, and the page faults
+ * in the large temporary buffers, which are kept between the jobs.
+ *
+ * While a job's particles are processed, the next job's data files are read into
+ * the page cache in the background.
+ * For this, the next job's #Callback::grp_chunk and #Callback::prt_chunk are called
+ * from another thread (never concurrently with the other methods of this job).
+ *
+ * @attention The jobs must not share a callback instance.
+ */
+template<typename AFields>
+void
+group_particles_batch (const std::vector<Callback<AFields> *> &jobs,
+                       size_t memory_budget=0UL,
+                       const std::function<void(size_t)> &job_done=nullptr)
+{
+    #ifndef NDEBUG
+    AFields::print_field_info();
+    #endif // NDEBUG
+
+    // shared by all jobs, so the buffers are reused
+    grp_prt_detail::Arena arena;
+
+    std::thread prefetcher;
+
+    for (size_t job_idx=0; job_idx != jobs.size(); ++job_idx)
+    {
+        // the next job's files are not touched until we are done with the current one
+        if (prefetcher.joinable())
+            prefetcher.join();
+
+        {
+            grp_prt_detail::Workspace<AFields, Callback<AFields>> ws { *jobs[job_idx], &arena };
+
+            ws.memory_budget(memory_budget);
+
+            ws.meta_init();
+
+            ws.grp_loop();
+
+            // the particle loop is usually compute bound,
+            // so the disk is free to work on the next job
+            if (job_idx+1UL != jobs.size())
+                prefetcher = std::thread { [&jobs, job_idx]()
+                                           { grp_prt_detail::prefetch_files(*jobs[job_idx+1UL]); } };
+
+            ws.prt_loop();
+        }
+
+        #ifndef NDEBUG
+        std::fprintf(stderr, "In group_particles_batch : did %lu jobs.\n", job_idx+1UL);
+        #endif // NDEBUG
+
+        if (job_done)
+            job_done(job_idx);
+    }
+
+    if (prefetcher.joinable())
+        prefetcher.join();
+}
+
+#endif // GROUP_PARTICLES_BATCH_HPP
@@ -0,0 +1,214 @@
+/*! @file group_particles_fork.hpp
+ *
+ * @brief Multi-process version of #group_particles on a single machine,
+ *        for HDF5 builds that are not thread safe.
+ *        Requires POSIX (fork, shared memory), so is not included in group_particles.hpp.
+ */
+
+#ifndef GROUP_PARTICLES_FORK_HPP
+#define GROUP_PARTICLES_FORK_HPP
+
+#include <cassert>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "group_particles.hpp"
+#include "fork_slot.hpp"
+
+namespace grp_prt_detail {
+
+// bounds on the size of the shared memory per worker
+static constexpr const size_t fork_slot_min = 1UL << 12,
+                              fork_slot_max = 1UL << 28;
+
+} // namespace grp_prt_detail
+
+/*! @brief Runs the code, with the particle chunks distributed over local worker processes.
+ *
+ * @tparam AFields      a type constructed from the #AllFields template,
+ *                      defines which fields the code should read from the data files.
+ * @param[in,out] callback      as for #group_particles.
+ *                              #Callback::grp_reducible must return true
+ *                              (unless Nworkers < 2).
+ * @param[in] Nworkers          number of worker processes.
+ *                              The OpenMP threads are divided among them.
+ * @param[in] memory_budget     as for #group_particles, applies to each worker
+ *                              (the group data is shared with the calling process
+ *                               until it is written to).
+ *
+ * The group catalog is read by the calling process, which then forks the workers.
+ * Particle chunk chunk_idx is processed by worker chunk_idx % Nworkers, which reads it
+ * on its own thread.
+ * After each chunk, the worker sends the data accumulated for this chunk through shared memory
+ * (using #Callback::grp_state_pack) and resets it (#Callback::grp_state_reset).
+ * The calling process combines these with #Callback::grp_state_merge in the order of the chunks,
+ * so the result does not depend on Nworkers and is bitwise reproducible.
+ *
+ * @note it is not necessary for the callback's methods to be fork-safe, since the workers
+ *       only call them on their own copy of the instance.
+ *       The workers terminate with _exit, so no destructors run in them.
+ * @note if not all workers can be started, the ones already running are stopped
+ *       and the particle loop runs in the calling process (with a warning).
+ *       If a worker fails, the program is aborted.
+ */
+template<typename AFields>
+void
+group_particles_fork (Callback<AFields> &callback, size_t Nworkers, size_t memory_budget=0UL)
+{
+    #ifndef NDEBUG
+    AFields::print_field_info();
+    #endif // NDEBUG
+
+    grp_prt_detail::Workspace<AFields, Callback<AFields>> ws { callback };
+
+    ws.memory_budget(memory_budget);
+
+    ws.meta_init();
+
+    ws.grp_loop();
+
+    if (Nworkers < 2)
+    {
+        ws.prt_loop();
+        return;
+    }
+
+    // otherwise the default grp_state_pack / grp_state_merge would be used
+    if (!callback.grp_reducible())
+    {
+        std::fprintf(stderr, "group_particles_fork : Callback::grp_reducible must return true "
+                             "for more than one worker\n");
+        std::abort();
+    }
+
+    // the workers would decide on further passes with partial data
+    // (checked at runtime, since a FusedCallback member may ask for it)
+    if (callback.prt_multipass())
+    {
+        std::fprintf(stderr, "group_particles_fork : Callback::prt_multipass is not supported "
+                             "with more than one worker\n");
+        std::abort();
+    }
+
+    // the data has the same layout for each chunk, so we can estimate
+    // the required buffer size from the state without particles
+    std::vector<char> buf;
+    callback.grp_state_pack(buf);
+    const size_t slot_size = std::clamp(buf.size(), grp_prt_detail::fork_slot_min,
+                                                    grp_prt_detail::fork_slot_max);
+
+    std::vector<std::unique_ptr<grp_prt_detail::ForkSlot>> slots;
+    for (size_t ii=0; ii != Nworkers; ++ii)
+        slots.push_back(std::make_unique<grp_prt_detail::ForkSlot>(slot_size));
+
+    const int Nthreads = std::max(1, grp_prt_detail::prt_loop_max_threads() / (int)Nworkers);
+
+    // otherwise buffered output would be written by each process
+    std::fflush(stdout);
+    std::fflush(stderr);
+
+    std::vector<pid_t> workers;
+    for (size_t worker_idx=0; worker_idx != Nworkers; ++worker_idx)
+    {
+        pid_t pid = fork();
+
+        if (pid < 0)
+        {
+            // the workers have not sent anything yet, so our data is untouched
+            std::fprintf(stderr, "group_particles_fork : WARNING could not start worker process %lu (%s), "
+                                 "running the particle loop in this process\n",
+                                 worker_idx, std::strerror(errno));
+
+            for (auto worker : workers)
+            {
+                kill(worker, SIGKILL);
+                waitpid(worker, nullptr, 0);
+            }
+
+            ws.prt_loop();
+            return;
+        }
+
+        if (pid == 0)
+        {
+            grp_prt_detail::prt_loop_set_threads(Nthreads);
+
+            auto &slot = *slots[worker_idx];
+
+            for (size_t chunk_idx=worker_idx; ws.prt_loop_chunk(chunk_idx); chunk_idx += Nworkers)
+            {
+                buf.clear();
+                callback.grp_state_pack(buf);
+                slot.send(chunk_idx, buf);
+                callback.grp_state_reset();
+            }
+
+            slot.send_end();
+
+            std::fflush(stdout);
+            std::fflush(stderr);
+            _exit(0);
+        }
+
+        workers.push_back(pid);
+    }
+
+    // merge in chunk order until the first chunk that does not exist
+    #ifndef NDEBUG
+    TIME_PT(t1);
+    #endif // NDEBUG
+
+    size_t chunk_idx = 0UL;
+    std::vector<bool> finished (Nworkers, false);
+    for (;; ++chunk_idx)
+    {
+        const size_t worker_idx = chunk_idx % Nworkers;
+
+        size_t recv_chunk_idx;
+        if (!slots[worker_idx]->recv(workers[worker_idx], recv_chunk_idx, buf))
+        {
+            finished[worker_idx] = true;
+            break;
+        }
+
+        assert(recv_chunk_idx == chunk_idx);
+        callback.grp_state_merge(buf.data());
+
+        #ifndef NDEBUG
+        std::fprintf(stderr, "In group_particles_fork : merged %lu chunks.\n", chunk_idx+1UL);
+        #endif // NDEBUG
+    }
+
+    // the other workers may still have to report that they are done
+    for (size_t worker_idx=0; worker_idx != Nworkers; ++worker_idx)
+    {
+        size_t recv_chunk_idx;
+        while (!finished[worker_idx]
+               && slots[worker_idx]->recv(workers[worker_idx], recv_chunk_idx, buf));
+
+        int status;
+        if (waitpid(workers[worker_idx], &status, 0) != workers[worker_idx]
+            || !WIFEXITED(status) || WEXITSTATUS(status))
+        {
+            std::fprintf(stderr, "group_particles_fork : worker process %d failed\n",
+                                 (int)workers[worker_idx]);
+            std::abort();
+        }
+    }
+
+    #ifndef NDEBUG
+    TIME_MSG(t1, "particle loop with %lu worker processes (%lu chunks)", Nworkers, chunk_idx);
+    #endif // NDEBUG
+}
+
+#endif // GROUP_PARTICLES_FORK_HPP
@@ -0,0 +1,105 @@
+/*! @file group_particles_mpi.hpp
+ *
+ * @brief Distributed version of #group_particles,
+ *        for snapshots that are too large to be processed on a single node.
+ *        Requires MPI, so is not included in group_particles.hpp.
+ */
+
+#ifndef GROUP_PARTICLES_MPI_HPP
+#define GROUP_PARTICLES_MPI_HPP
+
+#include <cstdio>
+
+#include "mpi.h"
+
+#include "group_particles.hpp"
+#include "mpi_reduce.hpp"
+
+/*! @brief Runs the code, with the particle chunks distributed over the MPI ranks.
+ *
+ * @tparam AFields      a type constructed from the #AllFields template,
+ *                      defines which fields the code should read from the data files.
+ * @param[in,out] callback      as for #group_particles.
+ *                              Each rank should pass its own instance, constructed
+ *                              identically.
+ *                              #Callback::grp_reducible must return true
+ *                              (unless there is only one rank).
+ * @param[in] comm      the communicator, must be the same on all ranks.
+ *                      MPI_Init should have been called by the user.
+ * @param[in] memory_budget     as for #group_particles, applies to each rank.
+ *
+ * Each rank reads all group chunks and thus holds the full selected group table.
+ * Particle chunk chunk_idx is processed by rank chunk_idx % Nranks,
+ * using the same (multi-threaded) loop as #group_particles.
+ * Afterwards, the per-group data of all ranks is serialized with #Callback::grp_state_pack
+ * and combined on rank 0 with #Callback::grp_state_merge, in a binary tree
+ * (so rank 0 only merges log2(Nranks) times).
+ * The order of the merges is fixed, so the result is deterministic.
+ *
+ * @attention only the instance on rank 0 holds the final result.
+ *            The instances on the other ranks only contain the contributions
+ *            from their own and possibly some other ranks' particle chunks.
+ *
+ * @note for a test on a single machine, `mpirun -np 4 ./executable` is sufficient.
+ *       Set OMP_NUM_THREADS so that the ranks do not oversubscribe the cores.
+ *       See the file null_test_mpi.cpp in the examples/ directory, which can be compiled with
+ *       compile_mpi.sh.
+ */
+template<typename AFields>
+void
+group_particles_mpi (Callback<AFields> &callback, MPI_Comm comm = MPI_COMM_WORLD,
+                     size_t memory_budget = 0UL)
+{
+    int rank, Nranks;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &Nranks);
+
+    // otherwise the default grp_state_pack / grp_state_merge would be used
+    if (Nranks > 1 && !callback.grp_reducible())
+    {
+        if (rank == 0)
+            std::fprintf(stderr, "group_particles_mpi : Callback::grp_reducible must return true "
+                                 "on more than one rank\n");
+        MPI_Abort(comm, 1);
+    }
+
+    #ifndef NDEBUG
+    if (rank == 0)
+        AFields::print_field_info();
+    #endif // NDEBUG
+
+    // the ranks would decide on further passes with partial data
+    // (checked at runtime, since a FusedCallback member may ask for it)
+    if (Nranks > 1 && callback.prt_multipass())
+    {
+        if (rank == 0)
+            std::fprintf(stderr, "group_particles_mpi : Callback::prt_multipass is not supported "
+                                 "on more than one rank\n");
+        MPI_Abort(comm, 1);
+    }
+
+    grp_prt_detail::Workspace<AFields, Callback<AFields>> ws { callback };
+
+    ws.prt_shard(rank, Nranks);
+
+    ws.memory_budget(memory_budget);
+
+    ws.meta_init();
+
+    ws.grp_loop();
+
+    ws.prt_loop();
+
+    #ifndef NDEBUG
+    TIME_PT(t1);
+    #endif // NDEBUG
+
+    grp_prt_detail::mpi_reduce_grp_state(callback, comm);
+
+    #ifndef NDEBUG
+    if (rank == 0)
+        TIME_MSG(t1, "reduction of group data over %d ranks", Nranks);
+    #endif // NDEBUG
+}
+
+#endif // GROUP_PARTICLES_MPI_HPP
@@ -0,0 +1,20 @@
+/* Runs group_particles a few times, for bench_affinity.sh.
+ * Has to be compiled without NDEBUG, so the stages report their timings.
+ * The runs are marked on stderr, so the timings can be attributed.
+ */
+
+#include "test_common.hpp"
+
+int main ()
+{
+    const int Nrepeat = 3;
+
+    for (int ii=0; ii != Nrepeat; ++ii)
+    {
+        std::fprintf(stderr, "run %d\n", ii);
+        test::Count callback;
+        group_particles(callback);
+    }
+
+    return 0;
+}
@@ -0,0 +1,46 @@
+#!/bin/sh
+# Compares the default placement of the groups on the threads (cost-balanced, dynamic)
+# with the one from -DGRP_AFFINITY (each thread works on the region of the box
+# whose sorted particles it has placed in memory), with the threads pinned
+# (OMP_PROC_BIND=true), for increasing numbers of threads, on the synthetic data from gen_data.cpp.
+# The difference is expected to show on multi-socket nodes.
+#
+# Usage : sh tests/bench_affinity.sh [Nprt per file] [thread counts...]
+#         (from the repository root)
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+CXX=${CXX:-g++}
+HDF5_FLAGS=${HDF5_FLAGS:-"-lhdf5 -lhdf5_cpp"}
+
+NPRT=${1:-2000000}
+[ $# -gt 0 ] && shift
+THREADS=${*:-"1 2 4 8 16"}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+$CXX -std=c++17 -O3 -o "$WORK/gen_data" "$ROOT/tests/gen_data.cpp" $HDF5_FLAGS
+# without NDEBUG, for the per-stage timings
+for V in default:"" affinity:"-DGRP_AFFINITY"; do
+  $CXX -std=c++17 -O3 -ffast-math -funroll-loops -fopenmp ${V#*:} \
+    -I"$ROOT/include" -I"$ROOT/include/callback_utils" -I"$ROOT/detail" -I"$ROOT/tests" \
+    -o "$WORK/bench_affinity_${V%%:*}" "$ROOT/tests/bench_affinity.cpp" $HDF5_FLAGS
+done
+
+cd "$WORK"
+./gen_data "$NPRT" 2000 4
+
+printf "%8s %10s %12s %12s %12s\n" threads build reorder group_loop speedup
+for T in $THREADS; do
+  for V in default affinity; do
+    # the run with the fastest group loop
+    OMP_NUM_THREADS=$T OMP_PROC_BIND=true ./bench_affinity_$V 2>&1 >/dev/null | awk -v T="$T" -v V="$V" '
+      function keep () { if (started && (best_l == "" || l < best_l)) { best_l = l; best_r = r } }
+      /^run / { keep(); started = 1; l = 0; r = 0 }
+      /Took .* sec for Sorting::reorder_prt_properties/ { r += $2 }
+      /Took .* sec for prt_loop->prt_loop_sorted/       { l += $2 }
+      END { keep(); printf "%8d %10s %12.4f %12.4f\n", T, V, best_r, best_l }'
+  done
+done | awk '{ if ($2 == "default") t0 = $4; printf "%s %12.2f\n", $0, t0/$4 }'
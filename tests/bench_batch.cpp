@@ -0,0 +1,97 @@
+/* Compares the time of the particle loop with #Callback::prt_action
+ * and with #Callback::prt_action_batch, for bench_batch.sh.
+ * The runs are marked on stderr, so the timings of the group loop can be attributed.
+ */
+
+#include <chrono>
+
+#include "test_common.hpp"
+
+namespace {
+
+// as test::Sums, but the particles are inserted in batches
+struct SumsBatch : public test::Sums
+{
+    void prt_insert_batch (size_t, const Callback<test::AF>::GrpProperties &,
+                           size_t Nprt, const size_t *prt_idx, const coord_t *Rsq_,
+                           void **prt_properties, coord_t)
+    {
+        const auto *m = (const IllustrisFields::Masses::value_type *)
+                        prt_properties[test::AF::ParticleFields::idx<IllustrisFields::Masses>];
+
+        double M_ = 0.0, Rsq_sum = 0.0;
+
+        #pragma omp simd reduction(+:M_,Rsq_sum)
+        for (size_t ii=0; ii < Nprt; ++ii)
+        {
+            M_ += m[prt_idx[ii]];
+            Rsq_sum += Rsq_[ii];
+        }
+
+        N += Nprt;
+        M += M_;
+        Rsq += Rsq_sum;
+    }
+
+    SumsBatch clone () const { return SumsBatch { }; }
+
+    void merge (const SumsBatch &other) { test::Sums::merge(other); }
+};
+
+struct CountBatch :
+    virtual public Callback<test::AF>,
+    public CallbackUtils::chunk::Multi<test::AF>,
+    public CallbackUtils::name::Illustris<test::AF, 0>,
+    public CallbackUtils::meta::Illustris<test::AF, 0>,
+    public CallbackUtils::select::LowCutoff<test::AF, IllustrisFields::Group_M_Crit200>,
+    public CallbackUtils::radius::Simple<test::AF, IllustrisFields::Group_R_Crit200>,
+    public CallbackUtils::prt_action::StorePrtHomogeneous<test::AF, SumsBatch>
+{
+    std::vector<SumsBatch> data;
+
+    CountBatch (float scaling) :
+        CallbackUtils::chunk::Multi<test::AF>("grp.%lu.hdf5", 0, "snap.%lu.hdf5", test::Nchunks-1UL),
+        CallbackUtils::select::LowCutoff<test::AF, IllustrisFields::Group_M_Crit200>(200.0F),
+        CallbackUtils::radius::Simple<test::AF, IllustrisFields::Group_R_Crit200>(scaling),
+        CallbackUtils::prt_action::StorePrtHomogeneous<test::AF, SumsBatch>(data)
+    { }
+};
+
+template<typename CB>
+double
+run (const char *name, CB &callback)
+{// {{{
+    std::fprintf(stderr, "run %s\n", name);
+    const auto t0 = std::chrono::steady_clock::now();
+    group_particles(callback);
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}// }}}
+
+} // namespace
+
+int main (int argc, char **argv)
+{
+    const float scaling = (argc > 1) ? std::atof(argv[1]) : 2.0F;
+    const int Nrepeat = 3;
+
+    // the best of a few runs, alternating so the file cache is warm for both
+    double t_single = 1e30, t_batch = 1e30;
+    size_t N_single = 0UL, N_batch = 0UL;
+    for (int ii=0; ii != Nrepeat; ++ii)
+    {
+        test::Count single (scaling);
+        t_single = std::min(t_single, run("single", single));
+        N_single = test::total_N(single.data);
+
+        CountBatch batch (scaling);
+        t_batch = std::min(t_batch, run("batch", batch));
+        N_batch = 0UL;
+        for (const auto &x : batch.data)
+            N_batch += x.N;
+    }
+
+    std::printf("%8.2f %12lu %12.4f %12.4f %10.2f\n",
+                scaling, N_single, t_single, t_batch, t_single / t_batch);
+
+    return (N_single == N_batch) ? 0 : 1;
+}
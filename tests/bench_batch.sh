@@ -0,0 +1,45 @@
+#!/bin/sh
+# Compares the time spent in the group loop when the particles are passed one by one
+# (Callback::prt_action) and in batches (Callback::prt_action_batch),
+# with the default build and with QUANTIZED_COORDS, on the synthetic data from gen_data.cpp.
+#
+# Usage : sh tests/bench_batch.sh [Nprt per file] [radius scalings...]
+#         (from the repository root)
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+CXX=${CXX:-g++}
+HDF5_FLAGS=${HDF5_FLAGS:-"-lhdf5 -lhdf5_cpp"}
+
+NPRT=${1:-2000000}
+[ $# -gt 0 ] && shift
+SCALINGS=${*:-"1 3"}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+$CXX -std=c++17 -O3 -o "$WORK/gen_data" "$ROOT/tests/gen_data.cpp" $HDF5_FLAGS
+# without NDEBUG, for the timing of the group loop
+for V in default:"" quantized:"-DQUANTIZED_COORDS"; do
+  $CXX -std=c++17 -O3 -ffast-math -funroll-loops -fopenmp ${V#*:} \
+    -I"$ROOT/include" -I"$ROOT/include/callback_utils" -I"$ROOT/detail" -I"$ROOT/tests" \
+    -o "$WORK/bench_batch_${V%%:*}" "$ROOT/tests/bench_batch.cpp" $HDF5_FLAGS
+done
+
+cd "$WORK"
+./gen_data "$NPRT" 2000 4
+
+printf "%10s %8s %12s %12s %10s\n" build scaling single batch speedup
+for V in default quantized; do
+  for S in $SCALINGS; do
+    # the best of the repeated runs
+    ./bench_batch_$V "$S" 2>&1 >/dev/null | awk -v V="$V" -v S="$S" '
+      function keep () { if (name != "" && (!(name in best) || t < best[name])) best[name] = t }
+      /^run / { keep(); name = $2; t = 0 }
+      /Took .* sec for .*group loop/ { t += $2 }
+      END { keep()
+            printf "%10s %8s %12.4f %12.4f %10.2f\n", V, S, best["single"], best["batch"],
+                   best["single"] / best["batch"] }'
+  done
+done
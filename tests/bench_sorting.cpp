@@ -0,0 +1,12 @@
+/* Runs group_particles once, for bench_sorting.sh.
+ * Has to be compiled without NDEBUG, so the stages report their timings.
+ */
+
+#include "test_common.hpp"
+
+int main ()
+{
+    test::Count callback;
+    group_particles(callback);
+    return 0;
+}
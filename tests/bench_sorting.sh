@@ -0,0 +1,37 @@
+#!/bin/sh
+# Reports the time spent in the stages of the particle sorting
+# for increasing numbers of threads, on the synthetic data from gen_data.cpp.
+#
+# Usage : sh tests/bench_sorting.sh [Nprt per file] [thread counts...]
+#         (from the repository root)
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+CXX=${CXX:-g++}
+HDF5_FLAGS=${HDF5_FLAGS:-"-lhdf5 -lhdf5_cpp"}
+
+NPRT=${1:-2000000}
+[ $# -gt 0 ] && shift
+THREADS=${*:-"1 2 4 8 16"}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+$CXX -std=c++17 -O3 -o "$WORK/gen_data" "$ROOT/tests/gen_data.cpp" $HDF5_FLAGS
+# without NDEBUG, for the per-stage timings
+$CXX -std=c++17 -O3 -ffast-math -funroll-loops -fopenmp \
+  -I"$ROOT/include" -I"$ROOT/include/callback_utils" -I"$ROOT/detail" -I"$ROOT/tests" \
+  -o "$WORK/bench_sorting" "$ROOT/tests/bench_sorting.cpp" $HDF5_FLAGS
+
+cd "$WORK"
+./gen_data "$NPRT" 2000 4
+
+printf "%8s %14s %14s %14s %14s %10s\n" threads cell_keys counting_sort reorder total speedup
+for T in $THREADS; do
+  OMP_NUM_THREADS=$T ./bench_sorting 2>&1 >/dev/null | awk -v T="$T" '
+    /Took .* sec for Sorting::compute_cell_keys/      { k += $2 }
+    /Took .* sec for Sorting::counting_sort/          { s += $2 }
+    /Took .* sec for Sorting::reorder_prt_properties/ { r += $2 }
+    END { printf "%8d %14.4f %14.4f %14.4f %14.4f\n", T, k, s, r, k+s+r }'
+done | awk '{ if (NR==1) t1=$5; printf "%s %10.2f\n", $0, t1/$5 }'
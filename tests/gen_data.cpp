@@ -0,0 +1,136 @@
+/* Writes a small synthetic Illustris-type data set into the current directory :
+ *      grp.0.hdf5              Ngrp groups (GroupPos, Group_M_Crit200, Group_R_Crit200)
+ *      snap.<chunk>.hdf5       Nchunks particle files with PartType0 and PartType1
+ *                              (Coordinates, Velocities, Masses, InternalEnergy, ElectronAbundance)
+ *
+ * Usage : gen_data [Nprt per file] [Ngrp] [Nchunks]
+ *
+ * A third of the particles are clustered around a massive group close to the box corner,
+ * so the periodic boundary conditions and heavy groups are exercised.
+ * The output only depends on the arguments.
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "H5Cpp.h"
+
+namespace {
+
+const double Bsize = 100.0;
+
+void scalar_attr (H5::Group &g, const char *name, const H5::PredType &type, const void *value)
+{
+    auto attr = g.createAttribute(name, type, H5::DataSpace());
+    attr.write(type, value);
+}
+
+template<typename T>
+void vector_attr (H5::Group &g, const char *name, const H5::PredType &type, const std::vector<T> &value)
+{
+    const hsize_t dim = value.size();
+    auto attr = g.createAttribute(name, type, H5::DataSpace(1, &dim));
+    attr.write(type, value.data());
+}
+
+template<typename T>
+void dataset (H5::Group &g, const char *name, const H5::PredType &type, const std::vector<T> &data, size_t dim)
+{
+    const hsize_t dims[2] = { data.size() / dim, dim };
+    auto dset = g.createDataSet(name, type, H5::DataSpace((dim==1) ? 1 : 2, dims));
+    dset.write(data.data(), type);
+}
+
+} // namespace
+
+int main (int argc, char **argv)
+{
+    const size_t Nprt    = (argc > 1) ? std::atol(argv[1]) : 200000UL;
+    const int    Ngrp    = (argc > 2) ? std::atoi(argv[2]) : 2000;
+    const int    Nchunks = (argc > 3) ? std::atoi(argv[3]) : 4;
+
+    std::mt19937 rng (42);
+    std::uniform_real_distribution<double> uniform (0.0, Bsize);
+    std::uniform_real_distribution<float> unit (0.0F, 1.0F);
+    std::normal_distribution<double> normal (0.0, 1.0);
+
+    // the massive group everything else clusters around
+    const double center[3] = { 0.5, 99.7, 50.0 };
+
+    {
+        H5::H5File f ("grp.0.hdf5", H5F_ACC_TRUNC);
+
+        auto header = f.createGroup("/Header");
+        scalar_attr(header, "Ngroups_ThisFile", H5::PredType::NATIVE_INT32, &Ngrp);
+
+        std::vector<float> pos, M, R;
+        for (int ii=0; ii != Ngrp; ++ii)
+        {
+            for (int kk=0; kk != 3; ++kk)
+                pos.push_back((ii) ? uniform(rng) : center[kk]);
+            const float m = (ii) ? std::pow(10.0F, 3.0F*unit(rng)+2.0F) : 1e6F;
+            M.push_back(m);
+            R.push_back((ii) ? 0.3F * std::cbrt(m/100.0F) : 15.0F);
+        }
+
+        auto grp = f.createGroup("/Group");
+        dataset(grp, "GroupPos", H5::PredType::NATIVE_FLOAT, pos, 3);
+        dataset(grp, "Group_M_Crit200", H5::PredType::NATIVE_FLOAT, M, 1);
+        dataset(grp, "Group_R_Crit200", H5::PredType::NATIVE_FLOAT, R, 1);
+    }
+
+    for (int chunk_idx=0; chunk_idx != Nchunks; ++chunk_idx)
+    {
+        H5::H5File f ("snap." + std::to_string(chunk_idx) + ".hdf5", H5F_ACC_TRUNC);
+
+        auto header = f.createGroup("/Header");
+        const double BoxSize = Bsize, HubbleParam = 0.7, Omega0 = 0.3, OmegaLambda = 0.7,
+                     OmegaBaryon = 0.05, Redshift = 0.5, Time = 1.0/1.5;
+        scalar_attr(header, "BoxSize", H5::PredType::NATIVE_DOUBLE, &BoxSize);
+        scalar_attr(header, "HubbleParam", H5::PredType::NATIVE_DOUBLE, &HubbleParam);
+        scalar_attr(header, "Omega0", H5::PredType::NATIVE_DOUBLE, &Omega0);
+        scalar_attr(header, "OmegaLambda", H5::PredType::NATIVE_DOUBLE, &OmegaLambda);
+        scalar_attr(header, "OmegaBaryon", H5::PredType::NATIVE_DOUBLE, &OmegaBaryon);
+        scalar_attr(header, "Redshift", H5::PredType::NATIVE_DOUBLE, &Redshift);
+        scalar_attr(header, "Time", H5::PredType::NATIVE_DOUBLE, &Time);
+        vector_attr(header, "MassTable", H5::PredType::NATIVE_DOUBLE,
+                    std::vector<double> { 0.0, 0.1, 0.0, 0.0, 0.0, 0.0 });
+
+        std::vector<int> Npart (6, 0);
+        for (int part_type=0; part_type != 2; ++part_type)
+        {
+            const size_t N = (part_type) ? Nprt/2 : Nprt;
+            Npart[part_type] = (int)N;
+
+            std::vector<double> x;
+            std::vector<float> v, m, u, ne;
+            for (size_t ii=0; ii != N; ++ii)
+            {
+                for (int kk=0; kk != 3; ++kk)
+                {
+                    const double xx = (ii%3==0) ? center[kk] + 5.0*normal(rng) : uniform(rng);
+                    x.push_back(std::fmod(xx+Bsize, Bsize));
+                    v.push_back(300.0*normal(rng));
+                }
+                m.push_back(unit(rng));
+                u.push_back(1e3F*unit(rng));
+                ne.push_back(unit(rng));
+            }
+
+            auto grp = f.createGroup("/PartType" + std::to_string(part_type));
+            dataset(grp, "Coordinates", H5::PredType::NATIVE_DOUBLE, x, 3);
+            dataset(grp, "Velocities", H5::PredType::NATIVE_FLOAT, v, 3);
+            dataset(grp, "Masses", H5::PredType::NATIVE_FLOAT, m, 1);
+            dataset(grp, "InternalEnergy", H5::PredType::NATIVE_FLOAT, u, 1);
+            dataset(grp, "ElectronAbundance", H5::PredType::NATIVE_FLOAT, ne, 1);
+        }
+
+        vector_attr(header, "NumPart_ThisFile", H5::PredType::NATIVE_INT32, Npart);
+    }
+
+    return 0;
+}
@@ -0,0 +1,77 @@
+#!/bin/sh
+# Builds and runs the tests on synthetic data from gen_data.cpp.
+#
+# Usage : sh tests/run_tests.sh
+#         (from the repository root)
+# The MPI test is run with $MPIRUN -np 4 if $MPICXX is found
+# (set MPIRUN="mpirun --oversubscribe" on machines with fewer cores).
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+CXX=${CXX:-g++}
+MPICXX=${MPICXX:-mpicxx}
+MPIRUN=${MPIRUN:-mpirun}
+HDF5_FLAGS=${HDF5_FLAGS:-"-lhdf5 -lhdf5_cpp"}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# $1 = test name, $2 = source, remaining arguments are passed to the compiler
+build ()
+{
+  name=$1; src=$2; shift 2
+  ${BUILD_CXX:-$CXX} -std=c++17 -O3 -ffast-math -DNDEBUG \
+    -I"$ROOT/include" -I"$ROOT/include/callback_utils" -I"$ROOT/detail" -I"$ROOT/tests" \
+    "$@" -o "$WORK/$name" "$ROOT/tests/$src" $HDF5_FLAGS
+}
+
+Nfailed=0
+
+# $1 = test name, remaining arguments are the command
+run ()
+{
+  name=$1; shift
+  if ! "$@"; then
+    echo "$name FAILED"
+    Nfailed=$((Nfailed+1))
+  fi
+}
+
+# $1 = test name, $2 = source, remaining arguments are passed to the compiler.
+# The test is run without arguments.
+check ()
+{
+  name=$1
+  if build "$@"; then
+    run "$name" ./"$name"
+  else
+    echo "$name FAILED to compile"
+    Nfailed=$((Nfailed+1))
+  fi
+}
+
+build gen_data gen_data.cpp || exit 1
+cd "$WORK" && ./gen_data 200000 2000 4 || exit 1
+
+check threads test_threads.cpp -fopenmp
+# as compile_parttype.sh, without OpenMP
+check threads_serial test_threads.cpp -Wno-unknown-pragmas
+check fork test_fork.cpp -fopenmp
+check fused test_fused.cpp -fopenmp
+check batch test_batch.cpp -fopenmp
+
+if command -v "$MPICXX" >/dev/null 2>&1; then
+  if BUILD_CXX=$MPICXX build mpi test_mpi.cpp -fopenmp; then
+    OMP_NUM_THREADS=1 run mpi $MPIRUN -np 4 ./mpi
+  else
+    echo "mpi FAILED to compile"
+    Nfailed=$((Nfailed+1))
+  fi
+else
+  echo "mpi skipped, no $MPICXX"
+fi
+
+if [ $Nfailed -ne 0 ]; then
+  echo "$Nfailed tests failed"
+  exit 1
+fi
+echo "all tests passed"
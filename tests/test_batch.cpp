@@ -0,0 +1,75 @@
+/* Checks that group_particles_batch gives the same results as separate calls
+ * to group_particles, and that with a memory budget each job splits the particle
+ * files into the same parts as it would on its own
+ * (the buffers kept from the previous jobs must not count against the budget).
+ */
+
+#include "group_particles_batch.hpp"
+
+#include "test_common.hpp"
+
+// also records the number of particles in each part of the particle files,
+// from the serial calls to prt_modify (a new part starts at the beginning of a buffer)
+struct Parts : public test::Count
+{// {{{
+    std::vector<size_t> parts;
+    const void *next = nullptr;
+
+    Parts (float scaling) : test::Count { scaling } { }
+
+    bool prt_modifies () const override { return true; }
+
+    void prt_modify (PrtProperties &prt) override
+    {
+        const coord_t *x = prt.coord();
+        if (x != next)
+            parts.push_back(0UL);
+        ++parts.back();
+        next = x + 3;
+    }
+};// }}}
+
+int main ()
+{
+    // enough for the particle files in one part, but not if the memory
+    // of the previous job were counted again
+    const size_t budget = grp_prt_detail::current_rss() + (24UL << 20);
+
+    const std::vector<float> scalings { 1.0F, 2.0F, 1.5F };
+
+    // the callbacks refer to their own data, so they must not be moved
+    std::vector<Parts> reference;
+    reference.reserve(scalings.size());
+    for (float scaling : scalings)
+    {
+        reference.emplace_back(scaling);
+        group_particles(reference.back(), budget);
+    }
+
+    std::vector<Parts> batch;
+    batch.reserve(scalings.size());
+    for (float scaling : scalings)
+        batch.emplace_back(scaling);
+
+    std::vector<Callback<test::AF> *> jobs;
+    for (auto &job : batch)
+        jobs.push_back(&job);
+
+    size_t Ndone = 0UL;
+    group_particles_batch(jobs, budget, [&Ndone](size_t job_idx) { Ndone += (job_idx == Ndone); });
+
+    bool ok = Ndone == scalings.size();
+
+    for (size_t ii=0; ii != scalings.size(); ++ii)
+    {
+        std::printf("job %lu : %lu particles in %lu groups, files read in %lu parts (separately %lu parts)\n",
+                    ii, test::total_N(batch[ii].data), batch[ii].data.size(),
+                    batch[ii].parts.size(), reference[ii].parts.size());
+
+        ok = ok && test::total_N(reference[ii].data) != 0UL
+                && test::same(batch[ii].data, reference[ii].data)
+                && batch[ii].parts == reference[ii].parts;
+    }
+
+    return test::report("batch", ok);
+}
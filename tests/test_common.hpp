@@ -0,0 +1,108 @@
+/* Shared definitions for the tests and benchmarks in this directory.
+ * They run on the data written by gen_data.cpp into the current directory.
+ */
+
+#ifndef TEST_COMMON_HPP
+#define TEST_COMMON_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include "group_particles.hpp"
+#include "common_fields.hpp"
+
+namespace test {
+
+using GrpF = GrpFields<IllustrisFields::GroupPos,
+                       IllustrisFields::Group_M_Crit200,
+                       IllustrisFields::Group_R_Crit200>;
+using PrtF = PrtFields<IllustrisFields::Coordinates,
+                       IllustrisFields::Masses,
+                       IllustrisFields::Velocities>;
+using AF = AllFields<GrpF, PrtF>;
+
+// as written by gen_data
+static constexpr const size_t Nchunks = 4UL;
+
+// number, mass and sum of squared distances of the particles in a group
+struct Sums
+{// {{{
+    size_t N = 0UL;
+    double M = 0.0, Rsq = 0.0;
+
+    void prt_insert (size_t, const Callback<AF>::GrpProperties &,
+                     const Callback<AF>::PrtProperties &prt, coord_t Rsq_)
+    {
+        ++N;
+        M += prt.get<IllustrisFields::Masses>();
+        Rsq += Rsq_;
+    }
+
+    Sums clone () const { return Sums { }; }
+
+    void merge (const Sums &other)
+    {
+        N += other.N;
+        M += other.M;
+        Rsq += other.Rsq;
+    }
+};// }}}
+
+// the gas particles within scaling * R200c of the groups above 200 mass units
+struct Count :
+    virtual public Callback<AF>,
+    public CallbackUtils::chunk::Multi<AF>,
+    public CallbackUtils::name::Illustris<AF, 0>,
+    public CallbackUtils::meta::Illustris<AF, 0>,
+    public CallbackUtils::select::LowCutoff<AF, IllustrisFields::Group_M_Crit200>,
+    public CallbackUtils::radius::Simple<AF, IllustrisFields::Group_R_Crit200>,
+    public CallbackUtils::prt_action::StorePrtHomogeneous<AF, Sums>
+{// {{{
+    std::vector<Sums> data;
+
+    Count (float scaling=1.0F) :
+        CallbackUtils::chunk::Multi<AF>("grp.%lu.hdf5", 0, "snap.%lu.hdf5", Nchunks-1UL),
+        CallbackUtils::select::LowCutoff<AF, IllustrisFields::Group_M_Crit200>(200.0F),
+        CallbackUtils::radius::Simple<AF, IllustrisFields::Group_R_Crit200>(scaling),
+        CallbackUtils::prt_action::StorePrtHomogeneous<AF, Sums>(data)
+    { }
+};// }}}
+
+// the sums can only differ by the order of additions
+inline bool
+same (const std::vector<Sums> &a, const std::vector<Sums> &b)
+{// {{{
+    if (a.size() != b.size())
+        return false;
+
+    auto close = [](double x, double y) { return std::fabs(x-y) <= 1e-6 * std::max(1.0, std::fabs(y)); };
+
+    for (size_t ii=0; ii != a.size(); ++ii)
+        if (a[ii].N != b[ii].N || !close(a[ii].M, b[ii].M) || !close(a[ii].Rsq, b[ii].Rsq))
+            return false;
+
+    return true;
+}// }}}
+
+inline size_t
+total_N (const std::vector<Sums> &a)
+{// {{{
+    size_t N = 0UL;
+    for (const auto &x : a)
+        N += x.N;
+    return N;
+}// }}}
+
+// prints the result and returns the exit code
+inline int
+report (const char *name, bool ok)
+{// {{{
+    std::printf("%-40s %s\n", name, (ok) ? "PASS" : "FAIL");
+    return (ok) ? 0 : 1;
+}// }}}
+
+} // namespace test
+
+#endif // TEST_COMMON_HPP
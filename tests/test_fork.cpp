@@ -0,0 +1,28 @@
+/* Checks that group_particles_fork gives the same result as group_particles,
+ * for several numbers of worker processes.
+ */
+
+#include "group_particles_fork.hpp"
+
+#include "test_common.hpp"
+
+int main ()
+{
+    test::Count reference;
+    group_particles(reference);
+
+    bool ok = test::total_N(reference.data) != 0UL;
+
+    for (size_t Nworkers : { 1UL, 2UL, 3UL, 5UL })
+    {
+        test::Count forked;
+        group_particles_fork(forked, Nworkers);
+
+        std::printf("%lu workers : %lu particles in %lu groups\n",
+                    Nworkers, test::total_N(forked.data), forked.data.size());
+
+        ok = ok && test::same(forked.data, reference.data);
+    }
+
+    return test::report("fork", ok);
+}
@@ -0,0 +1,129 @@
+/* Checks that callbacks passed together to group_particles give the same results
+ * as when they are run one after the other, if one of them makes several passes
+ * over the particles and the other one only a single pass.
+ */
+
+#include <array>
+
+#include "test_common.hpp"
+
+// a few steps of shrinking-sphere centering on the gas particles
+// within 1.5 R200c of the groups above 100 mass units
+struct Shrink :
+    virtual public Callback<test::AF>,
+    public CallbackUtils::chunk::Multi<test::AF>,
+    public CallbackUtils::name::Illustris<test::AF, 0>,
+    public CallbackUtils::meta::Illustris<test::AF, 0>,
+    public CallbackUtils::select::LowCutoff<test::AF, IllustrisFields::Group_M_Crit200>,
+    public CallbackUtils::radius::Simple<test::AF, IllustrisFields::Group_R_Crit200>
+{// {{{
+    static constexpr const size_t Npasses = 3UL;
+
+    // for each group and pass, the number of particles and the sum of their offsets
+    std::vector<std::array<double, 4>> data;
+
+    size_t pass_idx = 0UL;
+
+    Shrink () :
+        CallbackUtils::chunk::Multi<test::AF>("grp.%lu.hdf5", 0, "snap.%lu.hdf5", test::Nchunks-1UL),
+        CallbackUtils::select::LowCutoff<test::AF, IllustrisFields::Group_M_Crit200>(100.0F),
+        CallbackUtils::radius::Simple<test::AF, IllustrisFields::Group_R_Crit200>(1.5F)
+    { }
+
+    void grp_action (const GrpProperties &) override
+    {
+        data.resize(data.size() + Npasses, std::array<double, 4> { });
+    }
+
+    void prt_action (size_t grp_idx, const GrpProperties &grp,
+                     const PrtProperties &prt, coord_t) override
+    {
+        auto &d = data[grp_idx * Npasses + pass_idx];
+        const auto x = prt.coord(grp.coord());
+        d[0] += 1.0;
+        for (size_t kk=0; kk != 3; ++kk)
+            d[1UL+kk] += x[kk];
+    }
+
+    bool prt_multipass () const override { return true; }
+
+    bool pass_end (size_t pass_idx_) override
+    {
+        pass_idx = pass_idx_ + 1UL;
+        return pass_idx < Npasses;
+    }
+
+    void grp_update (size_t grp_idx, const GrpProperties &,
+                     coord_t *coord, coord_t &R) override
+    {
+        const auto &d = data[grp_idx * Npasses + pass_idx - 1UL];
+
+        // rounded, so the order of the additions does not matter
+        if (d[0] > 0.0)
+            for (size_t kk=0; kk != 3; ++kk)
+                coord[kk] += (coord_t)(std::round(d[1UL+kk] / d[0] * 1024.0) / 1024.0);
+
+        R *= (coord_t)0.8;
+    }
+};// }}}
+
+static bool
+same (const Shrink &a, const Shrink &b)
+{// {{{
+    if (a.data.size() != b.data.size())
+        return false;
+
+    for (size_t ii=0; ii != a.data.size(); ++ii)
+    {
+        if (a.data[ii][0] != b.data[ii][0])
+            return false;
+        for (size_t kk=1; kk != 4; ++kk)
+            if (std::fabs(a.data[ii][kk] - b.data[ii][kk]) > 1e-3 * std::max(1.0, a.data[ii][0]))
+                return false;
+    }
+
+    return true;
+}// }}}
+
+static double
+total_N (const Shrink &a, size_t pass_idx)
+{// {{{
+    double N = 0.0;
+    for (size_t ii=pass_idx; ii < a.data.size(); ii += Shrink::Npasses)
+        N += a.data[ii][0];
+    return N;
+}// }}}
+
+int main ()
+{
+    Shrink shrink_reference;
+    group_particles(shrink_reference);
+
+    test::Count count_reference;
+    group_particles(count_reference);
+
+    // each pass sees fewer particles
+    bool ok = test::total_N(count_reference.data) != 0UL
+              && total_N(shrink_reference, 1UL) < total_N(shrink_reference, 0UL)
+              && total_N(shrink_reference, 2UL) < total_N(shrink_reference, 1UL);
+
+    for (bool multipass_first : { true, false })
+    {
+        Shrink shrink;
+        test::Count count;
+
+        if (multipass_first)
+            group_particles(shrink, count);
+        else
+            group_particles(count, shrink);
+
+        std::printf("%s first : %.0f / %.0f / %.0f particles in the passes, %lu in the single pass\n",
+                    (multipass_first) ? "multipass" : "single pass",
+                    total_N(shrink, 0UL), total_N(shrink, 1UL), total_N(shrink, 2UL),
+                    test::total_N(count.data));
+
+        ok = ok && same(shrink, shrink_reference) && test::same(count.data, count_reference.data);
+    }
+
+    return test::report("fused (multipass with single pass)", ok);
+}
@@ -0,0 +1,38 @@
+/* Checks that group_particles_mpi gives the same result as group_particles.
+ * To be run with several ranks, e.g. mpirun -np 4.
+ */
+
+#include "group_particles_mpi.hpp"
+
+#include "test_common.hpp"
+
+int main (int argc, char **argv)
+{
+    MPI_Init(&argc, &argv);
+
+    int rank, Nranks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &Nranks);
+
+    test::Count distributed;
+    group_particles_mpi(distributed);
+
+    int status = 0;
+
+    // only rank 0 holds the full result
+    if (rank == 0)
+    {
+        test::Count reference;
+        group_particles(reference);
+
+        std::printf("%lu particles in %lu groups on %d ranks\n",
+                    test::total_N(distributed.data), distributed.data.size(), Nranks);
+
+        status = test::report("mpi", test::total_N(reference.data)
+                                     && test::same(distributed.data, reference.data));
+    }
+
+    MPI_Finalize();
+
+    return status;
+}
@@ -0,0 +1,94 @@
+/* Checks that the particle loop runs on no more threads at the same time than OpenMP allows
+ * (as set with omp_set_num_threads), and only on the calling thread
+ * if compiled without OpenMP.
+ * In the pipeline, the loop over groups only gets its share of the threads.
+ */
+
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#ifdef _OPENMP
+#   include <omp.h>
+#endif // _OPENMP
+
+#include "test_common.hpp"
+
+struct Threads :
+    virtual public Callback<test::AF>,
+    public CallbackUtils::chunk::Multi<test::AF>,
+    public CallbackUtils::name::Illustris<test::AF, 0>,
+    public CallbackUtils::meta::Illustris<test::AF, 0>,
+    public CallbackUtils::select::LowCutoff<test::AF, IllustrisFields::Group_M_Crit200>,
+    public CallbackUtils::radius::Simple<test::AF, IllustrisFields::Group_R_Crit200>
+{
+    const bool pipeline;
+
+    std::mutex mtx;
+    std::set<std::thread::id> ids;
+
+    // threads in prt_action at the same time
+    std::atomic<size_t> Nactive { 0UL }, max_Nactive { 0UL };
+
+    Threads (bool pipeline_) :
+        pipeline { pipeline_ },
+        CallbackUtils::chunk::Multi<test::AF>("grp.%lu.hdf5", 0, "snap.%lu.hdf5", test::Nchunks-1UL),
+        CallbackUtils::select::LowCutoff<test::AF, IllustrisFields::Group_M_Crit200>(0.0F),
+        CallbackUtils::radius::Simple<test::AF, IllustrisFields::Group_R_Crit200>(2.0F)
+    { }
+
+    void grp_action (const GrpProperties &) override { }
+
+    bool prt_pipeline () const override { return pipeline; }
+
+    void prt_action (size_t, const GrpProperties &, const PrtProperties &, coord_t) override
+    {
+        const size_t N = ++Nactive;
+
+        size_t max_N = max_Nactive.load();
+        while (N > max_N && !max_Nactive.compare_exchange_weak(max_N, N));
+
+        {
+            std::lock_guard<std::mutex> lock (mtx);
+            ids.insert(std::this_thread::get_id());
+        }
+
+        --Nactive;
+    }
+};
+
+// returns whether the loop over groups ran on at most Nallowed threads at the same time
+static bool
+check (bool pipeline, int Nthreads, size_t Nallowed)
+{// {{{
+    #ifdef _OPENMP
+    omp_set_num_threads(Nthreads);
+    #endif // _OPENMP
+
+    Threads callback (pipeline);
+    group_particles(callback);
+
+    std::printf("%s : particle loop ran on up to %lu threads at once (allowed %lu)\n",
+                (pipeline) ? "pipeline" : "serial", callback.max_Nactive.load(), Nallowed);
+
+    bool ok = !callback.ids.empty() && callback.max_Nactive.load() <= Nallowed;
+
+    #ifndef _OPENMP
+    ok = ok && *callback.ids.begin() == std::this_thread::get_id();
+    #endif // _OPENMP
+
+    return ok;
+}// }}}
+
+int main ()
+{
+    #ifdef _OPENMP
+    // 8 threads are split into 1 for preparing, 2 for sorting, and 5 for the loop over groups
+    const bool ok = check(true, 8, 5UL) && check(false, 2, 2UL);
+    return test::report("threads (OpenMP)", ok);
+    #else // _OPENMP
+    const bool ok = check(true, 1, 1UL) && check(false, 1, 1UL);
+    return test::report("threads (without OpenMP)", ok);
+    #endif // _OPENMP
+}